@@ -890,6 +890,13 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.control_vectors.push_back({ std::stof(argv[i]), fname, });
         return true;
     }
+    if (arg == "--steering-vector") {
+        CHECK_ARG
+        const char * name = argv[i];
+        CHECK_ARG
+        params.steering_vectors.push_back({ name, argv[i] });
+        return true;
+    }
     if (arg == "--control-vector-layer-range") {
         CHECK_ARG
         params.control_vector_layer_start = std::stoi(argv[i]);
@@ -1170,6 +1177,36 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.use_thp = true;
         return true;
     }
+    if (arg == "--hugepages") {
+        CHECK_ARG
+        // a single mode for all buffers, or a comma separated list of role=mode, e.g. weights=1G,kv=2M
+        auto parse_mode = [](const std::string & mode, llama_hugepages & result) {
+            /**/ if (mode == "none") { result = LLAMA_HUGEPAGES_NONE; }
+            else if (mode == "thp")  { result = LLAMA_HUGEPAGES_THP;  }
+            else if (mode == "2M")   { result = LLAMA_HUGEPAGES_2M;   }
+            else if (mode == "1G")   { result = LLAMA_HUGEPAGES_1G;   }
+            else { return false; }
+            return true;
+        };
+        for (const auto & item : string_split(std::string(argv[i]), ',')) {
+            const size_t eq = item.find('=');
+            if (eq == std::string::npos) {
+                llama_hugepages mode;
+                if (!parse_mode(item, mode)) { invalid_param = true; break; }
+                params.hugepages_weights = params.hugepages_kv = params.hugepages_compute = mode;
+                continue;
+            }
+            const std::string role = item.substr(0, eq);
+            llama_hugepages * target = role == "weights" ? &params.hugepages_weights
+                                     : role == "kv"      ? &params.hugepages_kv
+                                     : role == "compute" ? &params.hugepages_compute : nullptr;
+            if (!target || !parse_mode(item.substr(eq + 1), *target)) {
+                invalid_param = true;
+                break;
+            }
+        }
+        return true;
+    }
     if (arg == "-vq" || arg == "--validate-quants") {
         params.validate_quants = true;
         return true;
@@ -1183,6 +1220,29 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         else { invalid_param = true; }
         return true;
     }
+    if (arg == "--cpu-cores") {
+        CHECK_ARG
+        // comma separated list of cores and core ranges, e.g. 0-7,16-23
+        params.cpu_cores.clear();
+        for (const auto & item : string_split(std::string(argv[i]), ',')) {
+            const size_t dash = item.find('-');
+            const int first = std::stoi(item.substr(0, dash));
+            const int last  = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            if (first < 0 || last < first) {
+                invalid_param = true;
+                break;
+            }
+            for (int core = first; core <= last; ++core) {
+                params.cpu_cores.push_back(core);
+            }
+        }
+        return true;
+    }
+    if (arg == "--cpu-priority") {
+        CHECK_ARG
+        params.cpu_priority = std::stoi(argv[i]);
+        return true;
+    }
     if (arg == "-v" || arg == "--verbose") {
         params.verbosity = 1;
         return true;
@@ -1382,6 +1442,29 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.only_active_exps = true;
         return true;
     }
+    if (arg == "--logits-zero-copy") {
+        params.logits_zero_copy = true;
+        return true;
+    }
+    if (arg == "--lazy-k-shift") {
+        params.lazy_k_shift = true;
+        return true;
+    }
+    if (arg == "--output-head-rank") {
+        CHECK_ARG
+        params.output_head_rank = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--output-head-top") {
+        CHECK_ARG
+        params.output_head_top = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--output-head-min-mass") {
+        CHECK_ARG
+        params.output_head_min_mass = std::stof(argv[i]);
+        return true;
+    }
     if (arg == "--host") {
         CHECK_ARG
         params.hostname = argv[i];
@@ -1481,6 +1564,16 @@ bool gpt_params_find_arg(int argc, char ** argv, const std::string & arg, gpt_pa
         params.endpoint_metrics = true;
         return true;
     }
+    if (arg == "--trace") {
+        CHECK_ARG
+        params.n_trace = std::stoi(argv[i]);
+        return true;
+    }
+    if (arg == "--trace-file") {
+        CHECK_ARG
+        params.trace_file = argv[i];
+        return true;
+    }
     if (arg == "--slot-save-path") {
         CHECK_ARG
         params.slot_save_path = argv[i];
@@ -1794,6 +1887,12 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "*",           "-fmoe, --fused-moe",            "enable fused MoE (default: %s)", params.fused_moe_up_gate ? "enabled" : "disabled" });
     options.push_back({ "*",           "-no-fug, --no-fused-up-gate",   "disaable fused up-gate (default: %s)", params.fused_up_gate ? "enabled" : "disabled" });
     options.push_back({ "*",         "-ser,  --smart-expert-reduction,","experts reduction (default: %d,%g)", params.min_experts, params.thresh_experts});
+    options.push_back({ "*",           "       --logits-zero-copy",     "read logits directly from the compute buffer when it is in host memory (default: %s)", params.logits_zero_copy ? "enabled" : "disabled" });
+    options.push_back({ "*",           "       --lazy-k-shift",         "apply K-shifts in the next decode instead of in a separate graph (default: %s)", params.lazy_k_shift ? "enabled" : "disabled" });
+    options.push_back({ "*",           "       --output-head-rank N",   "use a two-stage output head with a rank-N approximation of the output matrix (default: %d, 0 = disabled)", params.output_head_rank });
+    options.push_back({ "*",           "       --output-head-top N",    "number of candidates per output for which exact logits are computed (default: %d)", params.output_head_top });
+    options.push_back({ "*",           "       --output-head-min-mass F",
+                                                                        "recompute all logits if the candidates carry less probability mass than this (default: %.2f)", (double)params.output_head_min_mass });
     options.push_back({ "*",           "-p,    --prompt PROMPT",        "prompt to start generation with\n"
                                                                         "in conversation mode, this will be used as system prompt\n"
                                                                         "(default: '%s')", params.prompt.c_str() });
@@ -1951,6 +2050,12 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
                                                                         "  - numactl: use the CPU map provided by numactl\n"
                                                                         "if run without this previously, it is recommended to drop the system page cache before using this\n"
                                                                         "see https://github.com/ggerganov/llama.cpp/issues/1437" });
+    options.push_back({ "*",           "       --cpu-cores LIST",       "pin compute threads to these cores, e.g. 0-7,16-23 (default: none)\n"
+                                                                        "contexts using the same cores share them and compute one at a time" });
+    options.push_back({ "*",           "       --cpu-priority N",       "priority when sharing cores with other contexts (default: %d)", params.cpu_priority });
+    options.push_back({ "*",           "       --hugepages SPEC",       "back CPU buffers with huge pages: none, thp, 2M or 1G for all of them, or per buffer\n"
+                                                                        "as a list of weights=,kv=,compute= (e.g. weights=1G,kv=2M). 2M/1G use the hugetlbfs\n"
+                                                                        "pool and fall back to thp when it is too small. Weights are then not mmapped (default: none)" });
 
     if (llama_supports_gpu_offload()) {
         options.push_back({ "*",           "-ngl,  --gpu-layers N",
@@ -2039,6 +2144,11 @@ void gpt_params_print_usage(int /*argc*/, char ** argv, const gpt_params & param
     options.push_back({ "server",      "       --log-format {text,json}",
                                                                         "log output format: json or text (default: json)" });
     options.push_back({ "server",      "       --metrics",              "enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled" });
+    options.push_back({ "server",      "       --trace N",              "record per-request timelines and keep the last N per slot for /trace/{id} (default: %d)", params.n_trace });
+    options.push_back({ "server",      "       --trace-file FNAME",     "append finished request timelines to FNAME as OTLP JSON lines (default: disabled)" });
+    options.push_back({ "server",      "       --steering-vector NAME FNAME",
+                                                                        "load a control vector that requests can select with \"steering_vector\": NAME\n"
+                                                                        "note: this argument can be repeated to add multiple steering vectors" });
     options.push_back({ "server",      "       --no-slots",             "disables slots monitoring endpoint (default: %s)", params.endpoint_slots ? "enabled" : "disabled" });
     options.push_back({ "server",      "       --slot-save-path PATH",  "path to save slot kv cache (default: disabled)" });
     options.push_back({ "server",      "       --chat-template JINJA_TEMPLATE",
@@ -2604,6 +2714,11 @@ struct llama_init_result llama_init_from_gpt_params(gpt_params & params) {
     if (params.warmup) {
         LOG("warming up the model with an empty run\n");
 
+        if (params.use_mmap && !params.use_mlock) {
+            // read the weights ahead of the warmup run, so that it does not fault them in one page at a time
+            llama_model_prefetch(model, false);
+        }
+
         std::vector<llama_token> tmp;
         llama_token bos = llama_token_bos(model);
         llama_token eos = llama_token_eos(model);
@@ -2662,6 +2777,7 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.check_tensors   = params.check_tensors;
     mparams.repack_tensors  = params.repack_tensors;
     mparams.use_thp         = params.use_thp;
+    mparams.hugepages_weights = params.hugepages_weights;
     mparams.validate_quants = params.validate_quants;
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -2751,6 +2867,17 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.min_experts       = params.min_experts;
     cparams.thresh_experts    = params.thresh_experts;
     cparams.only_active_experts = params.only_active_exps;
+    cparams.logits_zero_copy  = params.logits_zero_copy;
+    cparams.output_head_rank     = params.output_head_rank;
+    cparams.output_head_top      = params.output_head_top;
+    cparams.output_head_min_mass = params.output_head_min_mass;
+    cparams.cpu_priority         = params.cpu_priority;
+    cparams.lazy_k_shift         = params.lazy_k_shift;
+    cparams.hugepages_kv      = params.hugepages_kv;
+    cparams.hugepages_compute = params.hugepages_compute;
+    if (!params.cpu_cores.empty()) {
+        cparams.cpu_partition = llama_cpu_partition_add(params.cpu_cores.data(), params.cpu_cores.size());
+    }
 
     cparams.type_k = kv_cache_type_from_str(params.cache_type_k);
     cparams.type_v = kv_cache_type_from_str(params.cache_type_v);
@@ -3465,6 +3592,152 @@ void llama_kv_cache_dump_view_seqs(const llama_kv_cache_view & view, int row_siz
     printf("\n=== Done dumping\n");
 }
 
+//
+// Chunk cache (block attention)
+//
+
+static uint64_t llama_chunk_hash(const std::vector<llama_token> & tokens) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (llama_token t : tokens) {
+        for (int i = 0; i < 4; ++i) {
+            hash ^= (uint8_t)((uint32_t)t >> 8*i);
+            hash *= 0x100000001b3ULL;
+        }
+    }
+    return hash;
+}
+
+// decode tokens at positions [pos, pos + tokens.size()) of seq_id without outputs
+static bool llama_chunk_decode(llama_context * ctx, const llama_token * tokens, int32_t n_tokens, llama_seq_id seq_id,
+        llama_pos pos, int32_t n_batch) {
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+    bool ok = true;
+    for (int32_t i = 0; i < n_tokens && ok; i += n_batch) {
+        llama_batch_clear(batch);
+        for (int32_t j = i; j < std::min(i + n_batch, n_tokens); ++j) {
+            llama_batch_add(batch, tokens[j], pos + j, { seq_id }, false);
+        }
+        ok = llama_decode(ctx, batch) == 0;
+    }
+    llama_batch_free(batch);
+    return ok;
+}
+
+static void llama_chunk_cache_evict(llama_context * ctx, llama_chunk_cache & cache, uint64_t hash) {
+    llama_kv_cache_seq_rm(ctx, cache.entries.at(hash).seq_id, -1, -1);
+    cache.entries.erase(hash);
+}
+
+// the least recently used entry, entries.end() if the cache is empty
+static std::unordered_map<uint64_t, llama_chunk_cache_entry>::iterator llama_chunk_cache_lru(llama_chunk_cache & cache) {
+    auto lru = cache.entries.end();
+    for (auto it = cache.entries.begin(); it != cache.entries.end(); ++it) {
+        if (lru == cache.entries.end() || it->second.last_use < lru->second.last_use) {
+            lru = it;
+        }
+    }
+    return lru;
+}
+
+bool llama_chunk_cache_init(llama_context * ctx, llama_chunk_cache & cache, llama_seq_id seq_id_first, int32_t n_seq) {
+    cache = llama_chunk_cache();
+    if (n_seq <= 0) {
+        return true;
+    }
+    const uint32_t n_seq_max = llama_n_seq_max(ctx);
+    if (seq_id_first < 0 || (uint32_t) seq_id_first + n_seq > n_seq_max) {
+        fprintf(stderr, "%s: error: sequences [%d, %d) are out of range [0, %u)\n", __func__, seq_id_first, seq_id_first + n_seq, n_seq_max);
+        return false;
+    }
+    cache.seq_id_first = seq_id_first;
+    cache.n_seq        = n_seq;
+    return true;
+}
+
+void llama_chunk_cache_clear(llama_context * ctx, llama_chunk_cache & cache) {
+    for (const auto & it : cache.entries) {
+        llama_kv_cache_seq_rm(ctx, it.second.seq_id, -1, -1);
+    }
+    cache.entries.clear();
+}
+
+bool llama_chunk_cache_append(
+                   llama_context * ctx,
+               llama_chunk_cache & cache,
+  const std::vector<llama_token> & chunk,
+                    llama_seq_id   seq_id,
+                       llama_pos   pos,
+                         int32_t   n_recompute,
+                         int32_t   n_batch) {
+    if (seq_id < 0 || (uint32_t) seq_id >= llama_n_seq_max(ctx) ||
+        (seq_id >= cache.seq_id_first && seq_id < cache.seq_id_first + cache.n_seq)) {
+        fprintf(stderr, "%s: error: invalid seq_id %d\n", __func__, seq_id);
+        return false;
+    }
+    if (chunk.empty()) {
+        return true;
+    }
+    if (cache.n_seq <= 0) {
+        return llama_chunk_decode(ctx, chunk.data(), chunk.size(), seq_id, pos, n_batch);
+    }
+
+    const uint64_t hash = llama_chunk_hash(chunk);
+
+    auto it = cache.entries.find(hash);
+    if (it != cache.entries.end() && it->second.tokens != chunk) {
+        // hash collision
+        llama_chunk_cache_evict(ctx, cache, hash);
+        it = cache.entries.end();
+    }
+
+    if (it != cache.entries.end()) {
+        cache.n_hit++;
+    } else {
+        cache.n_miss++;
+
+        // find a free sequence, evicting the least recently used chunk if there is none
+        std::vector<bool> used(cache.n_seq, false);
+        for (const auto & e : cache.entries) {
+            used[e.second.seq_id - cache.seq_id_first] = true;
+        }
+        int32_t free = std::find(used.begin(), used.end(), false) - used.begin();
+        if (free == cache.n_seq) {
+            auto lru = llama_chunk_cache_lru(cache);
+            free = lru->second.seq_id - cache.seq_id_first;
+            llama_chunk_cache_evict(ctx, cache, lru->first);
+        }
+
+        const llama_seq_id chunk_seq_id = cache.seq_id_first + free;
+        if (!llama_chunk_decode(ctx, chunk.data(), chunk.size(), chunk_seq_id, 0, n_batch)) {
+            llama_kv_cache_seq_rm(ctx, chunk_seq_id, -1, -1);
+            return false;
+        }
+        it = cache.entries.emplace(hash, llama_chunk_cache_entry{ chunk_seq_id, chunk, 0 }).first;
+    }
+    it->second.last_use = ++cache.n_use;
+
+    // splice the chunk into the sequence, making room by evicting other chunks if needed
+    while (llama_kv_cache_seq_cp_shift(ctx, it->second.seq_id, seq_id, -1, -1, pos) < 0) {
+        auto lru = llama_chunk_cache_lru(cache);
+        if (lru == it) {
+            return false;
+        }
+        llama_chunk_cache_evict(ctx, cache, lru->first);
+    }
+
+    // let the start of the chunk attend to the preceding tokens
+    n_recompute = std::min<int32_t>(n_recompute, chunk.size());
+    if (n_recompute > 0 && pos > 0) {
+        llama_kv_cache_seq_rm(ctx, seq_id, pos, pos + n_recompute);
+        if (!llama_chunk_decode(ctx, chunk.data(), n_recompute, seq_id, pos, n_batch)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 //
 // Embedding utils
 //
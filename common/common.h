@@ -127,6 +127,15 @@ struct gpt_params {
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    std::vector<int32_t> cpu_cores;    // cores of the CPU partition to compute on (empty = no partition)
+    int32_t              cpu_priority = 0; // priority within the CPU partition
+
+    enum llama_hugepages hugepages_weights = LLAMA_HUGEPAGES_NONE; // huge pages for CPU buffers (linux only)
+    enum llama_hugepages hugepages_kv      = LLAMA_HUGEPAGES_NONE;
+    enum llama_hugepages hugepages_compute = LLAMA_HUGEPAGES_NONE;
+
+    bool lazy_k_shift = false; // apply K-shifts in the next decode instead of in a separate graph
+
     enum llama_split_mode        split_mode        = LLAMA_SPLIT_MODE_LAYER; // how to split the model across GPUs
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
@@ -167,6 +176,8 @@ struct gpt_params {
 
     std::vector<llama_control_vector_load_info> control_vectors; // control vector with user defined scale
 
+    std::vector<std::pair<std::string, std::string>> steering_vectors; // name and file of vectors selectable per request
+
     int32_t verbosity                  = 0;
     int32_t control_vector_layer_start = -1; // layer range for control vector
     int32_t control_vector_layer_end   = -1; // layer range for control vector
@@ -224,6 +235,11 @@ struct gpt_params {
     bool use_thp           = false; // use transparent huge pages (linux only)
     bool validate_quants   = false; // if true, check for NaNs while loading the model
     bool only_active_exps  = false; // if true, offload only active experts (relevant only for hybrid CPU/GPU)
+    bool logits_zero_copy  = false; // if true, read logits directly from the compute buffer when possible
+
+    int32_t output_head_rank     = 0;     // rank of the two-stage output head (0 = disabled)
+    int32_t output_head_top      = 1024;  // number of candidates for which exact logits are computed
+    float   output_head_min_mass = 0.99f; // recompute exactly if the candidates carry less probability mass
 
     std::string cache_type_k = "f16"; // KV cache data type for the K
     std::string cache_type_v = "f16"; // KV cache data type for the V
@@ -270,6 +286,9 @@ struct gpt_params {
     bool endpoint_props   = false; // only control POST requests, not GET
     bool endpoint_metrics = false;
 
+    int32_t     n_trace = 0; // finished request traces kept per slot for /trace, 0 = none
+    std::string trace_file;  // append finished request traces as OTLP JSON lines
+
     bool log_json = false;
 
     std::string slot_save_path;
@@ -539,6 +558,52 @@ void llama_kv_cache_dump_view(const llama_kv_cache_view & view, int row_size = 8
 // Dump the KV cache view showing individual sequences in each cell (long output).
 void llama_kv_cache_dump_view_seqs(const llama_kv_cache_view & view, int row_size = 40);
 
+//
+// Chunk cache (block attention)
+//
+// Document chunks (e.g. RAG passages) are prefilled once, on their own at positions [0, n), into sequences
+// reserved for the cache. A chunk appended to a prompt is copied from there into the prompt's sequence at
+// the prompt position, so a document that shows up in several prompts is only prefilled once.
+// The copied chunk has not attended to the preceding tokens of the prompt; re-decoding its first
+// n_recompute tokens in place recovers most of the quality lost at the chunk boundary.
+//
+
+struct llama_chunk_cache_entry {
+    llama_seq_id             seq_id;
+    std::vector<llama_token> tokens;
+    uint64_t                 last_use;
+};
+
+struct llama_chunk_cache {
+    llama_seq_id seq_id_first = 0; // sequences [seq_id_first, seq_id_first + n_seq) belong to the cache
+    int32_t      n_seq        = 0;
+
+    uint64_t n_use  = 0;
+    uint64_t n_hit  = 0;
+    uint64_t n_miss = 0;
+
+    std::unordered_map<uint64_t, llama_chunk_cache_entry> entries; // by hash of the chunk tokens
+};
+
+// reserve the sequences [seq_id_first, seq_id_first + n_seq) for the cache, n_seq is the max number of cached chunks
+// returns false (and leaves the cache disabled) if the sequences are not within [0, llama_n_seq_max(ctx))
+bool llama_chunk_cache_init(llama_context * ctx, llama_chunk_cache & cache, llama_seq_id seq_id_first, int32_t n_seq);
+
+// drop all cached chunks and remove their sequences from the KV cache
+void llama_chunk_cache_clear(llama_context * ctx, llama_chunk_cache & cache);
+
+// append the chunk to sequence seq_id at positions [pos, pos + chunk.size()), prefilling it first if it is not cached
+// returns false if seq_id is invalid or belongs to the cache, the chunk could not be decoded or there is no space for
+// it in the KV cache
+bool llama_chunk_cache_append(
+                   llama_context * ctx,
+               llama_chunk_cache & cache,
+  const std::vector<llama_token> & chunk,
+                    llama_seq_id   seq_id,
+                       llama_pos   pos,
+                         int32_t   n_recompute,
+                         int32_t   n_batch);
+
 //
 // Embedding utils
 //
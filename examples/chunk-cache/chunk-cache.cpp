@@ -0,0 +1,203 @@
+#include "common.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static void print_usage(int argc, char ** argv, const gpt_params & params) {
+    gpt_params_print_usage(argc, argv, params);
+
+    LOG_TEE("\nexample usage:\n");
+    LOG_TEE("\n    %s -m model.gguf --context-file doc1.txt --context-file doc2.txt --context-file doc3.txt -p \"Question: ...\" --top-k 2 -ns 8 [--keep 4]\n", argv[0]);
+    LOG_TEE("\n");
+}
+
+struct request_result {
+    llama_token token    = -1; // greedy first answer token
+    int32_t     n_prompt = 0;
+    int64_t     t_us     = 0;
+};
+
+// assembles system prompt + documents + question in sequence 0 and returns the greedy next token
+static request_result run_request(
+                                llama_context * ctx,
+                            llama_chunk_cache & cache,
+               const std::vector<llama_token> & system,
+  const std::vector<std::vector<llama_token>> & docs,
+                    const std::vector<size_t> & order,
+               const std::vector<llama_token> & question,
+                                      int32_t   n_recompute,
+                                      int32_t   n_batch) {
+    request_result res;
+
+    const int64_t t_start = ggml_time_us();
+
+    // the system prompt stays in sequence 0, everything after it is dropped
+    llama_kv_cache_seq_rm(ctx, 0, system.size(), -1);
+
+    llama_pos pos = system.size();
+    for (size_t i : order) {
+        if (!llama_chunk_cache_append(ctx, cache, docs[i], 0, pos, n_recompute, n_batch)) {
+            fprintf(stderr, "%s: failed to append document %zu\n", __func__, i);
+            return res;
+        }
+        pos += docs[i].size();
+    }
+
+    llama_batch batch = llama_batch_init(std::max<size_t>(question.size(), 1), 0, 1);
+    for (size_t i = 0; i < question.size(); ++i) {
+        llama_batch_add(batch, question[i], pos + i, { 0 }, i == question.size() - 1);
+    }
+    if (llama_decode(ctx, batch) == 0) {
+        const float * logits = llama_get_logits_ith(ctx, batch.n_tokens - 1);
+        res.token = std::max_element(logits, logits + llama_n_vocab(llama_get_model(ctx))) - logits;
+    } else {
+        fprintf(stderr, "%s: failed to decode the question\n", __func__);
+    }
+    llama_batch_free(batch);
+
+    res.n_prompt = pos + question.size();
+    res.t_us     = ggml_time_us() - t_start;
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    gpt_params params;
+
+    params.sparams.top_k = 3;
+    params.n_sequences   = 8;
+    params.n_keep        = 0;
+
+    if (!gpt_params_parse(argc, argv, params)) {
+        print_usage(argc, argv, params);
+        return 1;
+    }
+
+    if (params.context_files.empty()) {
+        fprintf(stderr, "%s: at least one --context-file is needed, each file is one document\n", __func__);
+        return 1;
+    }
+
+    const int32_t n_docs      = params.context_files.size();
+    const int32_t n_per_req   = std::min(std::max(params.sparams.top_k, 1), n_docs);
+    const int32_t n_recompute = params.n_keep;
+
+    std::vector<std::string> doc_texts;
+    for (const auto & fname : params.context_files) {
+        std::ifstream f(fname);
+        if (!f) {
+            fprintf(stderr, "%s: failed to open %s\n", __func__, fname.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        doc_texts.push_back(ss.str());
+    }
+
+    // sequence 0 holds the prompt, sequences [1, 1 + n_docs) hold the cached documents
+    params.n_parallel = 1 + n_docs;
+
+    print_build_info();
+
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    llama_init_result llama_init = llama_init_from_gpt_params(params);
+
+    llama_model * model = llama_init.model;
+    llama_context * ctx = llama_init.context;
+    if (model == NULL || ctx == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    const std::vector<llama_token> system   = ::llama_tokenize(ctx, params.system_prompt, true, true);
+    const std::vector<llama_token> question = ::llama_tokenize(ctx, params.prompt, system.empty(), true);
+
+    std::vector<std::vector<llama_token>> docs;
+    for (const auto & text : doc_texts) {
+        docs.push_back(::llama_tokenize(ctx, text, false, false));
+    }
+
+    if (question.empty()) {
+        fprintf(stderr, "%s: the question (-p) is empty\n", __func__);
+        return 1;
+    }
+
+    // the documents of each request, in random order
+    std::mt19937 rng(params.seed == LLAMA_DEFAULT_SEED ? 1234 : params.seed);
+    std::vector<std::vector<size_t>> orders(params.n_sequences);
+    for (auto & order : orders) {
+        std::vector<size_t> all(n_docs);
+        for (int32_t i = 0; i < n_docs; ++i) {
+            all[i] = i;
+        }
+        std::shuffle(all.begin(), all.end(), rng);
+        order.assign(all.begin(), all.begin() + n_per_req);
+    }
+
+    LOG_TEE("\n%s: %d documents, %d per request, %d requests, %d recomputed tokens per document\n",
+            __func__, n_docs, n_per_req, params.n_sequences, n_recompute);
+
+    // the same requests with the documents decoded in place (no cache) and spliced from the cache
+    std::vector<request_result> results[2];
+    for (int use_cache = 0; use_cache < 2; ++use_cache) {
+        llama_kv_cache_clear(ctx);
+        if (!system.empty()) {
+            llama_batch batch = llama_batch_get_one(const_cast<llama_token *>(system.data()), system.size(), 0, 0);
+            if (llama_decode(ctx, batch) != 0) {
+                fprintf(stderr, "%s: failed to decode the system prompt\n", __func__);
+                return 1;
+            }
+        }
+
+        llama_chunk_cache cache;
+        if (!llama_chunk_cache_init(ctx, cache, 1, use_cache ? n_docs : 0)) {
+            return 1;
+        }
+
+        for (const auto & order : orders) {
+            results[use_cache].push_back(run_request(ctx, cache, system, docs, order, question, n_recompute, params.n_batch));
+        }
+
+        int64_t t_us = 0;
+        for (const auto & res : results[use_cache]) {
+            t_us += res.t_us;
+        }
+        LOG_TEE("%s: %-8s total %8.2f ms", __func__, use_cache ? "cache" : "no cache", t_us/1000.0);
+        if (use_cache) {
+            LOG_TEE(", %llu hits, %llu misses", (unsigned long long) cache.n_hit, (unsigned long long) cache.n_miss);
+        }
+        LOG_TEE("\n");
+
+        llama_chunk_cache_clear(ctx, cache);
+    }
+
+    int n_same = 0;
+    for (int i = 0; i < params.n_sequences; ++i) {
+        const auto & a = results[0][i];
+        const auto & b = results[1][i];
+        if (a.token < 0 || b.token < 0) {
+            return 1;
+        }
+        n_same += a.token == b.token;
+        LOG_TEE("request %2d: %5d tokens, %8.2f ms -> %8.2f ms, next token '%s' / '%s'\n", i, b.n_prompt,
+                a.t_us/1000.0, b.t_us/1000.0, llama_token_to_piece(ctx, a.token).c_str(), llama_token_to_piece(ctx, b.token).c_str());
+    }
+    LOG_TEE("\n%s: same next token in %d of %d requests\n", __func__, n_same, params.n_sequences);
+
+    llama_print_timings(ctx);
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return 0;
+}
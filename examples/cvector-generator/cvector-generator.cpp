@@ -20,6 +20,7 @@
 #include <iostream>
 #include <fstream>
 #include <climits>
+#include <cmath>
 
 
 //////////////////////////////////////////////////
@@ -49,127 +50,6 @@ static void print_usage(int argc, char ** argv, const gpt_params & params) {
 //////////////////////////////////////////////////
 
 
-// cb_eval is reused for each pair of positive - negative prompt
-struct callback_data {
-    ggml_context * ctx_ggml = nullptr;   // holds v_pos, v_neg, v_diff_filtered
-
-    int n_layers = 0;
-    int n_tokens = 0;
-    bool is_eval_pos = true;
-
-    // each element of the vector correspond to one layer
-    std::vector<struct ggml_tensor *> v_pos; // vector of matrices of size [n_embd, n_tokens]
-    std::vector<struct ggml_tensor *> v_neg; // vector of matrices of size [n_embd, n_tokens]
-    std::vector<struct ggml_tensor *> v_diff_filtered;   // vector of matrices of size [n_embd, n_nonzero_rows]. NOTE: n_nonzero_rows maybe different for each layer
-
-    // save a tensor into either v_pos or v_neg (decided by is_eval_pos)
-    void save_tensor_for_layer(struct ggml_tensor * t) {
-        GGML_ASSERT(t->type == GGML_TYPE_F32);
-
-        if (ctx_ggml == nullptr) {
-            // alloc a new ctx_ggml if needed
-            struct ggml_init_params params_ggml = {
-                /*.mem_size   =*/ ggml_tensor_overhead() * n_layers * 3u,
-                /*.mem_buffer =*/ NULL,
-                /*.no_alloc   =*/ true,
-            };
-            ctx_ggml = ggml_init(params_ggml);
-        }
-
-        // copy tensor data
-        auto n_bytes = ggml_nbytes(t);
-        struct ggml_tensor * t_layer = ggml_new_tensor_2d(ctx_ggml, t->type, t->ne[0], t->ne[1]);
-        t_layer->data = malloc(n_bytes); // TODO @ngxson : get rid of this malloc somehow
-        ggml_backend_tensor_get(t, t_layer->data, 0, n_bytes);
-        ggml_set_name(t_layer, ggml_get_name(t));
-        //print_debug_tensor(t_layer);
-
-        if (is_eval_pos) {
-            v_pos.push_back(t_layer);
-        } else {
-            v_neg.push_back(t_layer);
-        }
-    }
-
-    // calculate diff (v_pos - v_neg) and place the result back to v_pos
-    // all zero rows in the diff tensor will also be removed
-    // NOTE: final layer is ignored. we only have (n_layers - 1) to process
-    std::vector<struct ggml_tensor *> calc_diff() {
-        for (float il = 0; il < v_pos.size(); il++) {
-            float * a = (float *) v_pos[il]->data;
-            float * b = (float *) v_neg[il]->data;
-            size_t n_elem = ggml_nelements(v_pos[il]);
-            for (size_t j = 0; j < n_elem; j++) {
-                a[j] -= b[j];
-            }
-            //print_debug_tensor(v_pos[i]);
-            auto diff_filtered = filter_nonzero_rows(v_pos[il]);
-            v_diff_filtered.push_back(diff_filtered);
-        }
-        return v_diff_filtered; // for convinient, we return the result std::vector
-    }
-
-    // delete zero rows from a given 2D tensor
-    struct ggml_tensor * filter_nonzero_rows(struct ggml_tensor * a) {
-        //printf("filter_nonzero_rows\n");
-        auto is_row_all_zeros = [](struct ggml_tensor * t, int row, float eps) -> bool {
-            // check if given row containing all zero elements
-            int n_cols = t->ne[0]; // hint: should be equal to n_embd
-            for (int col = 0; col < n_cols; ++col) {
-                if (ggml_get_f32_nd(t, col, row, 0, 0) > eps) {
-                    return false;
-                }
-            }
-            return true;
-        };
-        std::vector<int> rows_to_copy; // the idx of non-zero cols (to be copied to row of diff_filtered)
-        for (int i_row = 0; i_row < a->ne[1]; i_row++) {
-            if (!is_row_all_zeros(a, i_row, 1e-6)) {
-                rows_to_copy.push_back(i_row);
-            }
-        }
-
-        // get "n_nonzero_rows" for the output "diff_filtered"
-        int n_nonzero_rows = rows_to_copy.size();
-        //printf("n_nonzero_rows: %d\n", n_nonzero_rows);
-        int n_embd = a->ne[0];
-        GGML_ASSERT(n_nonzero_rows > 0);
-
-        // diff_filtered: [n_embd, n_nonzero_rows]
-        struct ggml_tensor * diff_filtered = ggml_new_tensor_2d(
-            ctx_ggml, GGML_TYPE_F32, n_embd, n_nonzero_rows);
-        ggml_format_name(diff_filtered, "diff_filtered_%s", a->name);
-        diff_filtered->data = malloc(ggml_nbytes(diff_filtered));
-
-        // copy non-zero rows
-        for (int dest_row = 0; dest_row < n_nonzero_rows; dest_row++) {
-            int src_row = rows_to_copy[dest_row];
-            for (int i = 0; i < n_embd; i++) {
-                float src_elem = ggml_get_f32_nd(a, i, src_row, 0, 0);
-                ggml_set_f32_nd(diff_filtered, i, dest_row, 0, 0, src_elem);
-            }
-        }
-
-        //print_debug_tensor(diff_filtered);
-
-        return diff_filtered;
-    }
-
-    // we don't implement destructor, because we want to reuse callback_data. we just want to free the tensors
-    void reset() {
-        for (auto ptr : v_pos) free(ptr->data);
-        for (auto ptr : v_neg) free(ptr->data);
-        for (auto ptr : v_diff_filtered) free(ptr->data);
-        v_pos.clear();
-        v_neg.clear();
-        v_diff_filtered.clear();
-        if (ctx_ggml) {
-            ggml_free(ctx_ggml);
-        }
-        ctx_ggml = nullptr;
-    }
-};
-
 /**
  * process_ctx is used to store the ggml context for pre-post processing the diff vectors
  * in short, input => v_diff and output => v_final
@@ -189,7 +69,7 @@ struct train_context {
     std::vector<struct ggml_tensor *> v_diff;  // vector of matrices of size [m, n_embd] where m ~ n_tokens * n_completions (v_diff contains no zero-rows)
     std::vector<struct ggml_tensor *> v_final; // vector of vectors of size [n_embd] to be written to file
 
-    // to easily re-alloc when concat v_diff, we temporary store v_diff in a vector instead of a tensor
+    // the diff rows are appended to v_diff_tmp by cb_eval while the prompts are evaluated
     // v_diff_tmp will get converted unto v_diff later on
     std::vector<std::vector<uint8_t>> v_diff_tmp;
 
@@ -211,18 +91,6 @@ struct train_context {
         }
     }
 
-    // add new rows into existing tensor in v_diff_tmp
-    void concat_diff_tmp(const std::vector<struct ggml_tensor *> & diff_filtered) {
-        GGML_ASSERT((int) diff_filtered.size() == n_layers - 1);
-        for (int il = 0; il < n_layers - 1; il++) {
-            auto t = diff_filtered[il];
-            auto & diff_tmp = v_diff_tmp[il];
-            size_t curr_size = diff_tmp.size();
-            diff_tmp.resize(curr_size + ggml_nbytes(t));
-            memcpy(diff_tmp.data() + curr_size, t->data, ggml_nbytes(t));
-        }
-    }
-
     // build the v_diff tensors from v_diff_tmp (v_diff need to be transposed)
     // TODO @ngxson : maybe add option NOT to transpose v_diff; will be useful for "mean" method
     void build_v_diff(bool transpose) {
@@ -239,11 +107,11 @@ struct train_context {
             diff->data = malloc(ggml_nbytes(diff)); // TODO: get rid of this malloc if possible
             if (transpose) {
                 // copy data & transpose
-                float * arr = (float *) diff_tmp.data();
+                const float * arr = (const float *) diff_tmp.data();
+                float * dst = (float *) diff->data;
                 for (int ir = 0; ir < n_rows; ++ir) {
                     for (int ic = 0; ic < n_embd; ++ic) {
-                        float f = arr[ir*n_embd + ic];
-                        ggml_set_f32_nd(diff, ir, ic, 0, 0, f);
+                        dst[ic*n_rows + ir] = arr[ir*n_embd + ic];
                     }
                 }
             } else {
@@ -253,7 +121,7 @@ struct train_context {
             v_diff.push_back(diff);
             print_debug_tensor(diff);
             // free memory of diff_tmp
-            diff_tmp.resize(0);
+            std::vector<uint8_t>().swap(diff_tmp);
         }
     }
 
@@ -265,23 +133,72 @@ struct train_context {
     }
 };
 
+// cb_eval receives the l_out tensors of a batch of prompt pairs. the positive and negative prompt of a pair are
+// evaluated as two sequences of the same batch, so the diff rows are computed right away and appended to ctx_train
+struct callback_data {
+    train_context * ctx_train = nullptr;
+
+    int n_layers = 0;
+    int n_tokens = 0; // number of tokens in the current batch
+
+    // position of the positive prompt of each pair in the current batch; the negative prompt follows it
+    std::vector<int> pair_pos;
+    std::vector<int> pair_len;
+
+    std::vector<uint8_t> buf; // host copy of l_out if it is not in host memory
+
+    // append (pos - neg) rows of all pairs in the batch to the layer, skipping all zero rows
+    void append_diff(int il, const struct ggml_tensor * t) {
+        GGML_ASSERT(t->type == GGML_TYPE_F32);
+
+        const uint8_t * data = (const uint8_t *) t->data;
+        if (!ggml_backend_buffer_is_host(t->buffer)) {
+            buf.resize(ggml_nbytes(t));
+            ggml_backend_tensor_get(t, buf.data(), 0, ggml_nbytes(t));
+            data = buf.data();
+        }
+
+        const int n_embd = t->ne[0];
+        auto & diff_tmp = ctx_train->v_diff_tmp[il];
+        for (size_t ip = 0; ip < pair_pos.size(); ++ip) {
+            for (int j = 0; j < pair_len[ip]; ++j) {
+                const float * a = (const float *) (data + (pair_pos[ip] + j)*t->nb[1]);
+                const float * b = (const float *) (data + (pair_pos[ip] + pair_len[ip] + j)*t->nb[1]);
+                bool is_zero = true;
+                for (int i = 0; i < n_embd && is_zero; ++i) {
+                    is_zero = std::fabs(a[i] - b[i]) <= 1e-6f;
+                }
+                if (is_zero) {
+                    continue;
+                }
+                const size_t curr_size = diff_tmp.size();
+                diff_tmp.resize(curr_size + n_embd*sizeof(float));
+                float * row = (float *) (diff_tmp.data() + curr_size);
+                for (int i = 0; i < n_embd; ++i) {
+                    row[i] = a[i] - b[i];
+                }
+            }
+        }
+    }
+};
+
 struct tokenized_prompt {
     std::vector<llama_token> tokens_pos;
     std::vector<llama_token> tokens_neg;
     size_t max_seq_len;
 
-    tokenized_prompt(llama_context * ctx, std::string pos, std::string neg) {
-        const bool add_bos = llama_should_add_bos_token(llama_get_model(ctx));
-        tokens_pos = ::llama_tokenize(ctx, pos, add_bos, true);
-        tokens_neg = ::llama_tokenize(ctx, neg, add_bos, true);
+    tokenized_prompt(llama_model * model, std::string pos, std::string neg) {
+        const bool add_bos = llama_should_add_bos_token(model);
+        tokens_pos = ::llama_tokenize(model, pos, add_bos, true);
+        tokens_neg = ::llama_tokenize(model, neg, add_bos, true);
         max_seq_len = std::max(tokens_pos.size(), tokens_neg.size());
-        padding_seq(ctx, tokens_pos, max_seq_len);
-        padding_seq(ctx, tokens_neg, max_seq_len);
+        padding_seq(model, tokens_pos, max_seq_len);
+        padding_seq(model, tokens_neg, max_seq_len);
     }
 
-    void padding_seq(llama_context * ctx, std::vector<llama_token> & tokens, size_t len) {
+    void padding_seq(llama_model * model, std::vector<llama_token> & tokens, size_t len) {
         // TODO: customize padding token
-        std::vector<llama_token> pad_tokens = ::llama_tokenize(ctx, " ", false);
+        std::vector<llama_token> pad_tokens = ::llama_tokenize(model, " ", false);
         llama_token pad_tok = pad_tokens.back();
         while (tokens.size() < len) {
             tokens.push_back(pad_tok);
@@ -321,25 +238,46 @@ static std::vector<std::string> ctrlvec_load_prompt_file(std::string path, bool
 
 static bool cb_eval(struct ggml_tensor * t, bool ask, void * user_data) {
     auto * cb_data = (callback_data *) user_data;
-    static const char * l_out_name = "l_out";
+    static const char * l_out_name = "l_out-";
     const bool is_l_out = strncmp(t->name, l_out_name, strlen(l_out_name)) == 0;
 
     if (ask) {
         return is_l_out;
     }
 
-    if (!is_l_out || t->ne[1] != cb_data->n_tokens) {
+    // NOTE: final layer is ignored. we only have (n_layers - 1) to process
+    const int il = is_l_out ? atoi(t->name + strlen(l_out_name)) : -1;
+    if (il < 0 || il >= cb_data->n_layers - 1 || t->ne[1] != cb_data->n_tokens) {
         return true;
     }
 
-    // save the tensor to current context
-    cb_data->save_tensor_for_layer(t);
+    cb_data->append_diff(il, t);
     return true;
 }
 
-static bool get_hidden_layers(llama_context * ctx, std::vector<llama_token> & tokens) {
+// evaluate the pairs [i_begin, i_end) in one batch, pair i uses the sequences 2*i and 2*i+1
+static bool get_hidden_layers(llama_context * ctx, llama_batch & batch, callback_data & cb_data,
+        const std::vector<tokenized_prompt> & tokenized_prompts, size_t i_begin, size_t i_end) {
     llama_kv_cache_clear(ctx);
-    if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size(), 0, 0))) {
+    llama_batch_clear(batch);
+    cb_data.pair_pos.clear();
+    cb_data.pair_len.clear();
+    for (size_t i = i_begin; i < i_end; ++i) {
+        const tokenized_prompt & t = tokenized_prompts[i];
+        const llama_seq_id seq_id = 2*(i - i_begin);
+        cb_data.pair_pos.push_back(batch.n_tokens);
+        cb_data.pair_len.push_back(t.max_seq_len);
+        for (size_t j = 0; j < t.max_seq_len; ++j) {
+            llama_batch_add(batch, t.tokens_pos[j], j, { seq_id }, false);
+        }
+        for (size_t j = 0; j < t.max_seq_len; ++j) {
+            llama_batch_add(batch, t.tokens_neg[j], j, { seq_id + 1 }, false);
+        }
+    }
+    batch.logits[batch.n_tokens - 1] = true;
+    cb_data.n_tokens = batch.n_tokens;
+
+    if (llama_decode(ctx, batch)) {
         fprintf(stderr, "%s : failed to eval\n", __func__);
         return false;
     }
@@ -400,26 +338,17 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
-
-    callback_data cb_data;
-
-    // pass the callback to the backend scheduler
-    // it will be executed for each node during the graph computation
-    params.cb_eval = cb_eval;
-    params.cb_eval_user_data = &cb_data;
-    params.warmup = false;
-
     print_build_info();
     llama_backend_init();
     llama_numa_init(params.numa);
 
     // load the model to get hparams
-    llama_init_result llama_init = llama_init_from_gpt_params(params);
-
-    llama_model * model = llama_init.model;
-    llama_context * ctx = llama_init.context;
+    llama_model * model = llama_load_model_from_file(params.model.c_str(), llama_model_params_from_gpt_params(params));
+    if (model == NULL) {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
 
-    // int n_ctx = llama_n_ctx(ctx);
     int n_layers = llama_n_layer(model);
     int n_embd = llama_n_embd(model);
     // get model hint param (a.k.a model arch name)
@@ -430,51 +359,97 @@ int main(int argc, char ** argv) {
     train_context ctx_train(n_embd, n_layers);
 
     // load and prepare entries for training
-    prepare_entries(params, ctx_train);
+    if (prepare_entries(params, ctx_train)) {
+        llama_free_model(model);
+        return 1;
+    }
 
-    // we have to pretokenize everything because otherwise we don't know how much overhead to allocate ctx_diffs_wrapped
+    // we have to pretokenize everything because otherwise we don't know how to group the prompts into batches
     std::vector<tokenized_prompt> tokenized_prompts;
     size_t n_total_tokens = 0;
     for (size_t i = 0; i < ctx_train.positive_entries.size(); ++i) {
-        tokenized_prompt t(ctx, ctx_train.positive_entries[i], ctx_train.negative_entries[i]);
+        tokenized_prompt t(model, ctx_train.positive_entries[i], ctx_train.negative_entries[i]);
         n_total_tokens += 2 * t.max_seq_len;
         tokenized_prompts.push_back(std::move(t));
     }
 
     std::cout << "n_total_tokens: " << n_total_tokens << std::endl;
 
-    for(size_t i = 0; i < ctx_train.positive_entries.size(); ++i) {
-        bool success = false;
-        tokenized_prompt t = tokenized_prompts[i];
-        cb_data.n_layers = n_layers;
-        cb_data.n_tokens = t.max_seq_len;
+    // group the pairs into batches that are evaluated as a single ubatch, so that cb_eval sees all of their tokens at once
+    llama_context_params cparams = llama_context_params_from_gpt_params(params);
+    const int n_ctx = cparams.n_ctx > 0 ? (int) cparams.n_ctx : llama_n_ctx_train(model);
+    const int n_batch_max = std::min({ n_ctx, (int) cparams.n_batch, (int) cparams.n_ubatch });
+    const int n_pairs_max = 128; // 2 sequences per pair, must not exceed the max. number of sequences of a KV cell
+
+    std::vector<size_t> batch_begin;
+    int n_batch_tokens = 0;
+    int n_pairs_batch  = 0;
+    for (size_t i = 0; i < tokenized_prompts.size(); ++i) {
+        const int n_pair_tokens = 2 * tokenized_prompts[i].max_seq_len;
+        if (n_pair_tokens > n_batch_max) {
+            fprintf(stderr, "%s: error: prompt pair %zu needs %d tokens, but a batch holds at most %d tokens (see -c, -b and -ub)\n",
+                __func__, i+1, n_pair_tokens, n_batch_max);
+            llama_free_model(model);
+            return 1;
+        }
+        if (batch_begin.empty() || n_batch_tokens + n_pair_tokens > n_batch_max || n_pairs_batch == n_pairs_max) {
+            batch_begin.push_back(i);
+            n_batch_tokens = 0;
+            n_pairs_batch  = 0;
+        }
+        n_batch_tokens += n_pair_tokens;
+        n_pairs_batch  += 1;
+    }
+    batch_begin.push_back(tokenized_prompts.size());
 
-        printf("Evaluating prompt[%d/%d]: \"%s\" - \"%s\" (%d tokens)\n",
-            (int) i+1, (int) ctx_train.positive_entries.size(),
-            tokens_to_str(ctx, t.tokens_pos.cbegin(), t.tokens_pos.cend()).c_str(),
-            tokens_to_str(ctx, t.tokens_neg.cbegin(), t.tokens_neg.cend()).c_str(),
-            (int) t.max_seq_len);
+    int n_pairs_per_batch = 0;
+    for (size_t ib = 0; ib + 1 < batch_begin.size(); ++ib) {
+        n_pairs_per_batch = std::max(n_pairs_per_batch, (int) (batch_begin[ib+1] - batch_begin[ib]));
+    }
 
-        cb_data.is_eval_pos = true;
-        success = get_hidden_layers(ctx, t.tokens_pos);
-        if (!success) break;
+    callback_data cb_data;
+    cb_data.ctx_train = &ctx_train;
+    cb_data.n_layers = n_layers;
+
+    // pass the callback to the backend scheduler
+    // it will be executed for each node during the graph computation
+    cparams.cb_eval = cb_eval;
+    cparams.cb_eval_user_data = &cb_data;
+    cparams.n_ctx = n_ctx;
+    cparams.n_seq_max = 2 * n_pairs_per_batch;
+
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to create context\n", __func__);
+        llama_free_model(model);
+        return 1;
+    }
 
-        cb_data.is_eval_pos = false;
-        success = get_hidden_layers(ctx, t.tokens_neg);
-        if (!success) break;
+    llama_batch batch = llama_batch_init(n_batch_max, 0, 1);
 
-        // calculate diff and remove all zero rows
-        auto v_diff_filtered = cb_data.calc_diff();
+    printf("Evaluating %zu prompt pairs in %zu batches (up to %d pairs per batch)\n",
+        tokenized_prompts.size(), batch_begin.size() - 1, n_pairs_per_batch);
 
-        // save & concat the filtered v_diff to ctx_train
-        ctx_train.concat_diff_tmp(v_diff_filtered);
+    const int64_t t_eval_start = ggml_time_us();
+    for (size_t ib = 0; ib + 1 < batch_begin.size(); ++ib) {
+        for (size_t i = batch_begin[ib]; i < batch_begin[ib+1]; ++i) {
+            const tokenized_prompt & t = tokenized_prompts[i];
+            printf("Evaluating prompt[%d/%d]: \"%s\" - \"%s\" (%d tokens)\n",
+                (int) i+1, (int) tokenized_prompts.size(),
+                tokens_to_str(ctx, t.tokens_pos.cbegin(), t.tokens_pos.cend()).c_str(),
+                tokens_to_str(ctx, t.tokens_neg.cbegin(), t.tokens_neg.cend()).c_str(),
+                (int) t.max_seq_len);
+        }
 
-        // reset for next iteration
-        cb_data.reset();
+        if (!get_hidden_layers(ctx, batch, cb_data, tokenized_prompts, batch_begin[ib], batch_begin[ib+1])) {
+            break;
+        }
     }
+    printf("Evaluated %zu tokens in %.2f s\n", n_total_tokens, 1e-6*(ggml_time_us() - t_eval_start));
 
     // done with the model, we can now free it to make gain some memory
     printf("Done evaluate prompts, unload model...\n");
+    llama_batch_free(batch);
     llama_free(ctx);
     llama_free_model(model);
 
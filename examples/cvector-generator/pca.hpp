@@ -18,6 +18,8 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <thread>
 
 #define DEBUG_POS 5
 
@@ -63,6 +65,9 @@ struct pca_model {
     struct ggml_tensor * dev_square;
     struct ggml_tensor * dev_eigenvector;
 
+    // graph metadata, one per model so that layers can be solved from several threads
+    std::vector<uint8_t> buf_graph;
+
     pca_model(struct ggml_tensor * t_input) {
 #ifdef GGML_USE_CUDA
         fprintf(stderr, "%s: using CUDA backend\n", __func__);
@@ -136,12 +141,13 @@ struct pca_model {
 
 static struct ggml_cgraph * build_graph_piter(
         const struct pca_params & params,
-        const pca_model & model,
+        pca_model & model,
         bool calc_square = false) {
     GGML_ASSERT(params.n_batch > 0);
     // TODO: buf_size must be able to scale with params.n_batch
-    static size_t buf_size = ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead();
-    static std::vector<uint8_t> buf(buf_size);
+    const size_t buf_size = ggml_tensor_overhead()*GGML_DEFAULT_GRAPH_SIZE + ggml_graph_overhead();
+    std::vector<uint8_t> & buf = model.buf_graph;
+    buf.resize(buf_size);
 
     struct ggml_init_params params0 = {
         /*.mem_size   =*/ buf_size,
@@ -157,6 +163,7 @@ static struct ggml_cgraph * build_graph_piter(
     if (calc_square) {
         tmp_square = ggml_mul_mat(ctx0, model.dev_input, model.dev_input);
         ggml_set_name(tmp_square, "tmp_square");
+        ggml_set_output(tmp_square); // copied to dev_square after the graph is computed
     }
 
     struct ggml_tensor * b_tensor;
@@ -170,7 +177,7 @@ static struct ggml_cgraph * build_graph_piter(
         ggml_set_name(b_tensor, "b_tensor");
 
         // normalize
-        b_tensor = ggml_div_inplace(ctx0,
+        b_tensor = ggml_div(ctx0,
             b_tensor,
             ggml_sqrt_inplace(ctx0, ggml_sum_rows(ctx0, ggml_sqr(ctx0, b_tensor)))
         );
@@ -179,10 +186,15 @@ static struct ggml_cgraph * build_graph_piter(
         // calculate distance(new eigenvector - old eigenvector)
         // we don't use ggml_sub because it may not be implemented on GPU backend
         struct ggml_tensor * new_sub_old = ggml_add(ctx0, old_eigen, ggml_scale(ctx0, b_tensor, -1));
-        distance = ggml_sqrt_inplace(ctx0,
+        distance = ggml_sqrt(ctx0,
             ggml_sum_rows(ctx0, ggml_sqr_inplace(ctx0, new_sub_old)));
         ggml_format_name(distance, "distance_%d", i);
 
+        // the allocator must not reuse the memory of these, they are read back after the graph is computed
+        // (b_tensor and distance are not computed inplace, an output flag on a view does not keep its source alive)
+        ggml_set_output(b_tensor);
+        ggml_set_output(distance);
+
         old_eigen = b_tensor;
 
         // build operations nodes
@@ -264,7 +276,8 @@ static void power_iteration(
     struct ggml_tensor * last_eigenvector = NULL;
 
     int n_iters = params.n_iterations / params.n_batch; // more batch, fewer iterations
-    for (int iter = 0; iter < n_iters; ++iter) {
+    bool converged = false;
+    for (int iter = 0; iter < n_iters && !converged; ++iter) {
         bool calc_square = (iter == 0); // only need to calculate square for first iteration
         struct ggml_cgraph * gf = build_graph_piter(params, model, calc_square);
         // ggml_graph_dump_dot(gf, nullptr, "/tmp/_cgraph.dot");
@@ -273,6 +286,7 @@ static void power_iteration(
         for (size_t k = 0; k < result.distances.size(); ++k) {
             last_eigenvector = result.eigenvectors[k];
             if (result.distances[k] < params.tolerance) {
+                converged = true;
                 break; // done
             }
         }
@@ -289,8 +303,8 @@ static void power_iteration(
             ggml_backend_tensor_copy(last_eigenvector, model.dev_eigenvector);
         }
 
-        printf("%s: layer %d/%d, iteration: %d / total: %d (batch = %d) ...\n",
-            __func__, params.i_layer+1, params.n_layers, iter+1, n_iters, params.n_batch);
+        printf("%s: layer %d/%d, iteration: %d / total: %d (batch = %d)%s\n",
+            __func__, params.i_layer+1, params.n_layers, iter+1, n_iters, params.n_batch, converged ? ", converged" : " ...");
     }
 
     // get output tensor
@@ -307,18 +321,43 @@ static void run_pca(
         struct pca_params & params,
         const std::vector<struct ggml_tensor *> & v_input, // shape of v_input[0]: [n_samples, n_embd]
         const std::vector<struct ggml_tensor *> & v_output) {
-    printf("%s: Running PCA...\n", __func__);
-    for (size_t il = 0; il < v_input.size(); ++il) {
-
-        // prepare output vector
-        struct ggml_tensor * ctrl_out = v_output[il];
-        ggml_format_name(ctrl_out, "direction.%zu", il+1);
-
-        // run power_iteration
-        params.i_layer = il;
-        params.n_layers = v_input.size();
-        power_iteration(params, v_input[il], ctrl_out);
-        printf("%s: Done layer %d / %d\n", __func__, (int) il+1, (int) v_input.size());
+    const int n_layers = v_input.size();
+
+    // the layers are independent: on the CPU backend, solve several of them at once and split the threads between them
+    // (a single power iteration is a chain of small matrix-vector products that does not scale to many threads)
+    int n_workers = std::max(1, std::min(n_layers, params.n_threads));
+#ifdef GGML_USE_CUDA
+    n_workers = 1;
+#endif
+    printf("%s: Running PCA on %d layers (%d at a time)...\n", __func__, n_layers, n_workers);
+
+    std::atomic<int> i_next(0);
+    std::atomic<int> n_done(0);
+    auto worker = [&](int n_threads) {
+        pca_params params_layer = params;
+        params_layer.n_threads = n_threads;
+        params_layer.n_layers  = n_layers;
+        for (int il = i_next++; il < n_layers; il = i_next++) {
+            // prepare output vector
+            struct ggml_tensor * ctrl_out = v_output[il];
+            ggml_format_name(ctrl_out, "direction.%d", il+1);
+
+            // run power_iteration
+            params_layer.i_layer = il;
+            power_iteration(params_layer, v_input[il], ctrl_out);
+            printf("%s: Done layer %d / %d\n", __func__, ++n_done, n_layers);
+        }
+    };
+
+    // the first workers get the remainder of the threads
+    auto n_threads_worker = [&](int i) { return params.n_threads / n_workers + (i < params.n_threads % n_workers ? 1 : 0); };
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_workers; ++i) {
+        workers.emplace_back(worker, n_threads_worker(i));
+    }
+    worker(n_threads_worker(0));
+    for (auto & w : workers) {
+        w.join();
     }
 }
 
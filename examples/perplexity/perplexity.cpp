@@ -1772,6 +1772,7 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     };
 
     kl_divergence_result kld;
+    size_t n_head_outputs = 0, n_head_approx = 0;
     auto    kld_ptr =    kld_values.data();
     auto p_diff_ptr = p_diff_values.data();
 
@@ -1810,6 +1811,14 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
             // restore the original token in case it was set to BOS
             tokens[batch_start] = token_org;
 
+            if (params.output_head_rank > 0) {
+                for (int k = 0; k < batch_size; ++k) {
+                    int32_t n_candidates;
+                    if (llama_get_logits_candidates_ith(ctx, k, &n_candidates)) ++n_head_approx;
+                }
+                n_head_outputs += batch_size;
+            }
+
             if (num_batches > 1) {
                 const auto * batch_logits = llama_get_logits(ctx);
                 logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
@@ -1966,6 +1975,12 @@ static void kl_divergence(llama_context * ctx, const gpt_params & params) {
     const double same_top_p = 1.0*kld.n_same_top/kld.count;
     printf("Same top p: %6.3lf ± %5.3lf %%\n", 100.0*same_top_p, 100.0*sqrt(same_top_p*(1.0 - same_top_p)/(kld.count - 1)));
 
+    if (n_head_outputs > 0) {
+        printf("\n");
+        printf("====== Output head (rank %d, %d candidates) ======\n", params.output_head_rank, params.output_head_top);
+        printf("Approximate outputs: %6.2lf %% (the rest fell back to exact logits)\n", 100.0*n_head_approx/n_head_outputs);
+    }
+
 }
 
 int main(int argc, char ** argv) {
@@ -2006,6 +2021,14 @@ int main(int argc, char ** argv) {
         }
     }
 
+    if (params.output_head_rank > 0 && params.n_ubatch > LLAMA_OUTPUT_HEAD_MAX_OUTPUTS) {
+        // the output head is only used for small ubatches, so evaluate the KL-divergence of the approximate logits
+        // (run with --kl-divergence against a base computed without --output-head-rank) in small ubatches
+        fprintf(stderr, "%s: output head enabled -> adjusting ubatch size from %d to %d\n",
+                __func__, params.n_ubatch, LLAMA_OUTPUT_HEAD_MAX_OUTPUTS);
+        params.n_ubatch = LLAMA_OUTPUT_HEAD_MAX_OUTPUTS;
+    }
+
     if (params.ppl_stride > 0) {
         fprintf(stderr, "Will perform strided perplexity calculation -> adjusting context size from %d to %d\n",
                 params.n_ctx, params.n_ctx + params.ppl_stride/2);
@@ -150,6 +150,8 @@ struct rpc_server_params {
     size_t      backend_mem = 0;
     bool        use_cache = false;
     int         n_threads = std::max(1U, std::thread::hardware_concurrency() / 2);
+    int         n_clients = 1;
+    size_t      client_mem = 0;
 };
 
 static void print_usage(int /*argc*/, char** argv, rpc_server_params params) {
@@ -161,6 +163,8 @@ static void print_usage(int /*argc*/, char** argv, rpc_server_params params) {
     fprintf(stderr, "  -p PORT, --port PORT      port to bind to (default: %d)\n", params.port);
     fprintf(stderr, "  -m MEM,  --mem MEM        backend memory size (in MB)\n");
     fprintf(stderr, "  -c,      --cache          enable local file cache\n");
+    fprintf(stderr, "  -n N,    --clients N      number of clients served concurrently (default: %d)\n", params.n_clients);
+    fprintf(stderr, "           --client-mem MEM memory quota per client (in MB, default: none)\n");
     fprintf(stderr, "\n");
 }
 
@@ -196,6 +200,22 @@ static bool rpc_server_params_parse(int argc, char** argv, rpc_server_params& pa
         else if (arg == "-c" || arg == "--cache") {
             params.use_cache = true;
         }
+        else if (arg == "-n" || arg == "--clients") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.n_clients = std::stoi(argv[i]);
+            if (params.n_clients <= 0) {
+                fprintf(stderr, "error: invalid number of clients: %d\n", params.n_clients);
+                return false;
+            }
+        }
+        else if (arg == "--client-mem") {
+            if (++i >= argc) {
+                return false;
+            }
+            params.client_mem = std::stoul(argv[i]) * 1024 * 1024;
+        }
         else if (arg == "-m" || arg == "--mem") {
             if (++i >= argc) {
                 return false;
@@ -323,7 +343,16 @@ int main(int argc, char * argv[]) {
     printf("  endpoint       : %s\n", endpoint.c_str());
     printf("  local cache    : %s\n", cache_dir ? cache_dir : "n/a");
     printf("  backend memory : %zu MB\n", free_mem / (1024 * 1024));
-    ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir, free_mem, total_mem);
+    printf("  clients        : %d\n", params.n_clients);
+    if (params.client_mem > 0) {
+        printf("  client memory  : %zu MB\n", params.client_mem / (1024 * 1024));
+    }
+    if (params.n_clients > 1 || params.client_mem > 0) {
+        ggml_backend_rpc_start_server_mt(backend, endpoint.c_str(), cache_dir, free_mem, total_mem,
+                params.n_clients, params.client_mem, params.n_threads);
+    } else {
+        ggml_backend_rpc_start_server(backend, endpoint.c_str(), cache_dir, free_mem, total_mem);
+    }
     ggml_backend_free(backend);
     return 0;
 }
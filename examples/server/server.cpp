@@ -25,10 +25,12 @@
 #include "index.html.gz.hpp"
 #include "loading.html.hpp"
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <fstream>
 #include <set>
 #include <mutex>
 #include <thread>
@@ -146,6 +148,8 @@ struct server_task {
 
     bool infill    = false;
     bool embedding = false;
+
+    int64_t t_queued = 0; // set when the task is first posted
 };
 
 struct server_task_result {
@@ -579,6 +583,129 @@ struct slot_params {
     
 };
 
+// one step in the timeline of a request, the meaning of n depends on the event
+struct server_trace_event {
+    const char * name; // static string
+    int64_t      t_us;
+    int32_t      n;
+};
+
+// timeline of one task, recorded by its slot when tracing is enabled (--trace, --trace-file)
+struct server_trace {
+    int id_task  = -1;
+    int id_multi = -1;
+    int id_slot  = -1;
+
+    int64_t t_queued = 0;
+    int64_t t_end    = 0;
+
+    const char * status = "ok"; // "ok", "error" or "cancelled"
+
+    std::vector<server_trace_event> events;
+};
+
+// finished traces of one slot, the oldest one is overwritten
+struct server_trace_ring {
+    std::vector<server_trace> traces;
+    size_t next = 0;
+
+    void push(server_trace && trace, size_t capacity) {
+        if (traces.size() < capacity) {
+            traces.push_back(std::move(trace));
+        } else if (capacity > 0) {
+            traces[next] = std::move(trace);
+            next = (next + 1) % capacity;
+        }
+    }
+};
+
+// OTLP/JSON (ExportTraceServiceRequest) with one span per trace, with the events of the trace and child spans for
+// the queue, prompt and generation phases. t_unix_us converts ggml_time_us() timestamps to unix time.
+static json server_traces_to_otlp(const std::vector<server_trace> & traces, int64_t t_unix_us) {
+    const auto hex = [](uint64_t v, int n_digits) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%0*llx", n_digits, (unsigned long long) v);
+        return std::string(buf);
+    };
+    const auto nanos = [t_unix_us](int64_t t_us) {
+        return std::to_string((t_us + t_unix_us)*1000);
+    };
+    const auto attr = [](const char * key, int64_t value) {
+        return json {{"key", key}, {"value", {{"intValue", std::to_string(value)}}}};
+    };
+
+    json spans = json::array();
+    for (const auto & trace : traces) {
+        // t_unix_us is the start of the process, so trace ids stay unique across restarts of the server
+        const std::string trace_id = hex((uint64_t) t_unix_us, 16) + hex((uint64_t) trace.id_task, 16);
+        // span ids must not be zero, the phases get the three ids after the request
+        const uint64_t    span_id  = ((uint64_t) trace.id_task + 1) << 2;
+        const std::string root_id  = hex(span_id, 16);
+
+        int64_t t_prompt = 0;
+        int64_t t_first  = 0;
+        json events = json::array();
+        for (const auto & ev : trace.events) {
+            if (!t_prompt && strcmp(ev.name, "prompt_start") == 0) {
+                t_prompt = ev.t_us;
+            }
+            if (!t_first && strcmp(ev.name, "token") == 0) {
+                t_first = ev.t_us;
+            }
+            events.push_back({
+                {"timeUnixNano", nanos(ev.t_us)},
+                {"name",         ev.name},
+                {"attributes",   json::array({attr("n", ev.n)})},
+            });
+        }
+
+        spans.push_back({
+            {"traceId",           trace_id},
+            {"spanId",            root_id},
+            {"name",              "request"},
+            {"kind",              2}, // SPAN_KIND_SERVER
+            {"startTimeUnixNano", nanos(trace.t_queued)},
+            {"endTimeUnixNano",   nanos(trace.t_end)},
+            {"attributes",        json::array({attr("id_task", trace.id_task), attr("id_multi", trace.id_multi), attr("id_slot", trace.id_slot)})},
+            {"events",            events},
+            {"status",            {{"code", strcmp(trace.status, "ok") == 0 ? 1 : 2}, {"message", trace.status}}},
+        });
+
+        // phases: queued until the slot starts on the prompt, then prompt processing until the first token
+        const int64_t t_phase[4] = {
+            trace.t_queued,
+            t_prompt ? t_prompt : trace.t_end,
+            t_first  ? t_first  : trace.t_end,
+            trace.t_end,
+        };
+        const char * phase_names[3] = { "queue", "prompt", "generation" };
+        for (int i = 0; i < 3; ++i) {
+            if (t_phase[i + 1] <= t_phase[i]) {
+                continue;
+            }
+            spans.push_back({
+                {"traceId",           trace_id},
+                {"spanId",            hex(span_id + i + 1, 16)},
+                {"parentSpanId",      root_id},
+                {"name",              phase_names[i]},
+                {"kind",              1}, // SPAN_KIND_INTERNAL
+                {"startTimeUnixNano", nanos(t_phase[i])},
+                {"endTimeUnixNano",   nanos(t_phase[i + 1])},
+            });
+        }
+    }
+
+    return json {
+        {"resourceSpans", json::array({{
+            {"resource",   {{"attributes", json::array({{{"key", "service.name"}, {"value", {{"stringValue", "llama-server"}}}}})}}},
+            {"scopeSpans", json::array({{
+                {"scope", {{"name", "llama-server"}}},
+                {"spans", spans},
+            }})},
+        }})},
+    };
+}
+
 struct server_slot {
     int id;
     int id_task = -1;
@@ -654,6 +781,16 @@ struct server_slot {
     size_t n_sent_text = 0; // number of sent text character
     size_t n_sent_token_probs = 0;
 
+    int64_t t_queued = 0;     // when the task of the current request was posted
+    int64_t t_last_token = 0; // when the last token was produced, 0 before the first one
+    int32_t priority = 0;     // request priority, used to label the latency metrics
+    int32_t steering_id = 0;  // steering vector of the sequence, the cached tokens were evaluated with it
+
+    // timeline of the current task, only recorded when tracing is enabled
+    bool         tracing = false;
+    server_trace trace;
+    int32_t      n_trace_prefill = 0; // prompt tokens of the slot in the batch being decoded
+
     int64_t t_start_process_prompt;
     int64_t t_start_generation;
 
@@ -725,6 +862,12 @@ struct server_slot {
         }
     }
 
+    void trace_event(const char * name, int32_t n = 0) {
+        if (tracing) {
+            trace.events.push_back({name, ggml_time_us(), n});
+        }
+    }
+
     json get_formated_timings() const {
         return json {
             {"prompt_n",               n_prompt_tokens_processed},
@@ -853,6 +996,70 @@ struct server_slot {
     }
 };
 
+// Log-linear histogram in the spirit of HdrHistogram: each power of two between 2^exp_min and 2^exp_max is split into
+// n_sub equal buckets, so a bucket is at most 1/n_sub wide relative to its value. Values are integers in a base unit
+// (microseconds, tokens, KV cells) and are recorded with relaxed atomic increments, so the hot path never takes a lock
+// and /metrics can read the histogram while the main loop keeps recording.
+struct server_histogram {
+    static constexpr int sub_bits = 2;
+    static constexpr int n_sub    = 1 << sub_bits;
+
+    const int exp_min;
+    const int exp_max;
+
+    std::vector<std::atomic<uint64_t>> counts; // the last bucket is +Inf
+    std::atomic<uint64_t> sum{0};
+
+    server_histogram(int exp_min, int exp_max) : exp_min(exp_min), exp_max(exp_max), counts(2 + (exp_max - exp_min)*n_sub) {
+        GGML_ASSERT(exp_min >= sub_bits && exp_max > exp_min && exp_max < 63);
+    }
+
+    // bucket i holds the values in (upper(i - 1), upper(i)]
+    size_t index(uint64_t value) const {
+        if (value <= (uint64_t(1) << exp_min)) {
+            return 0;
+        }
+        if (value > (uint64_t(1) << exp_max)) {
+            return counts.size() - 1;
+        }
+        const uint64_t v = value - 1;
+        int e = exp_min;
+        while (v >> (e + 1)) {
+            ++e;
+        }
+        return 1 + (e - exp_min)*n_sub + ((v >> (e - sub_bits)) & (n_sub - 1));
+    }
+
+    uint64_t upper(size_t i) const {
+        if (i == 0) {
+            return uint64_t(1) << exp_min;
+        }
+        const int e = exp_min + int(i - 1)/n_sub;
+        const int s = int(i - 1)%n_sub;
+        return (uint64_t(1) << e) + (uint64_t(s + 1) << (e - sub_bits));
+    }
+
+    void record(uint64_t value) {
+        counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (const auto & c : counts) {
+            n += c.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+};
+
+// latency distributions of the requests of one priority class
+struct server_request_histograms {
+    server_histogram queue_wait          {7, 27}; // us, from posting the task to starting the prompt
+    server_histogram time_to_first_token {7, 27}; // us, from posting the task to the first sampled token
+    server_histogram inter_token_latency {7, 24}; // us, between two tokens of the same request
+};
+
 struct server_metrics {
     int64_t t_start = 0;
 
@@ -867,8 +1074,35 @@ struct server_metrics {
     uint64_t n_tokens_predicted  = 0;
     uint64_t t_tokens_generation = 0;
 
-    void init() {
+    // per slot totals, indexed by slot id
+    std::vector<uint64_t> n_prompt_tokens_processed_slot;
+    std::vector<uint64_t> n_tokens_predicted_slot;
+
+    // distributions, read directly by /metrics
+    static constexpr int n_priority = 4;
+    std::array<server_request_histograms, n_priority> requests;
+
+    // per llama_decode call, [0] for batches with prompt tokens and [1] for batches of generated tokens only
+    std::array<server_histogram, 2> decode_time {{ {7, 27}, {7, 27} }}; // us
+    server_histogram batch_prompt_tokens    {2, 16};
+    server_histogram batch_generated_tokens {2, 16};
+    server_histogram kv_cache_used_cells    {6, 24}; // sampled after every batch
+    server_histogram sampling_time          {2, 20}; // us, per sampled token
+
+    void init(size_t n_slots) {
         t_start = ggml_time_us();
+        n_prompt_tokens_processed_slot.assign(n_slots, 0);
+        n_tokens_predicted_slot.assign(n_slots, 0);
+    }
+
+    static int priority_class(const server_slot & slot) {
+        return std::min(std::max(slot.priority, 0), n_priority - 1);
+    }
+
+    void on_prompt_start(const server_slot & slot) {
+        if (slot.t_queued > 0) {
+            requests[priority_class(slot)].queue_wait.record(slot.t_start_process_prompt - slot.t_queued);
+        }
     }
 
     void on_prompt_eval(const server_slot & slot) {
@@ -876,6 +1110,20 @@ struct server_metrics {
         n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
         t_prompt_processing             += slot.t_prompt_processing;
         t_prompt_processing_total       += slot.t_prompt_processing;
+
+        n_prompt_tokens_processed_slot[slot.id] += slot.n_prompt_tokens_processed;
+    }
+
+    // called for every token produced by a slot, before it is processed
+    void on_token(server_slot & slot) {
+        const int64_t t_now = ggml_time_us();
+        auto & hist = requests[priority_class(slot)];
+        if (slot.t_last_token > 0) {
+            hist.inter_token_latency.record(t_now - slot.t_last_token);
+        } else if (slot.t_queued > 0) {
+            hist.time_to_first_token.record(t_now - slot.t_queued);
+        }
+        slot.t_last_token = t_now;
     }
 
     void on_prediction(const server_slot & slot) {
@@ -883,6 +1131,15 @@ struct server_metrics {
         n_tokens_predicted         += slot.n_decoded;
         t_tokens_generation        += slot.t_token_generation;
         t_tokens_generation_total  += slot.t_token_generation;
+
+        n_tokens_predicted_slot[slot.id] += slot.n_decoded;
+    }
+
+    void on_decode(int64_t t_decode_us, int32_t n_prompt, int32_t n_generated, int32_t n_kv_used) {
+        decode_time[n_prompt > 0 ? 0 : 1].record(t_decode_us);
+        batch_prompt_tokens.record(n_prompt);
+        batch_generated_tokens.record(n_generated);
+        kv_cache_used_cells.record(std::max(n_kv_used, 0));
     }
 
     void reset_bucket() {
@@ -918,6 +1175,9 @@ struct server_queue {
             task.id = id++;
             LOG_VERBOSE("new task id", {{"new_id", task.id}});
         }
+        if (task.t_queued == 0) {
+            task.t_queued = ggml_time_us();
+        }
         queue_tasks.push_back(std::move(task));
         condition_tasks.notify_one();
         return task.id;
@@ -1170,6 +1430,15 @@ struct server_context {
 
     server_metrics metrics;
 
+    // steering vectors that requests can select by name, see llama_control_vector_set
+    std::map<std::string, int32_t> steering_ids;
+
+    // finished traces, one ring per slot, written by the main loop and read by /trace
+    std::vector<server_trace_ring> trace_rings;
+    std::mutex    mutex_traces;
+    std::ofstream trace_file;
+    int64_t       t_unix_us = 0; // unix time at ggml_time_us() == 0
+
     common_chat_templates_ptr chat_templates;
     oaicompat_parser_options  oai_parser_opt;
     // Necessary similarity of prompt for slot selection
@@ -1235,6 +1504,21 @@ struct server_context {
         add_bos_token = llama_should_add_bos_token(model);
         GGML_ASSERT(llama_add_eos_token(model) != 1);
 
+        for (const auto & [name, fname] : params.steering_vectors) {
+            const auto cvec = llama_control_vector_load({{ 1.0f, fname }});
+            if (cvec.n_embd == -1) {
+                LOG_ERROR("failed to load steering vector", {{"name", name}, {"fname", fname}});
+                return false;
+            }
+            const int32_t id = steering_ids.size() + 1;
+            const int32_t il_start = params.control_vector_layer_start > 0 ? params.control_vector_layer_start : 1;
+            const int32_t il_end   = params.control_vector_layer_end   > 0 ? params.control_vector_layer_end   : llama_n_layer(model);
+            if (llama_control_vector_set(ctx, id, cvec.data.data(), cvec.data.size(), cvec.n_embd, il_start, il_end) != 0) {
+                return false;
+            }
+            steering_ids[name] = id;
+        }
+
         chat_templates = common_chat_templates_init(model, params.chat_template);
         try {
             common_chat_format_example(chat_templates.get(), params.use_jinja);
@@ -1359,7 +1643,17 @@ struct server_context {
             batch = llama_batch_init(n_batch, 0, 1);
         }
 
-        metrics.init();
+        metrics.init(slots.size());
+
+        trace_rings.resize(slots.size());
+        t_unix_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() - ggml_time_us();
+        if (!params.trace_file.empty()) {
+            trace_file.open(params.trace_file, std::ios::app);
+            if (!trace_file) {
+                LOG_ERROR("failed to open trace file", {{"trace_file", params.trace_file}});
+            }
+        }
         oai_parser_opt = {
             /* use_jinja             */ params.use_jinja,
             /* prefill_assistant     */ params.prefill_assistant,
@@ -1511,6 +1805,22 @@ struct server_context {
             slot.oaicompat_model = "";
         }
         slot.params.timings_per_token = json_value(data, "timings_per_token", false);
+        slot.priority                  = json_value(data, "priority",          0);
+        slot.t_queued                  = task.t_queued;
+        slot.t_last_token              = 0;
+
+        slot.tracing         = tracing_enabled();
+        slot.n_trace_prefill = 0;
+        if (slot.tracing) {
+            slot.trace          = server_trace();
+            slot.trace.id_task  = task.id;
+            slot.trace.id_multi = task.id_multi;
+            slot.trace.id_slot  = slot.id;
+            slot.trace.t_queued = task.t_queued;
+            slot.trace.events.reserve(64);
+            slot.trace.events.push_back({"queued", task.t_queued, 0});
+            slot.trace_event("slot_assigned", slot.id);
+        }
         slot.params.stream             = json_value(data, "stream",            false);
         slot.params.cache_prompt       = json_value(data, "cache_prompt",      true);
         slot.params.n_predict          = json_value(data, "n_predict",         json_value(data, "max_tokens", default_params.n_predict));
@@ -1646,6 +1956,26 @@ struct server_context {
             }
         }
 
+        // steering vector for the tokens of the slot's sequence
+        {
+            int32_t steering_id = 0;
+            const std::string steering_vector = json_value(data, "steering_vector", std::string());
+            if (!steering_vector.empty()) {
+                const auto it = steering_ids.find(steering_vector);
+                if (it == steering_ids.end()) {
+                    send_error(task, "Unknown steering vector: " + steering_vector, ERROR_TYPE_INVALID_REQUEST);
+                    return false;
+                }
+                steering_id = it->second;
+            }
+            // the cached prompt was evaluated with the previous vector
+            if (steering_id != slot.steering_id) {
+                slot.cache_tokens.clear();
+                slot.steering_id = steering_id;
+            }
+            llama_control_vector_set_seq(ctx, slot.id + 1, steering_id);
+        }
+
         // penalize user-provided tokens
         {
             slot.sparams.penalty_prompt_tokens.clear();
@@ -1931,6 +2261,8 @@ struct server_context {
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
+        metrics.on_token(slot);
+
         // remember which tokens were sampled - used for repetition penalties during sampling
         const std::string token_str = llama_token_to_piece(ctx, result.tok, params.special);
         slot.sampled = result.tok;
@@ -2123,11 +2455,44 @@ struct server_context {
         };
     }
 
+    bool tracing_enabled() const {
+        return params.n_trace > 0 || !params.trace_file.empty();
+    }
+
+    // moves the trace of a released slot to its ring and to the trace file
+    void trace_finish(server_slot & slot) {
+        slot.tracing     = false;
+        slot.trace.t_end = ggml_time_us();
+
+        if (trace_file.is_open()) {
+            trace_file << server_traces_to_otlp({ slot.trace }, t_unix_us).dump(-1, ' ', false, json::error_handler_t::replace) << "\n";
+            trace_file.flush();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_traces);
+        trace_rings[slot.id].push(std::move(slot.trace), params.n_trace);
+    }
+
+    // finished traces of a task, or of all subtasks of a multi-prompt task
+    std::vector<server_trace> trace_find(int id) {
+        std::vector<server_trace> result;
+        std::lock_guard<std::mutex> lock(mutex_traces);
+        for (const auto & ring : trace_rings) {
+            for (const auto & trace : ring.traces) {
+                if (trace.id_task == id || trace.id_multi == id) {
+                    result.push_back(trace);
+                }
+            }
+        }
+        return result;
+    }
+
     void send_error(const server_task & task, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
         send_error(task.id, task.id_multi, error, type);
     }
 
-    void send_error(const server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+    void send_error(server_slot & slot, const std::string & error, const enum error_type type = ERROR_TYPE_SERVER) {
+        slot.trace.status = "error";
         send_error(slot.id_task, slot.id_multi, error, type);
     }
 
@@ -2193,6 +2558,7 @@ struct server_context {
         if (slot.params.timings_per_token) {
             res.timings = slot.get_timings();
         }
+        slot.trace_event("stream_flush", (int32_t) tkn.text_to_send.size());
         queue_results.send(std::move(res));
     }
 
@@ -2434,6 +2800,9 @@ struct server_context {
                     // release slot linked with the task id
                     for (auto & slot : slots) {
                         if (slot.id_task == task.id_target) {
+                            if (slot.command != SLOT_COMMAND_RELEASE) {
+                                slot.trace.status = "cancelled";
+                            }
                             slot.release();
                             break;
                         }
@@ -2508,6 +2877,9 @@ struct server_context {
                         { "n_tokens_predicted",              metrics.n_tokens_predicted},
                         { "t_tokens_generation",             metrics.t_tokens_generation},
 
+                        { "n_prompt_tokens_processed_slot",  metrics.n_prompt_tokens_processed_slot},
+                        { "n_tokens_predicted_slot",         metrics.n_tokens_predicted_slot},
+
                         { "kv_cache_tokens_count",           llama_get_kv_cache_token_count(ctx)},
                         { "kv_cache_used_cells",             llama_get_kv_cache_used_cells(ctx)},
 
@@ -2681,6 +3053,10 @@ struct server_context {
                 slot.command     = SLOT_COMMAND_NONE;
                 slot.t_last_used = ggml_time_us();
 
+                if (slot.tracing) {
+                    trace_finish(slot);
+                }
+
                 LOG_INFO("slot released", {
                     {"id_slot",         slot.id},
                     {"id_task",         slot.id_task},
@@ -2813,6 +3189,9 @@ struct server_context {
         // -1: none, 0: non-embedding, 1: embedding
         int32_t batch_type = batch.n_tokens > 0 ? 0 : -1;
 
+        // the sampled tokens of the generating slots are at the front of the batch, the prompt tokens follow
+        const int32_t n_batch_generated = batch.n_tokens;
+
         // next, batch any pending prompts without exceeding n_batch
         if (params.cont_batching || batch.n_tokens == 0) {
             for (auto & slot : slots) {
@@ -2829,6 +3208,8 @@ struct server_context {
 
                         slot.t_start_process_prompt = ggml_time_us();
                         slot.t_start_generation = 0;
+                        metrics.on_prompt_start(slot);
+                        slot.trace_event("prompt_start");
 
                         if (slot.infill) {
                             const bool add_bos = llama_should_add_bos_token(model);
@@ -2868,6 +3249,7 @@ struct server_context {
 
                         slot.n_past = 0;
                         slot.n_prompt_tokens = prompt_tokens.size();
+                        slot.trace_event("tokenized", slot.n_prompt_tokens);
 
                         LOG_VERBOSE("prompt tokenized", {
                             {"id_slot",         slot.id},
@@ -2952,6 +3334,7 @@ struct server_context {
                                 
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = common_part(slot.cache_tokens, prompt_tokens);
+                                slot.trace_event("cache_hit", slot.n_past);
 
                                 // push the prompt into the sampling context (do not apply grammar)
                                 for (int i = 0; i < slot.n_past; ++i) {
@@ -3044,6 +3427,7 @@ struct server_context {
                         }
 
                         slot.n_prompt_tokens_processed++;
+                        slot.n_trace_prefill++;
                         slot_npast++;
                     }
 
@@ -3146,8 +3530,22 @@ struct server_context {
                 0, 0, 0, // unused
             };
 
+            const int64_t t_decode_start = ggml_time_us();
             const int ret = llama_decode(ctx, batch_view);
 
+            if (ret == 0) {
+                const int32_t n_generated = std::max(0, std::min(n_tokens, n_batch_generated - i));
+                metrics.on_decode(ggml_time_us() - t_decode_start, n_tokens - n_generated, n_generated,
+                        llama_get_kv_cache_used_cells(ctx));
+
+                for (auto & slot : slots) {
+                    if (slot.n_trace_prefill > 0) {
+                        slot.trace_event("prefill_chunk", slot.n_trace_prefill);
+                        slot.n_trace_prefill = 0;
+                    }
+                }
+            }
+
             if (ret != 0) {
                 if (n_batch == 1 || ret < 0) {
                     // if you get here, it means the KV cache is full - try increasing it via the context size
@@ -3192,9 +3590,12 @@ struct server_context {
                 }
 
                 completion_token_output result;
+                const int64_t t_sample_start = ggml_time_us();
                 const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
 
                 llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                metrics.sampling_time.record(ggml_time_us() - t_sample_start);
+                slot.trace_event("token", n_tokens);
 
                 slot.n_decoded += 1;
 
@@ -3320,10 +3721,15 @@ struct server_context {
                     {"size", slot.batch_spec.n_tokens}
                 });
 
-                llama_decode(ctx, slot.batch_spec);
+                const int64_t t_decode_start = ggml_time_us();
+                if (llama_decode(ctx, slot.batch_spec) == 0) {
+                    metrics.on_decode(ggml_time_us() - t_decode_start, 0, slot.batch_spec.n_tokens,
+                            llama_get_kv_cache_used_cells(ctx));
+                }
 
                 // the accepted tokens from the speculation
                 std::vector<llama_token> ids = llama_sampling_sample_and_accept_n(slot.ctx_sampling, ctx, draft);
+                slot.trace_event("speculative", (int32_t) ids.size());
 
                 slot.n_past += ids.size();
                 slot.n_decoded += ids.size();
@@ -4009,6 +4415,78 @@ int main(int argc, char ** argv) {
             }
         }
 
+        std::string model_label = "model=\"";
+        for (char c : params.model_alias) {
+            if (c == '"' || c == '\\') {
+                model_label += '\\';
+            }
+            model_label += c == '\n' ? ' ' : c;
+        }
+        model_label += "\"";
+
+        // per slot counters
+        const struct { const char * key; const char * name; const char * help; } slot_counters[] = {
+            { "n_prompt_tokens_processed_slot", "slot_prompt_tokens_total",    "Number of prompt tokens processed by the slot."     },
+            { "n_tokens_predicted_slot",        "slot_tokens_predicted_total", "Number of generation tokens processed by the slot." },
+        };
+        for (const auto & [key, name, help] : slot_counters) {
+            prometheus << "# HELP llamacpp:" << name << " " << help << "\n"
+                       << "# TYPE llamacpp:" << name << " counter\n";
+            const json & values = data.at(key);
+            for (size_t id = 0; id < values.size(); ++id) {
+                prometheus << "llamacpp:" << name << "{" << model_label << ",slot=\"" << id << "\"} " << values[id].get<uint64_t>() << "\n";
+            }
+        }
+
+        // histograms are read without going through the task queue, the counts are atomic
+        // scale converts the recorded unit to the exported one, e.g. 1e-6 for microseconds to seconds
+        using histogram_series = std::vector<std::pair<std::string, const server_histogram *>>;
+        const auto write_histogram = [&prometheus](const char * name, const char * help, double scale, const histogram_series & series) {
+            prometheus << "# HELP llamacpp:" << name << " " << help << "\n"
+                       << "# TYPE llamacpp:" << name << " histogram\n";
+            for (const auto & [labels, hist] : series) {
+                uint64_t count = 0;
+                for (size_t i = 0; i < hist->counts.size(); ++i) {
+                    count += hist->counts[i].load(std::memory_order_relaxed);
+                    prometheus << "llamacpp:" << name << "_bucket{" << labels << ",le=\"";
+                    if (i + 1 < hist->counts.size()) {
+                        prometheus << hist->upper(i)*scale;
+                    } else {
+                        prometheus << "+Inf";
+                    }
+                    prometheus << "\"} " << count << "\n";
+                }
+                prometheus << "llamacpp:" << name << "_sum{"   << labels << "} " << hist->sum.load(std::memory_order_relaxed)*scale << "\n"
+                           << "llamacpp:" << name << "_count{" << labels << "} " << count << "\n";
+            }
+        };
+
+        const server_metrics & metrics = ctx_server.metrics;
+
+        histogram_series queue_wait, time_to_first_token, inter_token_latency;
+        for (int p = 0; p < server_metrics::n_priority; ++p) {
+            // the default priority is always exported, the others once they were used
+            if (p > 0 && metrics.requests[p].queue_wait.count() == 0) {
+                continue;
+            }
+            const std::string labels = model_label + ",priority=\"" + std::to_string(p) + "\"";
+            queue_wait         .push_back({labels, &metrics.requests[p].queue_wait});
+            time_to_first_token.push_back({labels, &metrics.requests[p].time_to_first_token});
+            inter_token_latency.push_back({labels, &metrics.requests[p].inter_token_latency});
+        }
+        write_histogram("queue_wait_seconds",          "Time from receiving a request to starting its prompt.",      1e-6, queue_wait);
+        write_histogram("time_to_first_token_seconds", "Time from receiving a request to its first generated token.", 1e-6, time_to_first_token);
+        write_histogram("inter_token_latency_seconds", "Time between two generated tokens of a request.",             1e-6, inter_token_latency);
+
+        write_histogram("decode_seconds", "Time of one llama_decode call.", 1e-6, {
+            {model_label + ",phase=\"prompt\"",     &metrics.decode_time[0]},
+            {model_label + ",phase=\"generation\"", &metrics.decode_time[1]},
+        });
+        write_histogram("sampling_seconds",        "Time to sample one token.",                     1e-6, {{model_label, &metrics.sampling_time}});
+        write_histogram("batch_prompt_tokens",     "Number of prompt tokens in a decoded batch.",    1,    {{model_label, &metrics.batch_prompt_tokens}});
+        write_histogram("batch_generated_tokens",  "Number of generated tokens in a decoded batch.", 1,    {{model_label, &metrics.batch_generated_tokens}});
+        write_histogram("kv_cache_used_cells",     "Used KV-cache cells after a decoded batch.",     1,    {{model_label, &metrics.kv_cache_used_cells}});
+
         const int64_t t_start = data.at("t_start");
         res.set_header("Process-Start-Time-Unix", std::to_string(t_start));
 
@@ -4016,6 +4494,30 @@ int main(int argc, char ** argv) {
         res.status = 200; // HTTP OK
     };
 
+    const auto handle_trace = [&ctx_server, &res_error](const httplib::Request & req, httplib::Response & res) {
+        if (!ctx_server.tracing_enabled()) {
+            res_error(res, format_error_response("This server does not record traces. Start it with `--trace N`", ERROR_TYPE_NOT_SUPPORTED));
+            return;
+        }
+
+        int id_task;
+        try {
+            id_task = std::stoi(req.path_params.at("id_task"));
+        } catch (const std::exception &) {
+            res_error(res, format_error_response("Invalid task ID", ERROR_TYPE_INVALID_REQUEST));
+            return;
+        }
+
+        const std::vector<server_trace> traces = ctx_server.trace_find(id_task);
+        if (traces.empty()) {
+            res_error(res, format_error_response("No finished trace for this task ID", ERROR_TYPE_NOT_FOUND));
+            return;
+        }
+
+        const json data = server_traces_to_otlp(traces, ctx_server.t_unix_us);
+        res.set_content(data.dump(-1, ' ', false, json::error_handler_t::replace), "application/json; charset=utf-8");
+    };
+
     const auto handle_slots_save = [&ctx_server, &res_error, &params](const httplib::Request & req, httplib::Response & res, int id_slot) {
         json request_data = json::parse(req.body);
         std::string filename = request_data.at("filename");
@@ -4160,6 +4662,9 @@ int main(int argc, char ** argv) {
         res.set_header("Access-Control-Allow-Origin", req.get_header_value("Origin"));
         auto data = json::parse(req.body);
         const int id_task = ctx_server.queue_tasks.get_new_id();
+        if (ctx_server.tracing_enabled()) {
+            res.set_header("X-Trace-Id", std::to_string(id_task));
+        }
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
         ctx_server.request_completion(id_task, -1, data, false, false);
@@ -4240,6 +4745,9 @@ int main(int argc, char ** argv) {
         auto body = json::parse(req.body);
         json data = oaicompat_chat_params_parse(body);
         const int id_task = ctx_server.queue_tasks.get_new_id();
+        if (ctx_server.tracing_enabled()) {
+            res.set_header("X-Trace-Id", std::to_string(id_task));
+        }
         const auto completion_id = gen_chatcmplid();
         ctx_server.queue_results.add_waiting_task_id(id_task);
         ctx_server.request_completion(id_task, -1, data, false, false);
@@ -4354,6 +4862,9 @@ int main(int argc, char ** argv) {
         auto body = json::parse(req.body);
         json data = oaicompat_chat_params_parse(ctx_server.model, body, ctx_server.oai_parser_opt);
         const int id_task = ctx_server.queue_tasks.get_new_id();
+        if (ctx_server.tracing_enabled()) {
+            res.set_header("X-Trace-Id", std::to_string(id_task));
+        }
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
         ctx_server.request_completion(id_task, -1, data, false, false);
@@ -4464,6 +4975,9 @@ int main(int argc, char ** argv) {
         json data = json::parse(req.body);
 
         const int id_task = ctx_server.queue_tasks.get_new_id();
+        if (ctx_server.tracing_enabled()) {
+            res.set_header("X-Trace-Id", std::to_string(id_task));
+        }
 
         ctx_server.queue_results.add_waiting_task_id(id_task);
         ctx_server.request_completion(id_task, -1, data, true, false);
@@ -5033,6 +5547,7 @@ int main(int argc, char ** argv) {
     // register API routes
     svr->Get ("/health",              handle_health);
     svr->Get ("/metrics",             handle_metrics);
+    svr->Get ("/trace/:id_task",      handle_trace);
     svr->Get ("/props",               handle_props);
     svr->Get ("/v1/models",           handle_models);
     svr->Post("/completion",          handle_completions); // legacy
@@ -103,6 +103,8 @@ extern "C" {
     GGML_API GGML_CALL bool ggml_backend_is_cpu                (ggml_backend_t backend);
     GGML_API           void ggml_backend_cpu_set_n_threads     (ggml_backend_t backend_cpu, int n_threads);
     GGML_API           void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_callback abort_callback, void * abort_callback_data);
+    // pin the compute threads to the given cores (NULL = no pinning), the array must outlive the backend
+    GGML_API           void ggml_backend_cpu_set_cpu_cores     (ggml_backend_t backend_cpu, const int * cpu_cores, int n_cpu_cores);
 
     // Create a backend buffer from an existing pointer
     GGML_API GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size);
@@ -113,6 +115,12 @@ extern "C" {
     GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void);
 #endif
 
+    // CPU buffer type backed by huge pages (linux only, elsewhere this is the regular CPU buffer type)
+    // page_size = 0 uses transparent huge pages (MADV_HUGEPAGE), otherwise hugetlbfs pages of this size (e.g. 2 MiB or 1 GiB)
+    // are used, falling back to transparent huge pages when not enough of them are available
+    // numa_node >= 0 makes the buffers prefer memory on this NUMA node
+    GGML_API ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node);
+
     //
     // Backend registry
     //
@@ -8,7 +8,7 @@ extern "C" {
 #endif
 
 #define RPC_PROTO_MAJOR_VERSION    2
-#define RPC_PROTO_MINOR_VERSION    0
+#define RPC_PROTO_MINOR_VERSION    2
 #define RPC_PROTO_PATCH_VERSION    1
 #define GGML_RPC_MAX_SERVERS       16
 
@@ -24,6 +24,16 @@ GGML_API GGML_CALL void ggml_backend_rpc_start_server(ggml_backend_t backend, co
                                                     const char * cache_dir,
                                                     size_t free_mem, size_t total_mem);
 
+// serve up to max_clients clients concurrently, each on its own thread
+// client_mem: memory quota per client in bytes (0 = no quota)
+// n_threads:  with a CPU backend, each client computes on its own CPU backend, the n_threads are split among the
+//             connected clients
+// large uploads are indexed by hash, so weights already uploaded by one client are copied on the server for the next
+GGML_API GGML_CALL void ggml_backend_rpc_start_server_mt(ggml_backend_t backend, const char * endpoint,
+                                                    const char * cache_dir,
+                                                    size_t free_mem, size_t total_mem,
+                                                    int max_clients, size_t client_mem, int n_threads);
+
 #ifdef  __cplusplus
 }
 #endif
@@ -670,6 +670,11 @@ extern "C" {
 
         GGML_OP_CROSS_ENTROPY_LOSS,
         GGML_OP_CROSS_ENTROPY_LOSS_BACK,
+
+        // appended so that the values of the other ops (e.g. in the RPC protocol) do not change
+        GGML_OP_ROPE_CACHE,
+        GGML_OP_ROPE_FAST,
+
         GGML_OP_COUNT,
     };
 
@@ -779,6 +784,10 @@ extern "C" {
 
         int n_threads;
 
+        // if not NULL, compute thread ith is pinned to cpu_cores[ith % n_cpu_cores] (linux only)
+        const int * cpu_cores;
+        int         n_cpu_cores;
+
         // abort ggml_graph_compute when true
         ggml_abort_callback abort_callback;
         void *              abort_callback_data;
@@ -1811,6 +1820,41 @@ extern "C" {
     GGML_CALL void ggml_rope_yarn_corr_dims(
         int n_dims, int n_ctx_orig, float freq_base, float beta_fast, float beta_slow, float dims[2]);
 
+    // In-place RoPE of selected rows of a host buffer holding rows of row_size bytes with n_per_row elements
+    // of the given type (e.g. a K cache), each row consisting of heads of n_embd_head elements.
+    // Row rows[i] is rotated by position pos[i], with the same result as ggml_rope_ext_inplace on the rows.
+    // Quantized rows are dequantized, rotated and quantized again. Only the normal and NeoX modes are supported.
+    GGML_API bool ggml_rope_rows_supported(enum ggml_type type, int mode);
+    GGML_API void ggml_rope_rows_inplace(
+            enum ggml_type type, void * data, size_t row_size, int64_t n_per_row, int64_t n_embd_head,
+            const int32_t * rows, const int32_t * pos, int64_t n_rows, const float * freq_factors,
+            int n_dims, int mode, int n_ctx_orig, float freq_base, float freq_scale,
+            float ext_factor, float attn_factor, float beta_fast, float beta_slow);
+
+    // RoPE with a precomputed table
+    // ggml_rope_cache returns the table for the int32 positions b and the optional freq factors c, F32 [n_dims, b->ne[0]]
+    // with the (cos, sin) pair of each rotated pair of dimensions. It only depends on the positions and the parameters,
+    // so the RoPE ops of all layers can share it. ggml_rope_fast(ctx, a, cache) gives the same result as ggml_rope_ext
+    // with the parameters of the table. Only the normal and NeoX modes are supported.
+    GGML_API struct ggml_tensor * ggml_rope_cache(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx_orig,
+            float                 freq_base,
+            float                 freq_scale,
+            float                 ext_factor,
+            float                 attn_factor,
+            float                 beta_fast,
+            float                 beta_slow);
+
+    GGML_API struct ggml_tensor * ggml_rope_fast(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * cache);
+
     // rotary position embedding backward, i.e compute dx from dy
     // a - dy
     GGML_API struct ggml_tensor * ggml_rope_back(
@@ -4,6 +4,7 @@
 #include "ggml-rpc.h"
 
 #include <cassert>
+#include <cerrno>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
@@ -11,6 +12,9 @@
 #include <cstring>
 #include <vector>
 #include <set>
+#include <map>
+#include <mutex>
+#include <string>
 
 #define IK_PRINT_TIMING 0
 
@@ -784,6 +788,198 @@ ggml_backend_buffer_type_t ggml_backend_cpu_hbm_buffer_type(void) {
 }
 #endif
 
+// buffer type backed by huge pages
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const size_t GGML_THP_SIZE = 2ull*1024*1024;
+
+struct ggml_backend_cpu_hugepage_buffer_type_context {
+    size_t      page_size; // 0 = transparent huge pages
+    int         numa_node; // < 0 = no binding
+    std::string name;
+    bool        warned = false;
+};
+
+struct ggml_backend_cpu_hugepage_buffer_context {
+    void      * data;
+    size_t      mapped;
+    const char * name;
+};
+
+GGML_CALL static const char * ggml_backend_cpu_hugepage_buffer_type_get_name(ggml_backend_buffer_type_t buft) {
+    return ((ggml_backend_cpu_hugepage_buffer_type_context *)buft->context)->name.c_str();
+}
+
+GGML_CALL static const char * ggml_backend_cpu_hugepage_buffer_get_name(ggml_backend_buffer_t buffer) {
+    return ((ggml_backend_cpu_hugepage_buffer_context *)buffer->context)->name;
+}
+
+GGML_CALL static void * ggml_backend_cpu_hugepage_buffer_get_base(ggml_backend_buffer_t buffer) {
+    return ((ggml_backend_cpu_hugepage_buffer_context *)buffer->context)->data;
+}
+
+GGML_CALL static void ggml_backend_cpu_hugepage_buffer_free_buffer(ggml_backend_buffer_t buffer) {
+    auto * ctx = (ggml_backend_cpu_hugepage_buffer_context *)buffer->context;
+    if (munmap(ctx->data, ctx->mapped) != 0) {
+        fprintf(stderr, "%s: munmap failed: %s\n", __func__, strerror(errno));
+    }
+    delete ctx;
+}
+
+GGML_CALL static void ggml_backend_cpu_hugepage_buffer_clear(ggml_backend_buffer_t buffer, uint8_t value) {
+    memset(((ggml_backend_cpu_hugepage_buffer_context *)buffer->context)->data, value, buffer->size);
+}
+
+static struct ggml_backend_buffer_i cpu_hugepage_backend_buffer_i = {
+    /* .get_name        = */ ggml_backend_cpu_hugepage_buffer_get_name,
+    /* .free_buffer     = */ ggml_backend_cpu_hugepage_buffer_free_buffer,
+    /* .get_base        = */ ggml_backend_cpu_hugepage_buffer_get_base,
+    /* .init_tensor     = */ NULL, // no initialization required
+    /* .memset_tensor   = */ ggml_backend_cpu_buffer_memset_tensor,
+    /* .set_tensor      = */ ggml_backend_cpu_buffer_set_tensor,
+    /* .get_tensor      = */ ggml_backend_cpu_buffer_get_tensor,
+    /* .cpy_tensor      = */ ggml_backend_cpu_buffer_cpy_tensor,
+    /* .clear           = */ ggml_backend_cpu_hugepage_buffer_clear,
+    /* .reset           = */ NULL,
+};
+
+// MPOL_PREFERRED, so that allocations spill to other nodes instead of failing when the node is full
+static void ggml_hugepage_mbind(void * addr, size_t len, int node) {
+#ifdef SYS_mbind
+    constexpr int k_mpol_preferred = 1;
+    unsigned long mask[1024/(8*sizeof(unsigned long))] = {};
+    if (node >= (int)(8*sizeof(mask))) {
+        fprintf(stderr, "%s: invalid NUMA node %d\n", __func__, node);
+        return;
+    }
+    mask[node/(8*sizeof(unsigned long))] |= 1ul << (node%(8*sizeof(unsigned long)));
+    if (syscall(SYS_mbind, addr, len, k_mpol_preferred, mask, 8*sizeof(mask), 0) != 0) {
+        fprintf(stderr, "%s: binding %.2f MiB to NUMA node %d failed: %s\n", __func__, len/1024./1024., node, strerror(errno));
+    }
+#else
+    GGML_UNUSED(addr); GGML_UNUSED(len); GGML_UNUSED(node);
+#endif
+}
+
+// anonymous mapping aligned to the THP size, so that all of it can be backed by huge pages
+static void * ggml_hugepage_mmap_thp(size_t size) {
+    char * raw = (char *)mmap(NULL, size + GGML_THP_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char * data = (char *)GGML_PAD((uintptr_t)raw, GGML_THP_SIZE);
+    if (data > raw) {
+        munmap(raw, data - raw);
+    }
+    if (raw + GGML_THP_SIZE > data) {
+        munmap(data + size, raw + GGML_THP_SIZE - data);
+    }
+#ifdef MADV_HUGEPAGE
+    if (madvise(data, size, MADV_HUGEPAGE) != 0) {
+        static bool warned = false;
+        if (!warned) {
+            warned = true;
+            fprintf(stderr, "%s: madvise(MADV_HUGEPAGE) failed: %s, transparent huge pages are not available\n", __func__, strerror(errno));
+        }
+    }
+#endif
+    return data;
+}
+
+GGML_CALL static ggml_backend_buffer_t ggml_backend_cpu_hugepage_buffer_type_alloc_buffer(ggml_backend_buffer_type_t buft, size_t size) {
+    auto * buft_ctx = (ggml_backend_cpu_hugepage_buffer_type_context *)buft->context;
+    const size_t alloc_size = size > 0 ? size : 1; // mmap does not accept empty mappings
+
+    void * data = NULL;
+    size_t mapped = 0;
+    const char * name = "CPU_THP";
+    if (buft_ctx->page_size > 0) {
+        mapped = GGML_PAD(alloc_size, buft_ctx->page_size);
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#ifdef MAP_HUGE_SHIFT
+        flags |= __builtin_ctzll(buft_ctx->page_size) << MAP_HUGE_SHIFT;
+#endif
+        data = mmap(NULL, mapped, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (data == MAP_FAILED) {
+            if (!buft_ctx->warned) {
+                buft_ctx->warned = true;
+                fprintf(stderr, "%s: not enough %zu MiB huge pages for a %.2f MiB buffer (%s), falling back to transparent huge pages\n",
+                        __func__, buft_ctx->page_size/(1024*1024), size/1024./1024., strerror(errno));
+            }
+            data = NULL;
+        } else {
+            name = buft_ctx->name.c_str();
+        }
+    }
+    if (!data) {
+        mapped = GGML_PAD(alloc_size, GGML_THP_SIZE);
+        data = ggml_hugepage_mmap_thp(mapped);
+        if (!data) {
+            fprintf(stderr, "%s: failed to allocate buffer of size %zu: %s\n", __func__, size, strerror(errno));
+            return NULL;
+        }
+    }
+    if (buft_ctx->numa_node >= 0) {
+        ggml_hugepage_mbind(data, mapped, buft_ctx->numa_node);
+    }
+
+    return ggml_backend_buffer_init(buft, cpu_hugepage_backend_buffer_i, new ggml_backend_cpu_hugepage_buffer_context{data, mapped, name}, size);
+}
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node) {
+    if (page_size > 0 && (page_size & (page_size - 1)) != 0) {
+        fprintf(stderr, "%s: huge page size %zu is not a power of 2, using transparent huge pages\n", __func__, page_size);
+        page_size = 0;
+    }
+    numa_node = numa_node < 0 ? -1 : numa_node;
+
+    // buffer types must outlive the buffers, so they are never freed
+    static std::mutex mutex;
+    static std::map<std::pair<size_t, int>, ggml_backend_buffer_type> buffer_types;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = buffer_types.find({page_size, numa_node});
+    if (it == buffer_types.end()) {
+        auto * ctx = new ggml_backend_cpu_hugepage_buffer_type_context;
+        ctx->page_size = page_size;
+        ctx->numa_node = numa_node;
+        ctx->name = page_size == 0 ? "CPU_THP" : page_size >= 1024*1024*1024 ? "CPU_" + std::to_string(page_size >> 30) + "G"
+                                                                              : "CPU_" + std::to_string(page_size >> 20) + "M";
+        if (numa_node >= 0) {
+            ctx->name += "_N" + std::to_string(numa_node);
+        }
+        ggml_backend_buffer_type buft = {
+            /* .iface    = */ {
+                /* .get_name         = */ ggml_backend_cpu_hugepage_buffer_type_get_name,
+                /* .alloc_buffer     = */ ggml_backend_cpu_hugepage_buffer_type_alloc_buffer,
+                /* .get_alignment    = */ ggml_backend_cpu_buffer_type_get_alignment,
+                /* .get_max_size     = */ NULL, // defaults to SIZE_MAX
+                /* .get_alloc_size   = */ NULL, // defaults to ggml_nbytes
+                /* .is_host          = */ ggml_backend_cpu_buffer_type_is_host,
+            },
+            /* .context  = */ ctx,
+        };
+        it = buffer_types.emplace(std::make_pair(page_size, numa_node), buft).first;
+    }
+    return &it->second;
+}
+
+#else
+
+ggml_backend_buffer_type_t ggml_backend_cpu_hugepage_buffer_type(size_t page_size, int numa_node) {
+    return ggml_backend_cpu_buffer_type();
+
+    GGML_UNUSED(page_size);
+    GGML_UNUSED(numa_node);
+}
+
+#endif
+
 struct ggml_backend_cpu_context {
     int n_threads;
     void * work_data;
@@ -791,6 +987,9 @@ struct ggml_backend_cpu_context {
 
     ggml_abort_callback abort_callback;
     void *              abort_callback_data;
+
+    const int * cpu_cores;
+    int         n_cpu_cores;
 };
 
 GGML_CALL static const char * ggml_backend_cpu_name(ggml_backend_t backend) {
@@ -835,6 +1034,8 @@ GGML_CALL static ggml_backend_graph_plan_t ggml_backend_cpu_graph_plan_create(gg
 
     cpu_plan->cplan.abort_callback      = cpu_ctx->abort_callback;
     cpu_plan->cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cpu_plan->cplan.cpu_cores           = cpu_ctx->cpu_cores;
+    cpu_plan->cplan.n_cpu_cores         = cpu_ctx->n_cpu_cores;
 
     return cpu_plan;
 }
@@ -874,6 +1075,8 @@ GGML_CALL static enum ggml_status ggml_backend_cpu_graph_compute(ggml_backend_t
 
     cplan.abort_callback      = cpu_ctx->abort_callback;
     cplan.abort_callback_data = cpu_ctx->abort_callback_data;
+    cplan.cpu_cores           = cpu_ctx->cpu_cores;
+    cplan.n_cpu_cores         = cpu_ctx->n_cpu_cores;
 
     return ggml_graph_compute(cgraph, &cplan);
 }
@@ -941,6 +1144,8 @@ ggml_backend_t ggml_backend_cpu_init(void) {
     ctx->work_size           = 0;
     ctx->abort_callback      = NULL;
     ctx->abort_callback_data = NULL;
+    ctx->cpu_cores           = NULL;
+    ctx->n_cpu_cores         = 0;
 
     ggml_backend_t cpu_backend = (ggml_backend_t)malloc(sizeof(struct ggml_backend));
     if (cpu_backend == NULL) {
@@ -975,6 +1180,14 @@ void ggml_backend_cpu_set_abort_callback(ggml_backend_t backend_cpu, ggml_abort_
     ctx->abort_callback_data = abort_callback_data;
 }
 
+void ggml_backend_cpu_set_cpu_cores(ggml_backend_t backend_cpu, const int * cpu_cores, int n_cpu_cores) {
+    GGML_ASSERT(ggml_backend_is_cpu(backend_cpu));
+
+    struct ggml_backend_cpu_context * ctx = (struct ggml_backend_cpu_context *)backend_cpu->context;
+    ctx->cpu_cores   = n_cpu_cores > 0 ? cpu_cores : NULL;
+    ctx->n_cpu_cores = cpu_cores ? n_cpu_cores : 0;
+}
+
 GGML_CALL ggml_backend_buffer_t ggml_backend_cpu_buffer_from_ptr(void * ptr, size_t size) {
     GGML_ASSERT((uintptr_t)ptr % TENSOR_ALIGNMENT == 0 && "buffer pointer must be aligned");
     return ggml_backend_buffer_init(ggml_backend_cpu_buffer_type(), cpu_backend_buffer_i_from_ptr, ptr, size);
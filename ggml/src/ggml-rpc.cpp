@@ -2,11 +2,16 @@
 #include "ggml.h"
 #include "ggml-backend-impl.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cmath>
+#include <condition_variable>
 #include <string>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 #ifdef _WIN32
@@ -24,6 +29,14 @@
 #  include <netinet/tcp.h>
 #  include <netdb.h>
 #  include <unistd.h>
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+#if defined(__linux__)
+// clients and servers on the same host move tensor data through a shared memory region
+#  define GGML_RPC_SHM
+#  include <sys/un.h>
 #endif
 #include <string.h>
 #include <fstream>
@@ -46,9 +59,35 @@ using ssize_t = __int64;
 typedef int sockfd_t;
 #endif
 
+// shared memory region for tensor data, created by the client with memfd_create
+// the server maps the same file through /proc/<client pid>/fd/<fd>
+struct rpc_shm {
+    int    fd   = -1;
+    void * data = nullptr;
+    size_t size = 0;
+    ~rpc_shm() {
+#ifdef GGML_RPC_SHM
+        if (data) {
+            munmap(data, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+};
+
 // cross-platform socket
 struct socket_t {
     sockfd_t fd;
+    // set on the client side when the server is on the same host
+    std::unique_ptr<rpc_shm> shm;
+    // type used for activations sent to and received from the server
+    ggml_type wire_type = GGML_TYPE_F32;
+    // a GRAPH_COMPUTE response has not been received yet
+    bool graph_pending = false;
+    // status of the last GRAPH_COMPUTE, kept until it is reported by synchronize or the next graph_compute
+    enum ggml_status graph_status = GGML_STATUS_SUCCESS;
     socket_t(sockfd_t fd) : fd(fd) {}
     ~socket_t() {
         GGML_PRINT_DEBUG("[%s] closing socket %d\n", __func__, this->fd);
@@ -99,18 +138,59 @@ enum rpc_cmd {
     RPC_CMD_INIT_TENSOR,
     RPC_CMD_GET_ALLOC_SIZE,
     RPC_CMD_HELLO,
+    RPC_CMD_SHM_ATTACH,
+    RPC_CMD_SET_TENSOR_SHM,
+    RPC_CMD_GET_TENSOR_SHM,
+    RPC_CMD_SET_TENSOR_CONV,
+    RPC_CMD_GET_TENSOR_CONV,
     RPC_CMD_COUNT,
 };
 
 // Try RPC_CMD_SET_TENSOR_HASH first when data size is larger than this threshold
 const size_t HASH_THRESHOLD = 10 * 1024 * 1024;
 
+// Size of the shared memory region used with servers on the same host, larger transfers are split
+const size_t SHM_SIZE = 64 * 1024 * 1024;
+// Smaller transfers go through the socket, the extra round trip is not worth it
+const size_t SHM_THRESHOLD = 64 * 1024;
+
+// Activations of at least this size are converted to the wire type (GGML_RPC_WIRE_TYPE) for transfer
+const size_t WIRE_THRESHOLD = 16 * 1024;
+
 struct rpc_msg_hello_rsp {
     uint8_t major;
     uint8_t minor;
     uint8_t patch;
 };
 
+struct rpc_msg_shm_attach_req {
+    uint64_t pid;
+    int64_t  fd;
+    uint64_t size;
+    uint64_t magic; // also stored at the start of the region
+};
+
+struct rpc_msg_shm_attach_rsp {
+    uint8_t result;
+};
+
+// the data is in the shared memory region, at offset 0
+struct rpc_msg_set_tensor_shm_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+};
+
+// f32 data of size bytes moved as wire_type
+// SET_TENSOR_CONV: the request is followed by the converted data
+// GET_TENSOR_CONV: the response is the converted data, or the f32 data if it has non-finite values
+struct rpc_msg_tensor_conv_req {
+    rpc_tensor tensor;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t wire_type;
+};
+
 struct rpc_msg_get_alloc_size_req {
     rpc_tensor tensor;
 };
@@ -226,6 +306,35 @@ static uint64_t fnv_hash(const uint8_t* data, size_t len) {
     return hash;
 }
 
+static bool rpc_wire_type_supported(ggml_type wire_type, uint64_t size) {
+    if (wire_type != GGML_TYPE_BF16 && wire_type != GGML_TYPE_Q8_0) {
+        return false;
+    }
+    return size % sizeof(float) == 0 && (size / sizeof(float)) % ggml_blck_size(wire_type) == 0;
+}
+
+static size_t rpc_wire_size(ggml_type wire_type, uint64_t size) {
+    return ggml_row_size(wire_type, size / sizeof(float));
+}
+
+static void rpc_wire_encode(ggml_type wire_type, const float * x, void * y, int64_t n) {
+    ggml_internal_get_type_traits(wire_type).from_float(x, y, n);
+}
+
+static void rpc_wire_decode(ggml_type wire_type, const void * x, float * y, int64_t n) {
+    ggml_internal_get_type_traits(wire_type).to_float(x, y, n);
+}
+
+// -INF (attention masks) or NaN cannot be represented by q8_0, such data is moved as f32
+static bool rpc_wire_all_finite(const float * x, int64_t n) {
+    for (int64_t i = 0; i < n; ++i) {
+        if (!std::isfinite(x[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static std::shared_ptr<socket_t> make_socket(sockfd_t fd) {
 #ifdef _WIN32
     if (fd == INVALID_SOCKET) {
@@ -387,7 +496,12 @@ static bool parse_endpoint(const std::string & endpoint, std::string & host, int
 
 // RPC request : | rpc_cmd (1 byte) | request_size (8 bytes) | request_data (request_size bytes) |
 // No response
+static bool recv_graph_compute_rsp(const std::shared_ptr<socket_t> & sock);
+
 static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cmd, const void * input, size_t input_size) {
+    if (sock->graph_pending && !recv_graph_compute_rsp(sock)) {
+        return false;
+    }
     uint8_t cmd_byte = cmd;
     if (!send_data(sock->fd, &cmd_byte, sizeof(cmd_byte))) {
         return false;
@@ -422,9 +536,29 @@ static bool send_rpc_cmd(const std::shared_ptr<socket_t> & sock, enum rpc_cmd cm
     return true;
 }
 
+// GRAPH_COMPUTE is asynchronous: the response is received on synchronize or before the next command on the socket,
+// so the client can compute other parts of the graph (e.g. its own tensor parallel slices) in the meantime
+static bool recv_graph_compute_rsp(const std::shared_ptr<socket_t> & sock) {
+    sock->graph_pending = false;
+    uint64_t out_size;
+    rpc_msg_graph_compute_rsp response;
+    if (!recv_data(sock->fd, &out_size, sizeof(out_size)) || out_size != sizeof(response)) {
+        return false;
+    }
+    if (!recv_data(sock->fd, &response, sizeof(response))) {
+        return false;
+    }
+    // the status is sent as a byte, the failures are negative
+    const enum ggml_status status = (enum ggml_status)(int8_t)response.result;
+    if (status != GGML_STATUS_SUCCESS) {
+        fprintf(stderr, "%s: graph compute failed on the server (status %d)\n", __func__, (int)status);
+        sock->graph_status = status;
+    }
+    return true;
+}
+
 // RPC client-side implementation
-static bool check_server_version(const std::shared_ptr<socket_t>& sock) {
-    rpc_msg_hello_rsp response;
+static bool check_server_version(const std::shared_ptr<socket_t>& sock, rpc_msg_hello_rsp& response) {
     bool status = send_rpc_cmd(sock, RPC_CMD_HELLO, nullptr, 0, &response, sizeof(response));
     GGML_ASSERT(status);
     if (response.major != RPC_PROTO_MAJOR_VERSION || response.minor > RPC_PROTO_MINOR_VERSION) {
@@ -437,6 +571,111 @@ static bool check_server_version(const std::shared_ptr<socket_t>& sock) {
     return true;
 }
 
+#ifdef GGML_RPC_SHM
+// true if the peer of a connected socket is on this host: a unix socket or a loopback address
+static bool is_local_peer(sockfd_t sockfd) {
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(sockfd, (struct sockaddr *)&peer, &peer_len) != 0) {
+        return false;
+    }
+    switch (peer.ss_family) {
+        case AF_UNIX:
+            return true;
+        case AF_INET: {
+            const auto * addr = (const struct sockaddr_in *)&peer;
+            return (ntohl(addr->sin_addr.s_addr) >> 24) == 127;
+        }
+        case AF_INET6: {
+            const auto * addr = (const struct sockaddr_in6 *)&peer;
+            if (IN6_IS_ADDR_LOOPBACK(&addr->sin6_addr)) {
+                return true;
+            }
+            // IPv4-mapped 127.0.0.0/8
+            return IN6_IS_ADDR_V4MAPPED(&addr->sin6_addr) && addr->sin6_addr.s6_addr[12] == 127;
+        }
+        default:
+            return false;
+    }
+}
+#endif
+
+// with a server on the same host, tensor data is moved through a shared memory region instead of the socket
+// set GGML_RPC_NO_SHM=1 to disable
+static void rpc_shm_connect(const std::shared_ptr<socket_t> & sock) {
+#ifdef GGML_RPC_SHM
+    const char * no_shm = getenv("GGML_RPC_NO_SHM");
+    if ((no_shm && atoi(no_shm) != 0) || !is_local_peer(sock->fd)) {
+        return;
+    }
+    auto shm = std::make_unique<rpc_shm>();
+    shm->fd = memfd_create("ggml-rpc", MFD_CLOEXEC);
+    if (shm->fd < 0 || ftruncate(shm->fd, SHM_SIZE) != 0) {
+        return;
+    }
+    void * data = mmap(nullptr, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    shm->data = data;
+    shm->size = SHM_SIZE;
+
+    std::random_device rd;
+    rpc_msg_shm_attach_req request;
+    request.pid   = getpid();
+    request.fd    = shm->fd;
+    request.size  = shm->size;
+    request.magic = ((uint64_t)rd() << 32) | rd();
+    memcpy(shm->data, &request.magic, sizeof(request.magic));
+    rpc_msg_shm_attach_rsp response;
+    bool status = send_rpc_cmd(sock, RPC_CMD_SHM_ATTACH, &request, sizeof(request), &response, sizeof(response));
+    GGML_ASSERT(status);
+    if (response.result) {
+        GGML_PRINT_DEBUG("[%s] using shared memory for sockfd=%d\n", __func__, sock->fd);
+        sock->shm = std::move(shm);
+    }
+#else
+    UNUSED(sock);
+#endif
+}
+
+// GGML_RPC_WIRE_TYPE=bf16|q8_0 sends activations crossing split boundaries in this type instead of f32
+static ggml_type rpc_wire_type_from_env() {
+    const char * env = getenv("GGML_RPC_WIRE_TYPE");
+    if (env == nullptr || strcmp(env, "f32") == 0) {
+        return GGML_TYPE_F32;
+    }
+    if (strcmp(env, "bf16") == 0) {
+        return GGML_TYPE_BF16;
+    }
+    if (strcmp(env, "q8_0") == 0) {
+        return GGML_TYPE_Q8_0;
+    }
+    fprintf(stderr, "%s: unsupported RPC wire type '%s', use f32, bf16 or q8_0\n", __func__, env);
+    return GGML_TYPE_F32;
+}
+
+// GGML_RPC_WIRE_CHECK=1 reports the error of every converted transfer against the f32 data
+static bool rpc_wire_check_enabled() {
+    static const bool enabled = [] {
+        const char * env = getenv("GGML_RPC_WIRE_CHECK");
+        return env != nullptr && atoi(env) != 0;
+    }();
+    return enabled;
+}
+
+static void rpc_wire_check(const char * func, const ggml_tensor * tensor, ggml_type wire_type, const float * ref, const float * x, int64_t n) {
+    double max_err = 0, sum_err2 = 0, sum_ref2 = 0;
+    for (int64_t i = 0; i < n; ++i) {
+        const double err = (double)x[i] - ref[i];
+        max_err   = std::max(max_err, std::abs(err));
+        sum_err2 += err*err;
+        sum_ref2 += (double)ref[i]*ref[i];
+    }
+    fprintf(stderr, "%s: %s as %s, n = %" PRId64 ": max abs err = %g, rel rms err = %g\n", func, tensor->name,
+            ggml_type_name(wire_type), n, max_err, sum_ref2 > 0 ? std::sqrt(sum_err2/sum_ref2) : 0.0);
+}
+
 static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     static std::mutex mutex;
     std::lock_guard<std::mutex> lock(mutex);
@@ -470,9 +709,16 @@ static std::shared_ptr<socket_t> get_socket(const std::string & endpoint) {
     if (sock == nullptr) {
         return nullptr;
     }
-    if (!check_server_version(sock)) {
+    rpc_msg_hello_rsp version;
+    if (!check_server_version(sock, version)) {
         return nullptr;
     }
+    if (version.minor >= 1) {
+        rpc_shm_connect(sock);
+    }
+    if (version.minor >= 2 && !sock->shm) {
+        sock->wire_type = rpc_wire_type_from_env();
+    }
     GGML_PRINT_DEBUG("[%s] connected to %s, sockfd=%d\n", __func__, endpoint.c_str(), sock->fd);
     sockets[endpoint] = sock;
     return sock;
@@ -558,9 +804,40 @@ GGML_CALL static void ggml_backend_rpc_buffer_init_tensor(ggml_backend_buffer_t
     }
 }
 
+// activations crossing split boundaries end up in compute buffers, weights are always sent as they are
+// graph inputs (masks, positions, ...) are sent as they are too
+static bool ggml_backend_rpc_use_wire_type(ggml_backend_buffer_t buffer, const ggml_tensor * tensor, size_t size) {
+    ggml_backend_rpc_buffer_context* ctx = (ggml_backend_rpc_buffer_context*)buffer->context;
+    return ctx->sock->wire_type != GGML_TYPE_F32 && tensor->type == GGML_TYPE_F32 && size >= WIRE_THRESHOLD &&
+           !(tensor->flags & GGML_TENSOR_FLAG_INPUT) &&
+           ggml_backend_buffer_get_usage(buffer) == GGML_BACKEND_BUFFER_USAGE_COMPUTE &&
+           rpc_wire_type_supported(ctx->sock->wire_type, size);
+}
+
 static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggml_tensor* tensor, const void* data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context* ctx = (ggml_backend_rpc_buffer_context*)buffer->context;
     rpc_tensor rpc_tensor = serialize_tensor(tensor);
+    if (ggml_backend_rpc_use_wire_type(buffer, tensor, size) && rpc_wire_all_finite((const float *)data, size / sizeof(float))) {
+        const ggml_type wire_type = ctx->sock->wire_type;
+        const int64_t n = size / sizeof(float);
+        rpc_msg_tensor_conv_req request;
+        request.tensor    = rpc_tensor;
+        request.offset    = offset;
+        request.size      = size;
+        request.wire_type = wire_type;
+        std::vector<uint8_t> input(sizeof(request) + rpc_wire_size(wire_type, size));
+        memcpy(input.data(), &request, sizeof(request));
+        rpc_wire_encode(wire_type, (const float *)data, input.data() + sizeof(request), n);
+        if (rpc_wire_check_enabled()) {
+            // the server decodes the same bytes
+            std::vector<float> decoded(n);
+            rpc_wire_decode(wire_type, input.data() + sizeof(request), decoded.data(), n);
+            rpc_wire_check(__func__, tensor, wire_type, (const float *)data, decoded.data(), n);
+        }
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_CONV, input.data(), input.size(), nullptr, 0);
+        GGML_ASSERT(status);
+        return;
+    }
     if (size > HASH_THRESHOLD) {
         // input serialization format: | rpc_tensor | offset (8 bytes) | hash (8 bytes)
         size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + sizeof(uint64_t);
@@ -577,6 +854,22 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
             return;
         }
     }
+    if (ctx->sock->shm && size >= SHM_THRESHOLD) {
+        // only the descriptor goes through the socket, the data is staged in the shared region
+        const rpc_shm * shm = ctx->sock->shm.get();
+        for (size_t done = 0; done < size; ) {
+            const size_t n = std::min(size - done, shm->size);
+            memcpy(shm->data, (const uint8_t *)data + done, n);
+            rpc_msg_set_tensor_shm_req request;
+            request.tensor = rpc_tensor;
+            request.offset = offset + done;
+            request.size   = n;
+            bool status = send_rpc_cmd(ctx->sock, RPC_CMD_SET_TENSOR_SHM, &request, sizeof(request), nullptr, 0);
+            GGML_ASSERT(status);
+            done += n;
+        }
+        return;
+    }
     // input serialization format: | rpc_tensor | offset (8 bytes) | data (size bytes)
     size_t input_size = sizeof(rpc_tensor) + sizeof(uint64_t) + size;
     std::vector<uint8_t> input(input_size, 0);
@@ -590,8 +883,57 @@ static void ggml_backend_rpc_buffer_set_tensor(ggml_backend_buffer_t buffer, ggm
 
 static void ggml_backend_rpc_buffer_get_tensor(ggml_backend_buffer_t buffer, const ggml_tensor* tensor, void* data, size_t offset, size_t size) {
     ggml_backend_rpc_buffer_context* ctx = (ggml_backend_rpc_buffer_context*)buffer->context;
+    if (ggml_backend_rpc_use_wire_type(buffer, tensor, size)) {
+        const ggml_type wire_type = ctx->sock->wire_type;
+        const int64_t n = size / sizeof(float);
+        rpc_msg_tensor_conv_req request;
+        request.tensor    = serialize_tensor(tensor);
+        request.offset    = offset;
+        request.size      = size;
+        request.wire_type = wire_type;
+        // the server sends f32 data instead if the tensor has non-finite values
+        bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR_CONV, &request, sizeof(request));
+        GGML_ASSERT(status);
+        uint64_t out_size;
+        status = recv_data(ctx->sock->fd, &out_size, sizeof(out_size));
+        GGML_ASSERT(status && (out_size == rpc_wire_size(wire_type, size) || out_size == size));
+        if (out_size == size) {
+            status = recv_data(ctx->sock->fd, data, size);
+            GGML_ASSERT(status);
+            return;
+        }
+        std::vector<uint8_t> output(out_size);
+        status = recv_data(ctx->sock->fd, output.data(), output.size());
+        GGML_ASSERT(status);
+        rpc_wire_decode(wire_type, output.data(), (float *)data, n);
+        if (rpc_wire_check_enabled()) {
+            // fetch the same data again without conversion
+            rpc_msg_get_tensor_req ref_request;
+            ref_request.tensor = request.tensor;
+            ref_request.offset = offset;
+            ref_request.size   = size;
+            std::vector<float> ref(n);
+            status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &ref_request, sizeof(ref_request), ref.data(), size);
+            GGML_ASSERT(status);
+            rpc_wire_check(__func__, tensor, wire_type, ref.data(), (const float *)data, n);
+        }
+        return;
+    }
     rpc_msg_get_tensor_req request;
     request.tensor = serialize_tensor(tensor);
+    if (ctx->sock->shm && size >= SHM_THRESHOLD) {
+        const rpc_shm * shm = ctx->sock->shm.get();
+        for (size_t done = 0; done < size; ) {
+            const size_t n = std::min(size - done, shm->size);
+            request.offset = offset + done;
+            request.size   = n;
+            bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR_SHM, &request, sizeof(request), nullptr, 0);
+            GGML_ASSERT(status);
+            memcpy((uint8_t *)data + done, shm->data, n);
+            done += n;
+        }
+        return;
+    }
     request.offset = offset;
     request.size = size;
     bool status = send_rpc_cmd(ctx->sock, RPC_CMD_GET_TENSOR, &request, sizeof(request), data, size);
@@ -740,8 +1082,13 @@ GGML_CALL static ggml_backend_buffer_type_t ggml_backend_rpc_get_default_buffer_
 }
 
 GGML_CALL static void ggml_backend_rpc_synchronize(ggml_backend_t backend) {
-    UNUSED(backend);
-    // this is no-op because we don't have any async operations
+    ggml_backend_rpc_context * rpc_ctx = (ggml_backend_rpc_context *)backend->context;
+    auto sock = get_socket(rpc_ctx->endpoint);
+    if (sock->graph_pending && !recv_graph_compute_rsp(sock)) {
+        fprintf(stderr, "%s: failed to receive the graph compute response\n", __func__);
+        sock->graph_status = GGML_STATUS_FAILED;
+    }
+    // a failure of the graph is kept in graph_status and returned by the next graph_compute on this backend
 }
 
 static void add_tensor(ggml_tensor * tensor, std::vector<rpc_tensor> & tensors, std::unordered_set<ggml_tensor*> & visited) {
@@ -785,11 +1132,21 @@ static enum ggml_status ggml_backend_rpc_graph_compute(ggml_backend_t backend, g
     ggml_backend_rpc_context* rpc_ctx = (ggml_backend_rpc_context*)backend->context;
     std::vector<uint8_t> input;
     serialize_graph(cgraph, input);
-    rpc_msg_graph_compute_rsp response;
     auto sock = get_socket(rpc_ctx->endpoint);
-    bool status = send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size(), &response, sizeof(response));
-    GGML_ASSERT(status);
-    return (enum ggml_status)response.result;
+    if (sock->graph_pending && !recv_graph_compute_rsp(sock)) {
+        return GGML_STATUS_FAILED;
+    }
+    // the previous graph was not synchronized, report its failure here
+    if (sock->graph_status != GGML_STATUS_SUCCESS) {
+        const enum ggml_status status = sock->graph_status;
+        sock->graph_status = GGML_STATUS_SUCCESS;
+        return status;
+    }
+    if (!send_rpc_cmd(sock, RPC_CMD_GRAPH_COMPUTE, input.data(), input.size())) {
+        return GGML_STATUS_FAILED;
+    }
+    sock->graph_pending = true;
+    return GGML_STATUS_SUCCESS;
 }
 
 GGML_CALL static bool ggml_backend_rpc_supports_op(ggml_backend_t backend, const ggml_tensor * op) {
@@ -925,10 +1282,37 @@ GGML_API GGML_CALL void ggml_backend_rpc_get_device_memory(const char * endpoint
 
 // RPC server-side implementation
 
+// state shared by the clients of a server
+struct rpc_server_shared {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    int                     n_clients = 0; // connected clients
+
+    int    max_clients = 1;
+    size_t client_mem  = 0; // memory quota per client, 0 = no quota
+    int    n_threads   = 0; // CPU threads split among the connected clients
+
+    // backends other than CPU are shared by all clients, the commands using them are serialized
+    bool       serialize_backend = false;
+    std::mutex backend_mutex;
+
+    // large uploads by hash, so that weights uploaded by one client can be copied on the server for the next one
+    struct upload {
+        ggml_backend_buffer_t buffer;
+        uint64_t              data;
+        size_t                size;
+    };
+    std::unordered_map<uint64_t, upload> uploads; // protected by mutex
+};
+
 class rpc_server {
 public:
-    rpc_server(ggml_backend_t backend, const char* cache_dir)
-        : backend(backend), cache_dir(cache_dir) {
+    rpc_server(ggml_backend_t backend, const char* cache_dir, rpc_server_shared & shared)
+        : backend(backend), cache_dir(cache_dir), shared(shared) {
+        // with several clients, each client computes its graphs with its own CPU backend
+        if (shared.max_clients > 1 && shared.n_threads > 0 && ggml_backend_is_cpu(backend)) {
+            client_backend = ggml_backend_cpu_init();
+        }
     }
     ~rpc_server();
     void hello(rpc_msg_hello_rsp& response);
@@ -941,13 +1325,25 @@ public:
     bool set_tensor(const std::vector<uint8_t>& input);
     bool set_tensor_hash(const std::vector<uint8_t>& input, rpc_msg_set_tensor_hash_rsp& response);
     bool get_tensor(const rpc_msg_get_tensor_req& request, std::vector<uint8_t>& response);
+    bool shm_attach(sockfd_t sockfd, const rpc_msg_shm_attach_req& request, rpc_msg_shm_attach_rsp& response);
+    bool set_tensor_shm(const rpc_msg_set_tensor_shm_req& request);
+    bool get_tensor_shm(const rpc_msg_get_tensor_req& request);
+    bool set_tensor_conv(const std::vector<uint8_t>& input);
+    bool get_tensor_conv(const rpc_msg_tensor_conv_req& request, std::vector<uint8_t>& response);
     bool copy_tensor(const rpc_msg_copy_tensor_req& request, rpc_msg_copy_tensor_rsp& response);
     bool graph_compute(const std::vector<uint8_t>& input, rpc_msg_graph_compute_rsp& response);
     bool init_tensor(const rpc_msg_init_tensor_req& request);
     bool get_alloc_size(const rpc_msg_get_alloc_size_req& request, rpc_msg_get_alloc_size_rsp& response);
 
 private:
+    // more: the next SET_TENSOR continues this one
+    bool set_tensor_data(const rpc_tensor* in_tensor, uint64_t offset, const void* data, size_t size, bool more);
+    bool get_tensor_data(const rpc_msg_get_tensor_req& request, void* data);
+    bool size_fits_buffer(const rpc_tensor& tensor, uint64_t size);
     bool get_cached_file(uint64_t hash, std::vector<uint8_t>& data);
+    bool get_upload(uint64_t hash, std::vector<uint8_t>& data);
+    void forget_uploads(ggml_backend_buffer_t buffer);
+    std::unique_lock<std::mutex> lock_backend();
     ggml_tensor * deserialize_tensor(struct ggml_context * ctx, const rpc_tensor * tensor);
     ggml_tensor * create_node(uint64_t id,
                               struct ggml_context * ctx,
@@ -957,9 +1353,64 @@ private:
 
     ggml_backend_t backend;
     const char* cache_dir;
+    rpc_server_shared & shared;
+    ggml_backend_t client_backend = nullptr;
     std::unordered_set<ggml_backend_buffer_t> buffers;
+    size_t allocated = 0;
+
+    // hash of the last SET_TENSOR_HASH miss, the client sends the data next
+    uint64_t pending_hash = 0;
+    uint64_t pending_data = 0;
+    uint64_t pending_size = 0;
+
+    // mapped with RPC_CMD_SHM_ATTACH when the client is on the same host
+    std::unique_ptr<rpc_shm> shm;
 };
 
+std::unique_lock<std::mutex> rpc_server::lock_backend() {
+    if (shared.serialize_backend) {
+        return std::unique_lock<std::mutex>(shared.backend_mutex);
+    }
+    return std::unique_lock<std::mutex>();
+}
+
+bool rpc_server::get_upload(uint64_t hash, std::vector<uint8_t>& data) {
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    auto it = shared.uploads.find(hash);
+    if (it == shared.uploads.end()) {
+        return false;
+    }
+    const auto & upload = it->second;
+    struct ggml_init_params params {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+    };
+    struct ggml_context* ctx = ggml_init(params);
+    ggml_tensor* src = ggml_new_tensor_1d(ctx, GGML_TYPE_I8, upload.size);
+    src->buffer = upload.buffer;
+    src->data   = reinterpret_cast<void *>(upload.data);
+    data.resize(upload.size);
+    {
+        auto lock = lock_backend();
+        ggml_backend_tensor_get(src, data.data(), 0, upload.size);
+    }
+    ggml_free(ctx);
+    // the region may have been overwritten since it was uploaded
+    if (fnv_hash(data.data(), data.size()) != hash) {
+        shared.uploads.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void rpc_server::forget_uploads(ggml_backend_buffer_t buffer) {
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    for (auto it = shared.uploads.begin(); it != shared.uploads.end(); ) {
+        it = it->second.buffer == buffer ? shared.uploads.erase(it) : std::next(it);
+    }
+}
+
 void rpc_server::hello(rpc_msg_hello_rsp& response) {
     response.major = RPC_PROTO_MAJOR_VERSION;
     response.minor = RPC_PROTO_MINOR_VERSION;
@@ -992,21 +1443,36 @@ bool rpc_server::get_alloc_size(const rpc_msg_get_alloc_size_req& request, rpc_m
         buft = tensor->buffer->buft;
     }
 
+    auto lock = lock_backend();
     response.alloc_size = ggml_backend_buft_get_alloc_size(buft, tensor);
 
     ggml_free(ctx);
     return true;
 }
 void rpc_server::alloc_buffer(const rpc_msg_alloc_buffer_req& request, rpc_msg_alloc_buffer_rsp& response) {
-    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
-    ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(buft, request.size);
     response.remote_ptr = 0;
     response.remote_size = 0;
+    if (shared.client_mem > 0 && allocated + request.size > shared.client_mem) {
+        // the client sees a failed allocation, the other clients are not affected
+        fprintf(stderr, "[%s] size: %" PRIu64 " -> exceeds the client quota (%zu of %zu bytes used)\n",
+                __func__, request.size, allocated, shared.client_mem);
+        return;
+    }
+    ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(backend);
+    ggml_backend_buffer_t buffer;
+    {
+        auto lock = lock_backend();
+        buffer = ggml_backend_buft_alloc_buffer(buft, request.size);
+    }
     if (buffer != nullptr) {
         response.remote_ptr = reinterpret_cast<uint64_t>(buffer);
         response.remote_size = buffer->size;
         GGML_PRINT_DEBUG("[%s] size: %" PRIu64 " -> remote_ptr: %" PRIx64 ", remote_size: %" PRIu64 "\n", __func__, request.size, response.remote_ptr, response.remote_size);
         buffers.insert(buffer);
+        allocated += buffer->size;
+    }
+    else if (shared.max_clients > 1) {
+        fprintf(stderr, "[%s] size: %" PRIu64 " -> failed\n", __func__, request.size);
     }
     else {
         GGML_ABORT("[%s] size: %" PRIu64 " -> failed\n", __func__, request.size);
@@ -1045,7 +1511,12 @@ bool rpc_server::free_buffer(const rpc_msg_free_buffer_req& request) {
         GGML_ABORT("[%s] buffer not found\n", __func__);
         return false;
     }
-    ggml_backend_buffer_free(buffer);
+    forget_uploads(buffer);
+    allocated -= buffer->size;
+    {
+        auto lock = lock_backend();
+        ggml_backend_buffer_free(buffer);
+    }
     buffers.erase(buffer);
     return true;
 }
@@ -1057,6 +1528,7 @@ bool rpc_server::buffer_clear(const rpc_msg_buffer_clear_req& request) {
         GGML_ABORT("[%s] buffer not found\n", __func__);
         return false;
     }
+    auto lock = lock_backend();
     ggml_backend_buffer_clear(buffer, request.value);
     return true;
 }
@@ -1114,7 +1586,36 @@ bool rpc_server::set_tensor(const std::vector<uint8_t>& input) {
     uint64_t offset;
     memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
     const size_t size = input.size() - sizeof(rpc_tensor) - sizeof(offset);
+    const void* data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
+    return set_tensor_data(in_tensor, offset, data, size, false);
+}
+
+bool rpc_server::set_tensor_shm(const rpc_msg_set_tensor_shm_req& request) {
+    if (!shm || request.size > shm->size) {
+        return false;
+    }
+    // clients split large transfers into chunks filling the whole region
+    return set_tensor_data(&request.tensor, request.offset, shm->data, request.size, request.size == shm->size);
+}
 
+bool rpc_server::set_tensor_conv(const std::vector<uint8_t>& input) {
+    // serialization format: | rpc_msg_tensor_conv_req | converted data |
+    if (input.size() < sizeof(rpc_msg_tensor_conv_req)) {
+        return false;
+    }
+    rpc_msg_tensor_conv_req request;
+    memcpy(&request, input.data(), sizeof(request));
+    const ggml_type wire_type = (ggml_type)request.wire_type;
+    if (request.tensor.type != GGML_TYPE_F32 || !rpc_wire_type_supported(wire_type, request.size) ||
+        input.size() != sizeof(request) + rpc_wire_size(wire_type, request.size)) {
+        return false;
+    }
+    std::vector<float> data(request.size / sizeof(float));
+    rpc_wire_decode(wire_type, input.data() + sizeof(request), data.data(), data.size());
+    return set_tensor_data(&request.tensor, request.offset, data.data(), request.size, false);
+}
+
+bool rpc_server::set_tensor_data(const rpc_tensor* in_tensor, uint64_t offset, const void* data, size_t size, bool more) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
             /*.mem_buffer =*/ NULL,
@@ -1141,7 +1642,6 @@ bool rpc_server::set_tensor(const std::vector<uint8_t>& input) {
         }
     }
 
-    const void* data = input.data() + sizeof(rpc_tensor) + sizeof(offset);
     if (cache_dir && size > HASH_THRESHOLD) {
         uint64_t hash = fnv_hash((const uint8_t*)data, size);
         char hash_str[17];
@@ -1152,7 +1652,21 @@ bool rpc_server::set_tensor(const std::vector<uint8_t>& input) {
         ofs.write((const char*)data, size);
         printf("[%s] saved to '%s'\n", __func__, cache_file.c_str());
     }
-    ggml_backend_tensor_set(tensor, data, offset, size);
+    {
+        auto lock = lock_backend();
+        ggml_backend_tensor_set(tensor, data, offset, size);
+    }
+    if (pending_hash != 0 && pending_data + pending_size == in_tensor->data + offset) {
+        // remember where the data is, for clients uploading the same data later
+        pending_size += size;
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.uploads[pending_hash] = { tensor->buffer, pending_data, pending_size };
+    } else {
+        more = false;
+    }
+    if (!more) {
+        pending_hash = 0;
+    }
     ggml_free(ctx);
     return true;
 }
@@ -1188,7 +1702,10 @@ bool rpc_server::set_tensor_hash(const std::vector<uint8_t>& input, rpc_msg_set_
     memcpy(&offset, input.data() + sizeof(rpc_tensor), sizeof(offset));
     const uint64_t* hash = (const uint64_t*)(input.data() + sizeof(rpc_tensor) + sizeof(offset));
     std::vector<uint8_t> cached_file;
-    if (!get_cached_file(*hash, cached_file)) {
+    if (!get_upload(*hash, cached_file) && !get_cached_file(*hash, cached_file)) {
+        pending_hash = *hash;
+        pending_data = in_tensor->data + offset;
+        pending_size = 0;
         response.result = 0;
         return true;
     }
@@ -1218,7 +1735,10 @@ bool rpc_server::set_tensor_hash(const std::vector<uint8_t>& input, rpc_msg_set_
             return false;
         }
     }
-    ggml_backend_tensor_set(tensor, cached_file.data(), offset, size);
+    {
+        auto lock = lock_backend();
+        ggml_backend_tensor_set(tensor, cached_file.data(), offset, size);
+    }
     response.result = 1;
     ggml_free(ctx);
     return true;
@@ -1239,6 +1759,7 @@ bool rpc_server::init_tensor(const rpc_msg_init_tensor_req& request) {
     }
 
     // Call the backend's buffer_init_tensor function
+    auto lock = lock_backend();
     ggml_backend_buffer_t buffer = tensor->buffer;
     if (buffer && buffer->iface.init_tensor) {
         buffer->iface.init_tensor(buffer, tensor);
@@ -1259,7 +1780,52 @@ bool rpc_server::init_tensor(const rpc_msg_init_tensor_req& request) {
     return true;
 }
 
+bool rpc_server::size_fits_buffer(const rpc_tensor& tensor, uint64_t size) {
+    // checked before allocating memory for the data, get_tensor_data checks the exact region
+    auto buffer = reinterpret_cast<ggml_backend_buffer_t>(tensor.buffer);
+    return buffers.find(buffer) != buffers.end() && size <= ggml_backend_buffer_get_size(buffer);
+}
+
 bool rpc_server::get_tensor(const rpc_msg_get_tensor_req& request, std::vector<uint8_t>& response) {
+    if (!size_fits_buffer(request.tensor, request.size)) {
+        return false;
+    }
+    response.resize(request.size, 0);
+    return get_tensor_data(request, response.data());
+}
+
+bool rpc_server::get_tensor_conv(const rpc_msg_tensor_conv_req& request, std::vector<uint8_t>& response) {
+    const ggml_type wire_type = (ggml_type)request.wire_type;
+    if (request.tensor.type != GGML_TYPE_F32 || !rpc_wire_type_supported(wire_type, request.size) ||
+        !size_fits_buffer(request.tensor, request.size)) {
+        return false;
+    }
+    rpc_msg_get_tensor_req get_request;
+    get_request.tensor = request.tensor;
+    get_request.offset = request.offset;
+    get_request.size   = request.size;
+    std::vector<float> data(request.size / sizeof(float));
+    if (!get_tensor_data(get_request, data.data())) {
+        return false;
+    }
+    if (!rpc_wire_all_finite(data.data(), data.size())) {
+        response.resize(request.size);
+        memcpy(response.data(), data.data(), request.size);
+        return true;
+    }
+    response.resize(rpc_wire_size(wire_type, request.size));
+    rpc_wire_encode(wire_type, data.data(), response.data(), data.size());
+    return true;
+}
+
+bool rpc_server::get_tensor_shm(const rpc_msg_get_tensor_req& request) {
+    if (!shm || request.size > shm->size) {
+        return false;
+    }
+    return get_tensor_data(request, shm->data);
+}
+
+bool rpc_server::get_tensor_data(const rpc_msg_get_tensor_req& request, void* data) {
     struct ggml_init_params params {
         /*.mem_size   =*/ ggml_tensor_overhead(),
             /*.mem_buffer =*/ NULL,
@@ -1288,11 +1854,64 @@ bool rpc_server::get_tensor(const rpc_msg_get_tensor_req& request, std::vector<u
         }
     }
 
-    response.resize(request.size, 0);
-    ggml_backend_tensor_get(tensor, response.data(), request.offset, request.size);
+    auto lock = lock_backend();
+    ggml_backend_tensor_get(tensor, data, request.offset, request.size);
     ggml_free(ctx);
     return true;
 }
+bool rpc_server::shm_attach(sockfd_t sockfd, const rpc_msg_shm_attach_req& request, rpc_msg_shm_attach_rsp& response) {
+    // failures are not fatal, the client keeps using the socket
+    response.result = 0;
+#ifdef GGML_RPC_SHM
+    // only clients on this host may attach, and only to a region created by rpc_shm_connect
+    if (!is_local_peer(sockfd)) {
+        fprintf(stderr, "[%s] refusing shared memory for a remote client\n", __func__);
+        return true;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%" PRIu64 "/fd/%" PRId64, request.pid, request.fd);
+    auto region = std::make_unique<rpc_shm>();
+    region->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (region->fd < 0) {
+        GGML_PRINT_DEBUG("[%s] cannot open %s\n", __func__, path);
+        return true;
+    }
+    // check what was actually opened, the link may have changed in the meantime
+    char self_path[64];
+    snprintf(self_path, sizeof(self_path), "/proc/self/fd/%d", region->fd);
+    char target[64] = {};
+    static const char shm_prefix[] = "/memfd:ggml-rpc";
+    const ssize_t target_len = readlink(self_path, target, sizeof(target) - 1);
+    if (target_len < (ssize_t)(sizeof(shm_prefix) - 1) || strncmp(target, shm_prefix, sizeof(shm_prefix) - 1) != 0) {
+        fprintf(stderr, "[%s] refusing shared memory: %s is not a ggml-rpc region\n", __func__, path);
+        return true;
+    }
+    struct stat st;
+    if (fstat(region->fd, &st) != 0 || (uint64_t)st.st_size < request.size || request.size < sizeof(uint64_t)) {
+        GGML_PRINT_DEBUG("[%s] cannot use shared memory region %s\n", __func__, path);
+        return true;
+    }
+    void * data = mmap(nullptr, request.size, PROT_READ | PROT_WRITE, MAP_SHARED, region->fd, 0);
+    if (data == MAP_FAILED) {
+        return true;
+    }
+    region->data = data;
+    region->size = request.size;
+    // make sure this is the client's region and not a file of an unrelated process with the same pid
+    uint64_t magic;
+    memcpy(&magic, data, sizeof(magic));
+    if (magic != request.magic) {
+        return true;
+    }
+    shm = std::move(region);
+    response.result = 1;
+#else
+    UNUSED(sockfd);
+    UNUSED(request);
+#endif
+    return true;
+}
+
 bool rpc_server::copy_tensor(const rpc_msg_copy_tensor_req& request, rpc_msg_copy_tensor_rsp& response) {
     struct ggml_init_params params {
         /*.mem_size   =*/ 2 * ggml_tensor_overhead(),
@@ -1434,7 +2053,18 @@ bool rpc_server::graph_compute(const std::vector<uint8_t>& input, rpc_msg_graph_
             return false;
         }
     }
-    ggml_status status = ggml_backend_graph_compute(backend, graph);
+    ggml_backend_t compute_backend = backend;
+    if (client_backend) {
+        int n_clients;
+        {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            n_clients = shared.n_clients;
+        }
+        ggml_backend_cpu_set_n_threads(client_backend, std::max(1, shared.n_threads/std::max(1, n_clients)));
+        compute_backend = client_backend;
+    }
+    auto lock = lock_backend();
+    ggml_status status = ggml_backend_graph_compute(compute_backend, graph);
     response.result = status;
     ggml_free(ctx);
     return true;
@@ -1442,12 +2072,17 @@ bool rpc_server::graph_compute(const std::vector<uint8_t>& input, rpc_msg_graph_
 
 rpc_server::~rpc_server() {
     for (auto buffer : buffers) {
+        forget_uploads(buffer);
+        auto lock = lock_backend();
         ggml_backend_buffer_free(buffer);
     }
+    if (client_backend) {
+        ggml_backend_free(client_backend);
+    }
 }
-static void rpc_serve_client(ggml_backend_t backend, const char* cache_dir,
+static void rpc_serve_client(ggml_backend_t backend, const char* cache_dir, rpc_server_shared & shared,
     sockfd_t sockfd, size_t free_mem, size_t total_mem) {
-    rpc_server server(backend, cache_dir);
+    rpc_server server(backend, cache_dir, shared);
     uint8_t cmd;
     if (!recv_data(sockfd, &cmd, 1)) {
         return;
@@ -1616,6 +2251,73 @@ static void rpc_serve_client(ggml_backend_t backend, const char* cache_dir,
             }
             break;
         }
+        case RPC_CMD_SHM_ATTACH: {
+            rpc_msg_shm_attach_req request;
+            if (!recv_msg(sockfd, &request, sizeof(request))) {
+                return;
+            }
+            rpc_msg_shm_attach_rsp response;
+            if (!server.shm_attach(sockfd, request, response)) {
+                return;
+            }
+            if (!send_msg(sockfd, &response, sizeof(response))) {
+                return;
+            }
+            break;
+        }
+        case RPC_CMD_SET_TENSOR_SHM: {
+            rpc_msg_set_tensor_shm_req request;
+            if (!recv_msg(sockfd, &request, sizeof(request))) {
+                return;
+            }
+            if (!server.set_tensor_shm(request)) {
+                return;
+            }
+            if (!send_msg(sockfd, nullptr, 0)) {
+                return;
+            }
+            break;
+        }
+        case RPC_CMD_GET_TENSOR_SHM: {
+            rpc_msg_get_tensor_req request;
+            if (!recv_msg(sockfd, &request, sizeof(request))) {
+                return;
+            }
+            if (!server.get_tensor_shm(request)) {
+                return;
+            }
+            if (!send_msg(sockfd, nullptr, 0)) {
+                return;
+            }
+            break;
+        }
+        case RPC_CMD_SET_TENSOR_CONV: {
+            std::vector<uint8_t> input;
+            if (!recv_msg(sockfd, input)) {
+                return;
+            }
+            if (!server.set_tensor_conv(input)) {
+                return;
+            }
+            if (!send_msg(sockfd, nullptr, 0)) {
+                return;
+            }
+            break;
+        }
+        case RPC_CMD_GET_TENSOR_CONV: {
+            rpc_msg_tensor_conv_req request;
+            if (!recv_msg(sockfd, &request, sizeof(request))) {
+                return;
+            }
+            std::vector<uint8_t> response;
+            if (!server.get_tensor_conv(request, response)) {
+                return;
+            }
+            if (!send_msg(sockfd, response.data(), response.size())) {
+                return;
+            }
+            break;
+        }
         case RPC_CMD_COPY_TENSOR: {
             rpc_msg_copy_tensor_req request;
             if (!recv_msg(sockfd, &request, sizeof(request))) {
@@ -1651,6 +2353,10 @@ static void rpc_serve_client(ggml_backend_t backend, const char* cache_dir,
             rpc_msg_get_device_memory_rsp response;
             response.free_mem = free_mem;
             response.total_mem = total_mem;
+            if (shared.client_mem > 0) {
+                response.free_mem  = std::min(free_mem,  shared.client_mem);
+                response.total_mem = std::min(total_mem, shared.client_mem);
+            }
             if (!send_msg(sockfd, &response, sizeof(response))) {
                 return;
             }
@@ -1668,6 +2374,20 @@ static void rpc_serve_client(ggml_backend_t backend, const char* cache_dir,
 void ggml_backend_rpc_start_server(ggml_backend_t backend, const char* endpoint,
     const char* cache_dir,
     size_t free_mem, size_t total_mem) {
+    ggml_backend_rpc_start_server_mt(backend, endpoint, cache_dir, free_mem, total_mem, 1, 0, 0);
+}
+
+void ggml_backend_rpc_start_server_mt(ggml_backend_t backend, const char* endpoint,
+    const char* cache_dir,
+    size_t free_mem, size_t total_mem,
+    int max_clients, size_t client_mem, int n_threads) {
+    // the serving threads are detached, so the shared state must outlive this function
+    auto shared = std::make_shared<rpc_server_shared>();
+    shared->max_clients       = std::max(1, max_clients);
+    shared->client_mem        = client_mem;
+    shared->n_threads         = n_threads;
+    shared->serialize_backend = !ggml_backend_is_cpu(backend);
+
     std::string host;
     int port;
     if (!parse_endpoint(endpoint, host, port)) {
@@ -1694,11 +2414,32 @@ void ggml_backend_rpc_start_server(ggml_backend_t backend, const char* endpoint,
             fprintf(stderr, "Failed to accept client connection\n");
             return;
         }
-        printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
-        fflush(stdout);
-        rpc_serve_client(backend, cache_dir, client_socket->fd, free_mem, total_mem);
-        printf("Client connection closed\n");
-        fflush(stdout);
+        if (shared->max_clients == 1) {
+            printf("Accepted client connection, free_mem=%zu, total_mem=%zu\n", free_mem, total_mem);
+            fflush(stdout);
+            rpc_serve_client(backend, cache_dir, *shared, client_socket->fd, free_mem, total_mem);
+            printf("Client connection closed\n");
+            fflush(stdout);
+            continue;
+        }
+        {
+            // connections beyond max_clients wait for a client to disconnect
+            std::unique_lock<std::mutex> lock(shared->mutex);
+            shared->cv.wait(lock, [&shared] { return shared->n_clients < shared->max_clients; });
+            shared->n_clients++;
+            printf("Accepted client connection, %d clients connected\n", shared->n_clients);
+            fflush(stdout);
+        }
+        std::thread([=]() {
+            rpc_serve_client(backend, cache_dir, *shared, client_socket->fd, free_mem, total_mem);
+            {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->n_clients--;
+                printf("Client connection closed, %d clients connected\n", shared->n_clients);
+                fflush(stdout);
+            }
+            shared->cv.notify_all();
+        }).detach();
     }
 #ifdef _WIN32
     WSACleanup();
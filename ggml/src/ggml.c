@@ -4114,9 +4114,12 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
 
     "CROSS_ENTROPY_LOSS",
     "CROSS_ENTROPY_LOSS_BACK",
+
+    "ROPE_CACHE",
+    "ROPE_FAST",
 };
 
-static_assert(GGML_OP_COUNT == 83, "GGML_OP_COUNT != 82");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4211,9 +4214,12 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
 
     "cross_entropy_loss(x,y)",
     "cross_entropy_loss_back(x,y)",
+
+    "rope_cache(x)",
+    "rope_fast(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 83, "GGML_OP_COUNT != 82");
+static_assert(GGML_OP_COUNT == 85, "GGML_OP_COUNT != 85");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -8406,6 +8412,83 @@ struct ggml_tensor * ggml_rope_back(
     return result;
 }
 
+// ggml_rope_cache
+
+struct ggml_tensor * ggml_rope_cache(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx_orig,
+        float                 freq_base,
+        float                 freq_scale,
+        float                 ext_factor,
+        float                 attn_factor,
+        float                 beta_fast,
+        float                 beta_slow) {
+    GGML_ASSERT((mode == 0 || mode == 2) && "ggml_rope_cache only supports the normal and NeoX modes");
+    GGML_ASSERT(n_dims > 0 && n_dims % 2 == 0);
+
+    GGML_ASSERT(ggml_is_vector(b));
+    GGML_ASSERT(b->type == GGML_TYPE_I32);
+
+    if (c) {
+        GGML_ASSERT(c->type == GGML_TYPE_F32);
+        GGML_ASSERT(c->ne[0] >= n_dims / 2);
+    }
+
+    struct ggml_tensor * result = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_dims, b->ne[0]);
+
+    int32_t params[11] = { /*n_past*/ 0, n_dims, mode, /*n_ctx*/ 0, n_ctx_orig };
+    memcpy(params +  5, &freq_base,    sizeof(float));
+    memcpy(params +  6, &freq_scale,   sizeof(float));
+    memcpy(params +  7, &ext_factor,   sizeof(float));
+    memcpy(params +  8, &attn_factor,  sizeof(float));
+    memcpy(params +  9, &beta_fast,    sizeof(float));
+    memcpy(params + 10, &beta_slow,    sizeof(float));
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_ROPE_CACHE;
+    result->grad = NULL;
+    result->src[0] = b;
+    result->src[1] = c;
+
+    return result;
+}
+
+// ggml_rope_fast
+
+struct ggml_tensor * ggml_rope_fast(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * cache) {
+    GGML_ASSERT(cache->op == GGML_OP_ROPE_CACHE);
+    GGML_ASSERT(a->type == GGML_TYPE_F32 || a->type == GGML_TYPE_F16);
+    GGML_ASSERT(a->ne[2] == cache->ne[1]);
+    GGML_ASSERT(a->ne[0] >= cache->ne[0]);
+
+    bool is_node = false;
+
+    if (a->grad) {
+        GGML_ABORT("fatal error"); // TODO: implement backward
+        is_node = true;
+    }
+
+    struct ggml_tensor * result = ggml_dup_tensor(ctx, a);
+
+    // n_dims and mode of the table
+    int32_t params[2] = { ggml_get_op_params_i32(cache, 1), ggml_get_op_params_i32(cache, 2) };
+    ggml_set_op_params(result, params, sizeof(params));
+
+    result->op   = GGML_OP_ROPE_FAST;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = a;
+    result->src[1] = cache;
+
+    return result;
+}
+
 // ggml_clamp
 
 struct ggml_tensor * ggml_clamp(
@@ -11766,6 +11849,61 @@ static void ggml_compute_forward_add_id_f32(
     }
 }
 
+// residual add followed by the per-row indexed add of the control vectors: both results are written in one pass
+// over the rows, so the sum is not read back from memory. Returns false if the two ops do not have this form.
+static bool ggml_compute_forward_add_add_id(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * add,
+        struct ggml_tensor * add_id) {
+
+    const struct ggml_tensor * src0 = add->src[0];
+    const struct ggml_tensor * src1 = add->src[1];
+    const struct ggml_tensor * dirs = add_id->src[1];
+    const struct ggml_tensor * ids  = add_id->src[2];
+
+    if (add_id->src[0] != add || add->type != GGML_TYPE_F32 || src0->type != GGML_TYPE_F32 || src1->type != GGML_TYPE_F32 ||
+        add_id->type != GGML_TYPE_F32 || dirs->type != GGML_TYPE_F32 || !ggml_are_same_shape(src0, src1) ||
+        !ggml_is_contiguous_rows(src0) || !ggml_is_contiguous_rows(src1) || !ggml_is_contiguous_rows(add) ||
+        !ggml_is_contiguous_rows(add_id) || dirs->nb[0] != sizeof(float)) {
+        return false;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne0 = add->ne[0];
+    const int64_t ne1 = add->ne[1];
+    const int64_t ne2 = add->ne[2];
+    const int64_t nr  = ggml_nrows(add);
+
+    const int64_t dr  = (nr + nth - 1)/nth;
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const int32_t id = *(const int32_t *) ((const char *) ids->data + i1*ids->nb[0] + i2*ids->nb[1]);
+        GGML_ASSERT(id >= 0 && id < dirs->ne[1]);
+
+        float       * x = (float *) ((char *) add->data    + i3*add->nb[3]    + i2*add->nb[2]    + i1*add->nb[1]);
+        float       * y = (float *) ((char *) add_id->data + i3*add_id->nb[3] + i2*add_id->nb[2] + i1*add_id->nb[1]);
+        const float * a = (const float *) ((const char *) src0->data + i3*src0->nb[3] + i2*src0->nb[2] + i1*src0->nb[1]);
+        const float * b = (const float *) ((const char *) src1->data + i3*src1->nb[3] + i2*src1->nb[2] + i1*src1->nb[1]);
+        const float * d = (const float *) ((const char *) dirs->data + id*dirs->nb[1]);
+
+        for (int64_t i0 = 0; i0 < ne0; ++i0) {
+            const float sum = a[i0] + b[i0];
+            x[i0] = sum;
+            y[i0] = sum + d[i0];
+        }
+    }
+
+    return true;
+}
+
 static void ggml_compute_forward_add_id(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst) {
@@ -17545,6 +17683,73 @@ GGML_CALL void ggml_rope_yarn_corr_dims(
     dims[1] = MIN(n_dims - 1, end);
 }
 
+bool ggml_rope_rows_supported(enum ggml_type type, int mode) {
+    if (mode != 0 && mode != 2) { // normal or NeoX
+        return false;
+    }
+    if (type == GGML_TYPE_F32) {
+        return true;
+    }
+    // interleaved types store several rows together
+    if (type >= GGML_TYPE_Q4_0_R8 || type == GGML_TYPE_Q4_0_4_4 || type == GGML_TYPE_Q4_0_4_8 || type == GGML_TYPE_Q4_0_8_8) {
+        return false;
+    }
+    return type_traits[type].to_float && type_traits[type].from_float;
+}
+
+void ggml_rope_rows_inplace(
+        enum ggml_type type, void * data, size_t row_size, int64_t n_per_row, int64_t n_embd_head,
+        const int32_t * rows, const int32_t * pos, int64_t n_rows, const float * freq_factors,
+        int n_dims, int mode, int n_ctx_orig, float freq_base, float freq_scale,
+        float ext_factor, float attn_factor, float beta_fast, float beta_slow) {
+    GGML_ASSERT(ggml_rope_rows_supported(type, mode));
+    GGML_ASSERT(n_dims <= n_embd_head && n_dims % 2 == 0 && n_per_row % n_embd_head == 0);
+
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+
+    float corr_dims[2];
+    ggml_rope_yarn_corr_dims(n_dims, n_ctx_orig, freq_base, beta_fast, beta_slow, corr_dims);
+
+    const bool is_neox = mode & 2;
+    const int  offset  = is_neox ? n_dims/2 : 1;
+
+    float * cache = (float *)malloc((n_dims + (type == GGML_TYPE_F32 ? 0 : n_per_row))*sizeof(float));
+    float * x     = cache + n_dims;
+
+    for (int64_t ir = 0; ir < n_rows; ++ir) {
+        char * row = (char *)data + rows[ir]*row_size;
+        if (type == GGML_TYPE_F32) {
+            x = (float *)row;
+        } else {
+            type_traits[type].to_float(row, x, n_per_row);
+        }
+
+        ggml_rope_cache_init(pos[ir], freq_scale, freq_factors, corr_dims, n_dims, ext_factor, attn_factor, cache, 1.0f, theta_scale);
+
+        for (int64_t ih = 0; ih < n_per_row; ih += n_embd_head) {
+            float * h = x + ih;
+            for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                const float cos_theta = cache[i0 + 0];
+                const float sin_theta = cache[i0 + 1];
+
+                float * v = is_neox ? h + i0/2 : h + i0;
+
+                const float x0 = v[0];
+                const float x1 = v[offset];
+
+                v[0]      = x0*cos_theta - x1*sin_theta;
+                v[offset] = x0*sin_theta + x1*cos_theta;
+            }
+        }
+
+        if (type != GGML_TYPE_F32) {
+            type_traits[type].from_float(x, row, n_per_row);
+        }
+    }
+
+    free(cache);
+}
+
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         struct ggml_tensor * dst,
@@ -17817,6 +18022,123 @@ static void ggml_compute_forward_rope(
     }
 }
 
+// ggml_compute_forward_rope_cache
+
+static void ggml_compute_forward_rope_cache(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    float freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow;
+
+    const int n_dims     = ((int32_t *) dst->op_params)[1];
+    const int n_ctx_orig = ((int32_t *) dst->op_params)[4];
+
+    memcpy(&freq_base,   (int32_t *) dst->op_params +  5, sizeof(float));
+    memcpy(&freq_scale,  (int32_t *) dst->op_params +  6, sizeof(float));
+    memcpy(&ext_factor,  (int32_t *) dst->op_params +  7, sizeof(float));
+    memcpy(&attn_factor, (int32_t *) dst->op_params +  8, sizeof(float));
+    memcpy(&beta_fast,   (int32_t *) dst->op_params +  9, sizeof(float));
+    memcpy(&beta_slow,   (int32_t *) dst->op_params + 10, sizeof(float));
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && dst->ne[0] == n_dims);
+
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+
+    float corr_dims[2];
+    ggml_rope_yarn_corr_dims(n_dims, n_ctx_orig, freq_base, beta_fast, beta_slow, corr_dims);
+
+    const float * freq_factors = src1 ? (const float *) src1->data : NULL;
+
+    const int32_t * pos = (const int32_t *) src0->data;
+
+    for (int64_t i1 = params->ith; i1 < dst->ne[1]; i1 += params->nth) {
+        float * cache = (float *)((char *) dst->data + i1*dst->nb[1]);
+        ggml_rope_cache_init(pos[i1], freq_scale, freq_factors, corr_dims, n_dims, ext_factor, attn_factor, cache, 1.0f, theta_scale);
+    }
+}
+
+// ggml_compute_forward_rope_fast
+
+static void ggml_compute_forward_rope_fast(
+        const struct ggml_compute_params * params,
+        struct ggml_tensor * dst) {
+
+    const struct ggml_tensor * src0 = dst->src[0];
+    const struct ggml_tensor * src1 = dst->src[1];
+
+    const int n_dims = ((int32_t *) dst->op_params)[0];
+    const int mode   = ((int32_t *) dst->op_params)[1];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    const bool is_neox = mode & 2;
+    const bool is_f16  = src0->type == GGML_TYPE_F16;
+
+    // for the normal mode the pairs are adjacent, for NeoX they are n_dims/2 apart
+    const int64_t pair_stride = is_neox ? n_dims/2 : 1;
+    const int64_t pair_step   = is_neox ? 1 : 2;
+
+    const int64_t nr = ne1*ne2*ne3;
+
+    // rows per thread
+    const int64_t dr = (nr + params->nth - 1)/params->nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*params->ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne1*ne2);
+        const int64_t i2 = (ir - i3*ne1*ne2)/ne1;
+        const int64_t i1 = ir - i3*ne1*ne2 - i2*ne1;
+
+        const float * cache = (const float *)((const char *) src1->data + i2*src1->nb[1]);
+
+        const char * src_row = (const char *) src0->data + i3*nb03 + i2*nb02 + i1*nb01;
+              char * dst_row = (char *)        dst->data + i3*nb3  + i2*nb2  + i1*nb1;
+
+        if (is_f16) {
+            for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                const float cos_theta = cache[i0 + 0];
+                const float sin_theta = cache[i0 + 1];
+
+                const int64_t ic = i0/2*pair_step;
+
+                const float x0 = GGML_FP16_TO_FP32(*(const ggml_fp16_t *)(src_row + ic*nb00));
+                const float x1 = GGML_FP16_TO_FP32(*(const ggml_fp16_t *)(src_row + (ic + pair_stride)*nb00));
+
+                *(ggml_fp16_t *)(dst_row + ic*nb0)                 = GGML_FP32_TO_FP16(x0*cos_theta - x1*sin_theta);
+                *(ggml_fp16_t *)(dst_row + (ic + pair_stride)*nb0) = GGML_FP32_TO_FP16(x0*sin_theta + x1*cos_theta);
+            }
+            for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                *(ggml_fp16_t *)(dst_row + i0*nb0) = *(const ggml_fp16_t *)(src_row + i0*nb00);
+            }
+        } else {
+            GGML_ASSERT(nb00 == sizeof(float));
+            const float * x = (const float *) src_row;
+                  float * y = (float *) dst_row;
+            for (int64_t i0 = 0; i0 < n_dims; i0 += 2) {
+                const float cos_theta = cache[i0 + 0];
+                const float sin_theta = cache[i0 + 1];
+
+                const int64_t ic = i0/2*pair_step;
+
+                const float x0 = x[ic];
+                const float x1 = x[ic + pair_stride];
+
+                y[ic]               = x0*cos_theta - x1*sin_theta;
+                y[ic + pair_stride] = x0*sin_theta + x1*cos_theta;
+            }
+            for (int64_t i0 = n_dims; i0 < ne0; ++i0) {
+                y[i0] = x[i0];
+            }
+        }
+    }
+}
+
 // ggml_compute_forward_rope_back
 
 static void ggml_compute_forward_rope_back(
@@ -20406,7 +20728,11 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_ADD:
             {
-                ggml_compute_forward_add(params, tensor);
+                if (next && next->op == GGML_OP_ADD_ID && ggml_compute_forward_add_add_id(params, tensor, next)) {
+                    skip_next = true;
+                } else {
+                    ggml_compute_forward_add(params, tensor);
+                }
             } break;
        case GGML_OP_ADD_ID:
             {
@@ -20600,6 +20926,14 @@ static bool ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_rope_back(params, tensor);
             } break;
+        case GGML_OP_ROPE_CACHE:
+            {
+                ggml_compute_forward_rope_cache(params, tensor);
+            } break;
+        case GGML_OP_ROPE_FAST:
+            {
+                ggml_compute_forward_rope_fast(params, tensor);
+            } break;
         case GGML_OP_CLAMP:
             {
                 ggml_compute_forward_clamp(params, tensor);
@@ -21597,6 +21931,11 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_ROPE_CACHE:
+        case GGML_OP_ROPE_FAST:
+            {
+                GGML_ABORT("fatal error"); // TODO: not implemented
+            }
         case GGML_OP_CLAMP:
             {
                 GGML_ABORT("fatal error"); // TODO: not implemented
@@ -22224,11 +22563,44 @@ static void clear_numa_thread_affinity(void) {
 
     CPU_FREE(cpus);
 }
+
+struct ggml_thread_affinity {
+    cpu_set_t cpus;
+    bool      valid;
+};
+
+static void save_thread_affinity(struct ggml_thread_affinity * affinity) {
+    affinity->valid = pthread_getaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus) == 0;
+}
+
+static void restore_thread_affinity(const struct ggml_thread_affinity * affinity) {
+    if (affinity->valid) {
+        pthread_setaffinity_np(pthread_self(), sizeof(affinity->cpus), &affinity->cpus);
+    }
+}
+
+static void set_core_thread_affinity(int core) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    int rv = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (rv) {
+        fprintf(stderr, "warning: pthread_setaffinity_np() failed: %s\n", strerror(rv));
+    }
+}
 #else
 // TODO: Windows etc.
 // (the linux implementation may also work on BSD, someone should test)
 static void set_numa_thread_affinity(int thread_n) { UNUSED(thread_n);  }
 static void clear_numa_thread_affinity(void) {}
+
+struct ggml_thread_affinity {
+    bool valid;
+};
+
+static void save_thread_affinity(struct ggml_thread_affinity * affinity) { affinity->valid = false; }
+static void restore_thread_affinity(const struct ggml_thread_affinity * affinity) { UNUSED(affinity); }
+static void set_core_thread_affinity(int core) { UNUSED(core); }
 #endif
 
 static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
@@ -22337,6 +22709,8 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_SOFT_MAX_BACK:
         case GGML_OP_ROPE:
         case GGML_OP_ROPE_BACK:
+        case GGML_OP_ROPE_CACHE:
+        case GGML_OP_ROPE_FAST:
         case GGML_OP_ADD_REL_POS:
             {
                 n_tasks = n_threads;
@@ -22702,7 +23076,14 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     const struct ggml_cgraph * cgraph = state->shared->cgraph;
     const struct ggml_cplan  * cplan  = state->shared->cplan;
 
-    set_numa_thread_affinity(state->ith);
+    // with explicit cores the previous affinity is restored on exit, as OpenMP threads are reused
+    struct ggml_thread_affinity affinity;
+    if (cplan->n_cpu_cores > 0) {
+        save_thread_affinity(&affinity);
+        set_core_thread_affinity(cplan->cpu_cores[state->ith % cplan->n_cpu_cores]);
+    } else {
+        set_numa_thread_affinity(state->ith);
+    }
 
     struct ggml_compute_params params = {
         /*.ith   =*/ state->ith,
@@ -22748,6 +23129,10 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
     if (state->ith == 0) printf("ggml_barrier(...): %d us\n", (int)(t_end - t_start - t_eval));
 #endif
 
+    if (cplan->n_cpu_cores > 0) {
+        restore_thread_affinity(&affinity);
+    }
+
     return 0;
 }
 
@@ -1337,6 +1337,23 @@ struct FlashQKfp32 {
     }
 };
 
+// Returns true if the mask for nq rows of q and the next k_step rows of k is -INFINITY everywhere.
+// With causal attention this is the case for all k-blocks past the last q position in the block
+// of q rows being processed, with SWA also for all k-blocks that are outside of the window.
+// Such blocks do not contribute to the result, so we skip them instead of computing K*Q,
+// applying the mask, and accumulating V with zero weights.
+template <int k_step>
+inline bool is_masked_block(int nq, int stride_m, const char * mask) {
+    if (stride_m == 0) nq = 1;
+    for (int j = 0; j < nq; ++j) {
+        auto m = (const uint16_t *)(mask + j*stride_m);
+        uint16_t diff = 0;
+        for (int l = 0; l < k_step; ++l) diff |= m[l] ^ 0xfc00; // 0xfc00 is -INFINITY as fp16
+        if (diff) return false;
+    }
+    return true;
+}
+
 template <int Dk, int Dv, int q_step, int k_step, typename KHelper, typename VHelper, typename KQHelper>
 void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, int stride_m, int stride_qkv,
         FlashMS<q_step, k_step>& fms,
@@ -1356,6 +1373,12 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1383,6 +1406,12 @@ void compute_helper(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q, in
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #ifdef __aarch64__
             KQHelper::multiply_mask_kq(n_left, kh, Dk, stride_m, q_f16, mr, fms);
 #else
@@ -1415,6 +1444,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
             HelperQ80::convert<Dk>(q_step, stride_q, q, q8r);
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+                if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
                 HelperQ80R8<Dk>::repack(k_step, kh.block, kh.stride, q8r8);
                 KQHelper::mul_mask_kq(khr8, stride_m, q8r, mr, fms);
                 fqkv.accumulate_qkv(vh, fms);
@@ -1442,6 +1477,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
 #endif
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
 #if FA_TIMING
             t1 = Perf::cur_time();
             KQHelper::mul_mask_kq(kh, stride_m, q8, mr, fms);
@@ -1478,6 +1519,12 @@ void compute_helper_q(KHelper& kh, VHelper& vh, int nq1, int nk1, int stride_q,
         HelperQ80::convert<Dk>(n_left, stride_q, q, q8);
         auto mr = mask;
         for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+            if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                kh.next_block(k_step);
+                vh.next_block(k_step);
+                mr += k_step*sizeof(ggml_half);
+                continue;
+            }
             KQHelper::mul_mask_kq(n_left, kh, stride_m, q8, mr, fms);
             fqkv.accumulate_qkv(n_left, vh, fms);
             kh.next_block(k_step);
@@ -1960,6 +2007,12 @@ struct FlashAttnBF16 {
 #endif
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+                if (is_masked_block<k_step>(q_step, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
 #if FA_TIMING
                 //t1 = Perf::cur_time();
                 FlashQKbf16<Dk, q_step, k_step>::multiply_mask_kq(kh, stride_m, q_bf16, mr, fms, perf);
@@ -1995,6 +2048,12 @@ struct FlashAttnBF16 {
             FlashQKbf16<Dk, q_step, k_step>::convert(n_left, stride_q, q, q_bf16);
             auto mr = mask;
             for (int k1 = 0; k1 < nk1/k_step; ++k1) {
+                if (is_masked_block<k_step>(n_left, stride_m, mr)) {
+                    kh.next_block(k_step);
+                    vh.next_block(k_step);
+                    mr += k_step*sizeof(ggml_half);
+                    continue;
+                }
                 FlashQKbf16<Dk, q_step, k_step>::multiply_mask_kq(n_left, kh, stride_m, q_bf16, mr, fms);
                 fqkv.accumulate_qkv(n_left, vh, fms);
                 kh.next_block(k_step);
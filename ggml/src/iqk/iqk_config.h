@@ -48,3 +48,7 @@
 #endif
 #endif
 
+
+// bits returned by iqk_kernel_features()
+#define IQK_FEATURE_FANCY_SIMD 1 // AVX512 kernels, run-time repacked Q8_0_R8, Q8_K_R8 and Q8_KV_R8 quants are unsigned
+#define IQK_FEATURE_BF16_R16   2 // AVX512-BF16 kernels for BF16_R16
@@ -0,0 +1,208 @@
+//
+// Copyright (C) 2024-2025 Iwan Kawrakow
+// MIT license
+// SPDX-License-Identifier: MIT
+//
+
+//
+// Runtime selection of the iqk kernels (GGML_IQK_CPU_VARIANTS)
+//
+// The iqk kernels are compiled once per CPU level, with the entry points of each copy renamed to <name>_<variant>.
+// The first variant supported by the CPU is selected on first use. GGML_IQK_VARIANT=<variant> can be used to
+// force a lower level, e.g. to compare performance.
+//
+
+#include "iqk_mul_mat.h"
+#include "ggml.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined __aarch64__ && defined __linux__
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define IQK_VARIANT_DECL(v) \
+    extern "C" { \
+        decltype(iqk_mul_mat)            iqk_mul_mat_##v; \
+        decltype(iqk_mul_mat_4d)         iqk_mul_mat_4d_##v; \
+        decltype(iqk_mul_mat_moe)        iqk_mul_mat_moe_##v; \
+        decltype(iqk_moe_fused_up_gate)  iqk_moe_fused_up_gate_##v; \
+        decltype(iqk_dequant_type)       iqk_dequant_type_##v; \
+        decltype(iqk_kernel_features)    iqk_kernel_features_##v; \
+        decltype(iqk_flash_attn_noalibi) iqk_flash_attn_noalibi_##v; \
+    }
+
+#ifdef GGML_IQK_FLASH_ATTENTION
+#define IQK_VARIANT_FLASH_ATTN(v) iqk_flash_attn_noalibi_##v
+#else
+#define IQK_VARIANT_FLASH_ATTN(v) nullptr
+#endif
+
+#define IQK_VARIANT_ENTRY(v) \
+    { #v, iqk_cpu_supports_##v, iqk_mul_mat_##v, iqk_mul_mat_4d_##v, iqk_mul_mat_moe_##v, iqk_moe_fused_up_gate_##v, \
+      iqk_dequant_type_##v, iqk_kernel_features_##v, IQK_VARIANT_FLASH_ATTN(v) }
+
+namespace {
+
+struct iqk_variant {
+    const char * name;
+    bool (*supported)();
+
+    decltype(&iqk_mul_mat)            mul_mat;
+    decltype(&iqk_mul_mat_4d)         mul_mat_4d;
+    decltype(&iqk_mul_mat_moe)        mul_mat_moe;
+    decltype(&iqk_moe_fused_up_gate)  moe_fused_up_gate;
+    decltype(&iqk_dequant_type)       dequant_type;
+    decltype(&iqk_kernel_features)    kernel_features;
+    decltype(&iqk_flash_attn_noalibi) flash_attn_noalibi; // nullptr without GGML_IQK_FLASH_ATTENTION
+};
+
+#if defined __x86_64__
+
+// __builtin_cpu_supports also checks that the OS saves the AVX/AVX512 registers
+[[maybe_unused]] bool iqk_cpu_supports_avx2() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+[[maybe_unused]] bool iqk_cpu_supports_avx512() {
+    return iqk_cpu_supports_avx2() &&
+           __builtin_cpu_supports("avx512f")  && __builtin_cpu_supports("avx512vl") &&
+           __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") &&
+           __builtin_cpu_supports("avx512vnni");
+}
+
+[[maybe_unused]] bool iqk_cpu_supports_zen4() {
+    return iqk_cpu_supports_avx512() &&
+           __builtin_cpu_supports("avx512bf16") && __builtin_cpu_supports("avx512vbmi") &&
+           __builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512bitalg");
+}
+
+#elif defined __aarch64__
+
+[[maybe_unused]] bool iqk_cpu_supports_dotprod() {
+#if defined __linux__
+    const unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_ASIMDDP) && (hwcap & HWCAP_ASIMDHP);
+#else
+    return true;
+#endif
+}
+
+#endif
+
+}
+
+#ifdef GGML_IQK_VARIANT_ZEN4
+IQK_VARIANT_DECL(zen4)
+#endif
+#ifdef GGML_IQK_VARIANT_AVX512
+IQK_VARIANT_DECL(avx512)
+#endif
+#ifdef GGML_IQK_VARIANT_AVX2
+IQK_VARIANT_DECL(avx2)
+#endif
+#ifdef GGML_IQK_VARIANT_DOTPROD
+IQK_VARIANT_DECL(dotprod)
+#endif
+
+namespace {
+
+// best first
+const iqk_variant k_iqk_variants[] = {
+#ifdef GGML_IQK_VARIANT_ZEN4
+    IQK_VARIANT_ENTRY(zen4),
+#endif
+#ifdef GGML_IQK_VARIANT_AVX512
+    IQK_VARIANT_ENTRY(avx512),
+#endif
+#ifdef GGML_IQK_VARIANT_AVX2
+    IQK_VARIANT_ENTRY(avx2),
+#endif
+#ifdef GGML_IQK_VARIANT_DOTPROD
+    IQK_VARIANT_ENTRY(dotprod),
+#endif
+};
+
+const iqk_variant * iqk_select_variant() {
+    const char * forced = getenv("GGML_IQK_VARIANT");
+    for (const auto & variant : k_iqk_variants) {
+        if (!variant.supported()) continue;
+        if (forced && strcmp(forced, variant.name) != 0) continue;
+        return &variant;
+    }
+    if (forced) {
+        fprintf(stderr, "%s: iqk variant %s is not available or not supported by this CPU\n", __func__, forced);
+    }
+    GGML_ABORT("Unsupported CPU. None of the compiled iqk kernel variants can run on this CPU\n");
+}
+
+inline const iqk_variant & iqk_get_variant() {
+    static const iqk_variant * variant = iqk_select_variant();
+    return *variant;
+}
+
+}
+
+extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
+    return iqk_get_variant().mul_mat(Nx, Ny, ne00, typeA, A, strideA, typeB, B, strideB, C, stride_C, ith, nth);
+}
+
+extern "C" IQK_API bool iqk_mul_mat_4d(long Nx, long Ny, long ne00,
+        long ne02, long ne03, long ne12, long ne13,
+        long nb02, long nb03, long nb12, long nb13, long nb2, long nb3,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long stride_C, int ith, int nth) {
+    return iqk_get_variant().mul_mat_4d(Nx, Ny, ne00, ne02, ne03, ne12, ne13, nb02, nb03, nb12, nb13, nb2, nb3,
+            typeA, A, strideA, typeB, B, strideB, C, stride_C, ith, nth);
+}
+
+extern "C" IQK_API bool iqk_mul_mat_moe(long Nx, long Ny, long ne00, int ne11,
+        int typeA, const void * A, long strideA,
+        int typeB, const void * B, long strideB,
+        float * C, long nb1, long nb2, const void * vrow_mapping, int ith, int nth) {
+    return iqk_get_variant().mul_mat_moe(Nx, Ny, ne00, ne11, typeA, A, strideA, typeB, B, strideB,
+            C, nb1, nb2, vrow_mapping, ith, nth);
+}
+
+extern "C" IQK_API bool iqk_moe_fused_up_gate(long Nx, long Ny, long ne00, int ne11, int unary_op,
+        int typeA, const void * Aup, const void * Agate, long strideA,
+        int typeB, const void * B, long strideB,
+        const char * up_b, const char * gate_b,
+        float * C, long nb1, long nb2, const void * vrow_mapping, int ith, int nth) {
+    return iqk_get_variant().moe_fused_up_gate(Nx, Ny, ne00, ne11, unary_op, typeA, Aup, Agate, strideA,
+            typeB, B, strideB, up_b, gate_b, C, nb1, nb2, vrow_mapping, ith, nth);
+}
+
+extern "C" IQK_API int iqk_dequant_type(int type, int Ny) {
+    return iqk_get_variant().dequant_type(type, Ny);
+}
+
+// decides the layout of repacked data in iqk_quantize.cpp, which is only compiled for the baseline
+extern "C" IQK_API int iqk_kernel_features(void) {
+    return iqk_get_variant().kernel_features();
+}
+
+extern "C" IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
+                            int neq3, int neq2, long nbq3, long nbq2,
+                            int nek3, int nek2, long nbk3, long nbk2,
+                            int nev3, int nev2, long nbv3, long nbv2,
+                            int ne2,  int ne1,  long nb1,
+                            int type_k, int type_v, int Dk, int Dv, int nq, int nk,
+                            int stride_q, int stride_k, int stride_v, int stride_m,
+                            const void * q, const void * k, const void * v, const void * mask, const void * sinks,
+                            float scale, float softcap, float * qkv,
+                            void * work_buffer, barrier_t barrier, void * barrier_data,
+                            int ith, int nth, int n_swa) {
+    auto flash_attn_noalibi = iqk_get_variant().flash_attn_noalibi;
+    return flash_attn_noalibi && flash_attn_noalibi(type_q, type_mask, max_bias,
+            neq3, neq2, nbq3, nbq2, nek3, nek2, nbk3, nbk2, nev3, nev2, nbv3, nbv2, ne2, ne1, nb1,
+            type_k, type_v, Dk, Dv, nq, nk, stride_q, stride_k, stride_v, stride_m,
+            q, k, v, mask, sinks, scale, softcap, qkv, work_buffer, barrier, barrier_data, ith, nth, n_swa);
+}
@@ -522,6 +522,7 @@ bool iqk_set_kernels_float(int ne00, int typeA, int typeB, std::array<mul_mat_t,
         switch (typeB) {
 #ifdef __AVX512BF16__
             case GGML_TYPE_BF16: set_mul_mat_bf16(kernels); break;
+            case GGML_TYPE_F32:  set_mul_mat_f<ggml_bf16_t, float>(kernels); break;
 #else
             case GGML_TYPE_BF16: set_mul_mat_f<ggml_bf16_t, ggml_bf16_t>(kernels); break;
             case GGML_TYPE_F32:  set_mul_mat_f<ggml_bf16_t, float>(kernels);       break;
@@ -543,7 +544,8 @@ bool iqk_set_kernels_float(int ne00, int typeA, int typeB, std::array<mul_mat_t,
     }
 
     if (typeA == GGML_TYPE_F16 || typeA == GGML_TYPE_F32) {
-        if (ne00 % 4) return false;
+        // the kernels always load the first k_step values of a row
+        if (ne00 % 4 || ne00 < QFBase::k_step) return false;
     }
     if (typeA == GGML_TYPE_F16) {
         switch (typeB) {
@@ -3166,6 +3166,40 @@ void iqk_convert_qX_1_q8_1_r8(int n, const void * vx, size_t bx, void * vy, int
     }
 }
 
+#if defined(__ARM_FEATURE_SVE) && defined(GGML_IQK_SVE)
+// Vector length agnostic Q8_0 x Q8_0_X4 kernel. With 128-bit SVE the NEON kernels are faster, so it is only
+// used when the vectors are wider (e.g., 256 bits on Graviton3 and Neoverse V1).
+// Sizeless SVE types cannot be put in arrays, so the rows of the right matrix are done one at a time
+// while the row of the left matrix stays in L1.
+// Not yet validated on SVE hardware, so it is only built with GGML_IQK_SVE (OFF by default).
+template <int nrc_y>
+static void mul_mat_q8_0_q8_0_sve(int n, const void * vx, size_t bx, const DataInfo& info, int nrc_x) {
+    GGML_ASSERT(n%QK8_0 == 0);
+    const int nb  = n/QK8_0;
+    const int nb4 = 4*(nb/4);
+    const int vl  = svcntb();
+    const svbool_t all = svptrue_b32();
+    for (int ix = 0; ix < nrc_x; ++ix) {
+        auto x = (const block_q8_0 *)((const char *)vx + ix*bx);
+        for (int iy = 0; iy < nrc_y; ++iy) {
+            auto y4 = (const block_q8_0_x4 *)info.src1_row(iy);
+            auto y  = (const block_q8_0    *)info.src1_row(iy);
+            svfloat32_t acc = svdup_n_f32(0.0f);
+            for (int ib = 0; ib < nb; ++ib) {
+                const int8_t * qy = ib < nb4 ? y4[ib/4].qs + QK8_0*(ib%4) : y[ib].qs;
+                const float d = GGML_FP16_TO_FP32(x[ib].d)*GGML_FP16_TO_FP32(ib < nb4 ? y4[ib/4].d[ib%4] : y[ib].d);
+                for (int j = 0; j < QK8_0; j += vl) {
+                    const svbool_t pg = svwhilelt_b8(j, QK8_0);
+                    const svint32_t dot = svdot_s32(svdup_n_s32(0), svld1_s8(pg, x[ib].qs + j), svld1_s8(pg, qy + j));
+                    acc = svmla_n_f32_x(all, acc, svcvt_f32_s32_x(all, dot), d);
+                }
+            }
+            info.store(ix, iy, svaddv_f32(all, acc));
+        }
+    }
+}
+#endif
+
 }
 
 bool iqk_convert_legacy_quants_q8_r8(int type, int n, const void * vx, size_t bx, void * vy, int nrc_x) {
@@ -3210,6 +3244,12 @@ bool iqk_set_kernels_legacy_quants(int ne00, int typeA, int typeB, std::array<mu
             IQK_SET_MUL_MAT_FUNCTIONS_T(mul_mat_qX_0_q8_0, DequantizerQ60, kernels);
             break;
         case GGML_TYPE_Q8_0:
+#if defined(__ARM_FEATURE_SVE) && defined(GGML_IQK_SVE)
+            if (svcntb() > 16) {
+                IQK_SET_MUL_MAT_FUNCTIONS(mul_mat_q8_0_q8_0_sve, kernels);
+                break;
+            }
+#endif
             IQK_SET_MUL_MAT_FUNCTIONS_T(mul_mat_qX_0_q8_0, DequantizerQ80, kernels);
             break;
         case GGML_TYPE_IQ4_NL:
@@ -3291,6 +3331,11 @@ inline std::pair<mul_mat_t, int> mul_mat_kernel(int int_typeA, int nq) {
     }
     if (typeA == GGML_TYPE_Q8_0) {
 #ifdef __aarch64__
+#if defined(__ARM_FEATURE_SVE) && defined(GGML_IQK_SVE)
+        if (svcntb() > 16) {
+            MAKE_FUNCS_ONLY_NRC(mul_mat_q8_0_q8_0_sve, nq);
+        }
+#endif
         MAKE_FUNCS(mul_mat_qX_0_q8_0<DequantizerQ80, nq);
 #else
 #ifdef HAVE_FANCY_SIMD
@@ -398,6 +398,21 @@ static std::vector<char> & thread_local_work_buffer() {
     return f;
 }
 
+// With a large batch and only a few rows per thread (small models, many threads), the threads also split the
+// batch, so that each thread still gets a block of at least k_min_rows x k_min_cols. Returns the number of
+// column chunks, which always divides nth.
+static int num_y_chunks(long nrows, long Ny, int nth) {
+    constexpr int k_min_rows = 64, k_min_cols = 32;
+    int nth_y = 1;
+    while (nrows*nth_y < k_min_rows*nth) {
+        int nth_x = nth/nth_y, f = 2;
+        while (f <= nth_x && nth_x%f) ++f;
+        if (f > nth_x || Ny < k_min_cols*nth_y*f) break;
+        nth_y *= f;
+    }
+    return nth_y;
+}
+
 bool iqk_convert_repack(int typeA, int n, const void * vx, size_t bx, void * vy, size_t stride_y, int nrc_x) {
 
     switch (typeA) {
@@ -492,6 +507,17 @@ extern "C" IQK_API int iqk_dequant_type(int type, int Ny) {
     return MulMat::is_dequant_better(ggml_type(type), Ny);
 }
 
+extern "C" IQK_API int iqk_kernel_features(void) {
+    int features = 0;
+#ifdef HAVE_FANCY_SIMD
+    features |= IQK_FEATURE_FANCY_SIMD;
+#endif
+#ifdef __AVX512BF16__
+    features |= IQK_FEATURE_BF16_R16;
+#endif
+    return features;
+}
+
 extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
         int typeA, const void * A, long strideA,
         int typeB, const void * B, long strideB,
@@ -505,6 +531,11 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
 
         constexpr int k_x_step = 32;
 
+        int nth_y = num_y_chunks(Nx, Ny, nth);
+        int ith_y = ith%nth_y;
+        ith /= nth_y; nth /= nth_y;
+        int first_y = Ny*ith_y/nth_y, last_y = Ny*(ith_y+1)/nth_y;
+
         auto num_rows = MulMat::num_rows(ggml_type(dequant_type));
         GGML_ASSERT(Nx%num_rows == 0);
         auto nrc_x = (Nx/num_rows + nth - 1)/nth;
@@ -518,7 +549,7 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
 
         //printf("Dequant mul mat %s x %s: ne00 = %d, row_size = %d\n", ggml_type_name(dequant_type), ggml_type_name(ggml_type(typeB)), (int)ne00, (int)row_size_qx);
 
-        DataInfo info{C + first_x, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
+        DataInfo info{C + first_x, (const char *)B, (size_t)stride_C, row_size_qy, first_y, 1, nullptr, 0};
 
         auto& f = thread_local_work_buffer();
 
@@ -530,7 +561,7 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
             if (!iqk_convert_repack(typeA, ne00, (const char *)A + (first_x + ix)*strideA, strideA, f.data(), ne00, this_nrc_x)) {
                 GGML_ABORT("Fatal error");
             }
-            mm.mul_mat_NxM(ne00, f.data(), row_size_qx, this_info, this_nrc_x, Ny);
+            mm.mul_mat_NxM(ne00, f.data(), row_size_qx, this_info, this_nrc_x, last_y);
         }
 
         return true;
@@ -552,13 +583,19 @@ extern "C" IQK_API bool iqk_mul_mat(long Nx, long Ny, long ne00,
         GGML_ASSERT(false);
     }
     GGML_ASSERT(Nx%num_rows == 0);
+
+    int nth_y = num_y_chunks(Nx, Ny, nth);
+    int ith_y = ith%nth_y;
+    ith /= nth_y; nth /= nth_y;
+    int first_y = Ny*ith_y/nth_y, last_y = Ny*(ith_y+1)/nth_y;
+
     auto nrc_x = (Nx/num_rows + nth - 1)/nth;
     auto first_x = ith*nrc_x;
     if (first_x + nrc_x > Nx/num_rows) nrc_x = Nx/num_rows - first_x;
 
-    DataInfo info{C + first_x*num_rows, (const char *)B, (size_t)stride_C, row_size_qy, 0, 1, nullptr, 0};
+    DataInfo info{C + first_x*num_rows, (const char *)B, (size_t)stride_C, row_size_qy, first_y, 1, nullptr, 0};
 
-    mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x*num_rows, row_size_qx, info, nrc_x*num_rows, Ny);
+    mm.mul_mat_NxM(ne00, (const char *)A + row_size_qx*first_x*num_rows, row_size_qx, info, nrc_x*num_rows, last_y);
 
     return true;
 }
@@ -814,12 +851,18 @@ namespace {
 
 bool MulMat::prepare(int typeA, int typeB, int ne00, MulMat& mm, int Ny) {
 
-    (void)Ny;
-
     switch (typeA) {
+#ifdef __AVX512BF16__
+        case GGML_TYPE_BF16:
+            // For a GEMV the bf16 dot products are faster (the caller then converts src1 to bf16),
+            // for a GEMM converting the weights to f32 on load and using FMA is faster.
+            if (typeB == GGML_TYPE_F32 && Ny <= 2) return false;
+            return iqk_set_kernels_float(ne00, typeA, typeB, mm.funcs);
+#else
+        case GGML_TYPE_BF16:
+#endif
         case GGML_TYPE_F16:
         case GGML_TYPE_F32:
-        case GGML_TYPE_BF16:
         case GGML_TYPE_BF16_R16:
             return iqk_set_kernels_float(ne00, typeA, typeB, mm.funcs);
         case GGML_TYPE_Q2_K:
@@ -1346,4 +1389,8 @@ extern "C" IQK_API bool iqk_moe_fused_up_gate(long /*Nx*/, long /*Ny*/, long /*n
     return false;
 }
 
+extern "C" IQK_API int iqk_kernel_features(void) {
+    return 0;
+}
+
 #endif
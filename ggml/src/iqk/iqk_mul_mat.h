@@ -37,6 +37,9 @@ IQK_API bool iqk_moe_fused_up_gate(long Nx, long Ny, long ne00, int ne11, int un
 
 IQK_API int iqk_dequant_type(int type, int Ny);
 
+// IQK_FEATURE_* bits of the kernels in use, which decide the layout of some repacked types (see iqk_config.h)
+IQK_API int iqk_kernel_features(void);
+
 typedef void (*barrier_t) (void *);
 
 IQK_API bool iqk_flash_attn_noalibi(int type_q, int type_mask, float max_bias,
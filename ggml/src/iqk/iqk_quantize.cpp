@@ -59,6 +59,23 @@ inline int nearest_int(float fval) {
     return (i & 0x007fffff) - 0x00400000;
 }
 
+// With GGML_IQK_CPU_VARIANTS the kernels are selected at run time, while this file is compiled for the baseline,
+// so the layout of repacked data must follow the features of the selected kernels and not the flags of this file.
+inline int iqk_kernel_features_cached() {
+#if GGML_USE_IQK_MULMAT
+    static const int features = iqk_kernel_features();
+    return features;
+#else
+    return 0;
+#endif
+}
+
+// an offset of 127 makes q8_0 quants unsigned, 128 (same as xor 0x80) makes q8_K quants unsigned
+inline void iqk_offset_quants(int8_t * q, int64_t n, uint8_t offset) {
+    auto u = (uint8_t *)q;
+    for (int64_t j = 0; j < n; ++j) u[j] += offset;
+}
+
 typedef void (*quantize_func_t)(const float * src, void * qdata, int n_per_row, const float * imatrix);
 
 struct QHelper {
@@ -738,6 +755,40 @@ void quantize_row_q8_0_x4(const float * x, void * vy, int64_t k) {
     block_q8_0    * y  = (block_q8_0    *)vy;
     block_q8_0_x4 * y4 = (block_q8_0_x4 *)vy;
 #if defined(__aarch64__)
+#if defined(__ARM_FEATURE_SVE) && defined(GGML_IQK_SVE)
+    if (svcntb() > 16) {
+        // vector length agnostic
+        for (int i = 0; i < nb; i++) {
+            int i4 = i/4, ir = i%4;
+            const float * xb = x + i*QK8_0;
+            svfloat32_t vmax = svdup_n_f32(0.0f);
+            for (int j = 0; j < QK8_0; j += svcntw()) {
+                const svbool_t pg = svwhilelt_b32(j, QK8_0);
+                vmax = svmax_f32_m(pg, vmax, svabs_f32_x(pg, svld1_f32(pg, xb + j)));
+            }
+            const float amax = svmaxv_f32(svptrue_b32(), vmax);
+
+            const float d = amax / ((1 << 7) - 1);
+            const float id = d ? 1.0f/d : 0.0f;
+
+            int8_t * qs;
+            if (i < nb4) {
+                y4[i4].d[ir] = GGML_FP32_TO_FP16(d);
+                qs = y4[i4].qs + 32*ir;
+            } else {
+                y[i].d = GGML_FP32_TO_FP16(d);
+                qs = y[i].qs;
+            }
+
+            for (int j = 0; j < QK8_0; j += svcntw()) {
+                const svbool_t pg = svwhilelt_b32(j, QK8_0);
+                const svfloat32_t v = svrintn_f32_x(pg, svmul_n_f32_x(pg, svld1_f32(pg, xb + j), id));
+                svst1b_s32(pg, qs + j, svcvt_s32_f32_x(pg, v));
+            }
+        }
+        return;
+    }
+#endif
     for (int i = 0; i < nb; i++) {
         int i4 = i/4, ir = i%4;
         float32x4_t srcv [8];
@@ -4854,6 +4905,33 @@ static void repack_q4_0(int nrows, int n_per_row, const block_q4_0 * x, block_iq
         y += nblock;
     }
 }
+// The ggml-aarch64 Q4_0_MxN layouts (M rows with their quants interleaved in groups of N bytes and xor'ed with 0x88)
+// are converted back to Q4_0 rows and then repacked to Q4_0_R8, so that models quantized offline to these types
+// go through the same iqk kernels as Q4_0 models repacked at load time.
+template <typename Block, int nrows_interleaved, int blck_size_interleave>
+static void repack_q4_0_aarch64(int nrows, int n_per_row, const Block * x, block_iq4_nl_r8 * y, bool online) {
+    static_assert(sizeof(Block) == nrows_interleaved*sizeof(block_q4_0));
+    GGML_ASSERT(nrows%8 == 0);
+    GGML_ASSERT(n_per_row%QK4_0 == 0);
+    int nblock = n_per_row/QK4_0;
+    std::vector<block_q4_0> aux(8*nblock);
+    for (int row = 0; row < nrows; row += 8) {
+        for (int k0 = 0; k0 < 8; k0 += nrows_interleaved) {
+            for (int ib = 0; ib < nblock; ++ib) {
+                for (int k = 0; k < nrows_interleaved; ++k) aux[(k0 + k)*nblock + ib].d = x->d[k];
+                for (int i = 0; i < nrows_interleaved*QK4_0/2; ++i) {
+                    int src_id = (i % (nrows_interleaved*blck_size_interleave))/blck_size_interleave;
+                    int src_offset = (i / (nrows_interleaved*blck_size_interleave))*blck_size_interleave + i % blck_size_interleave;
+                    aux[(k0 + src_id)*nblock + ib].qs[src_offset] = x->qs[i] ^ 0x88;
+                }
+                ++x;
+            }
+        }
+        repack_q4_0(8, n_per_row, aux.data(), y, online);
+        y += nblock;
+    }
+}
+
 #ifdef __ARM_NEON
 static void modify_q4_0_r8(int64_t k, char * cy) {
     auto y = (block_iq4_nl_r8 *)cy;
@@ -4938,6 +5016,7 @@ void quantize_row_q8_0_r8(const float * x, void * y, int64_t k) {
 static void repack_q8_0(int nrows, int n_per_row, const block_q8_0 * x, block_q8_0_r8 * y, [[maybe_unused]] bool online) {
     GGML_ASSERT(nrows%8 == 0);
     GGML_ASSERT(n_per_row%QK8_0 == 0);
+    const bool unsigned_quants = iqk_kernel_features_cached() & IQK_FEATURE_FANCY_SIMD;
     int nblock = n_per_row/QK8_0;
     const block_q8_0 * x8[8];
     for (int row = 0; row < nrows; row += 8) {
@@ -4950,32 +5029,22 @@ static void repack_q8_0(int nrows, int n_per_row, const block_q8_0 * x, block_q8
                     y[ib].qs[32*l+4*k+i+128] = x8[k][ib].qs[i+4*l+16];
                 }
             }
-#ifdef HAVE_FANCY_SIMD
-            if (online) {
-                for (int l = 0; l < 4; ++l) {
-                    auto v = _mm512_add_epi8(_mm512_loadu_si512((const __m512i *)y[ib].qs + l), _mm512_set1_epi8(127));
-                    _mm512_storeu_si512((__m512i *)y[ib].qs + l, v);
-                }
+            if (online && unsigned_quants) {
+                iqk_offset_quants(y[ib].qs, sizeof(y[ib].qs), 127);
             }
-#endif
         }
         x += 8*nblock;
         y += nblock;
     }
 }
 
-#ifdef HAVE_FANCY_SIMD
 static void modify_q8_0_r8(int64_t k, char * cy) {
     auto y = (block_q8_0_r8 *)cy;
     int nb = k/(32*8);
     for (int ib = 0; ib < nb; ++ib) {
-        for (int l = 0; l < 4; ++l) {
-            auto v = _mm512_add_epi8(_mm512_loadu_si512((const __m512i *)y[ib].qs + l), _mm512_set1_epi8(127));
-            _mm512_storeu_si512((__m512i *)y[ib].qs + l, v);
-        }
+        iqk_offset_quants(y[ib].qs, sizeof(y[ib].qs), 127);
     }
 }
-#endif
 
 size_t quantize_q8_0_r8(const float * src, void * dst, int64_t nrows, int64_t n_per_row, const float * imatrix) {
     GGML_ASSERT(nrows%8 == 0);
@@ -6490,6 +6559,7 @@ void quantize_row_q8_k_r8(const float * x, void * y, int64_t k) {
 }
 
 static void repack_q8_k(int nrows, int n_per_row, const block_q8_K * x, block_q8_k_r8 * y, [[maybe_unused]] bool online) {
+    const bool unsigned_quants = iqk_kernel_features_cached() & IQK_FEATURE_FANCY_SIMD;
     GGML_ASSERT(nrows%8 == 0);
     GGML_ASSERT(n_per_row%QK_K == 0);
     int nblock = n_per_row/QK_K;
@@ -6503,31 +6573,21 @@ static void repack_q8_k(int nrows, int n_per_row, const block_q8_K * x, block_q8
                     for (int i = 0; i < 4; ++i) y[ibl].qs[32*ib + 4*k + i] = x8[k][ibl].qs[4*ib+i];
                 }
             }
-#ifdef HAVE_FANCY_SIMD
-            if (online) {
-                for (int l = 0; l < 32; ++l) {
-                    auto v = _mm512_xor_si512(_mm512_loadu_si512((const __m512i *)y[ibl].qs + l), _mm512_set1_epi8(-128));
-                    _mm512_storeu_si512((__m512i *)y[ibl].qs + l, v);
-                }
+            if (online && unsigned_quants) {
+                iqk_offset_quants(y[ibl].qs, sizeof(y[ibl].qs), 128);
             }
-#endif
         }
         x += 8*nblock;
         y += nblock;
     }
 }
-#ifdef HAVE_FANCY_SIMD
 static void modify_q8_k_r8(int64_t k, char * cy) {
     auto y = (block_q8_k_r8 *)cy;
     int nb = k/(256*8);
     for (int ib = 0; ib < nb; ++ib) {
-        for (int l = 0; l < 32; ++l) {
-            auto v = _mm512_xor_si512(_mm512_loadu_si512((const __m512i *)y[ib].qs + l), _mm512_set1_epi8(-128));
-            _mm512_storeu_si512((__m512i *)y[ib].qs + l, v);
-        }
+        iqk_offset_quants(y[ib].qs, sizeof(y[ib].qs), 128);
     }
 }
-#endif
 
 size_t quantize_q8_k_r8(const float * src, void * dst, int64_t nrows, int64_t n_per_row, [[maybe_unused]] const float * imatrix) {
     GGML_ASSERT(nrows%8 == 0);
@@ -6601,12 +6661,8 @@ static void repack_q16_k(int nrows, int n_per_row, const block_q8_K * x, block_q
                     for (int i = 0; i < 4; ++i) y[ibl].qs[64*ib + 4*k + i] = x16[k][ibl].qs[4*ib+i];
                 }
             }
-#ifdef HAVE_FANCY_SIMD
-            for (int l = 0; l < 64; ++l) {
-                auto v = _mm512_xor_si512(_mm512_loadu_si512((const __m512i *)y[ibl].qs + l), _mm512_set1_epi8(-128));
-                _mm512_storeu_si512((__m512i *)y[ibl].qs + l, v);
-            }
-#endif
+            // Q8_K_R16 quants are always stored as unsigned (see dequantize_row_q8_k_r16)
+            iqk_offset_quants(y[ibl].qs, sizeof(y[ibl].qs), 128);
         }
         x += 16*nblock;
         y += nblock;
@@ -6681,6 +6737,8 @@ static void repack_q8_KV(int nrows, int n_per_row, const char * cx, char * cy, [
     const int8_t * x8[8];
 #ifdef __ARM_NEON
     int8x16x2_t m0, m1, m2, m3;
+#else
+    [[maybe_unused]] const bool unsigned_quants = iqk_kernel_features_cached() & IQK_FEATURE_FANCY_SIMD;
 #endif
     for (int row = 0; row < nrows; row += 8) {
         auto dy = (float *)cy;
@@ -6705,14 +6763,12 @@ static void repack_q8_KV(int nrows, int n_per_row, const char * cx, char * cy, [
             m1 = _mm256_unpackhi_epi64(t0, t1);
             m2 = _mm256_unpacklo_epi64(t2, t3);
             m3 = _mm256_unpackhi_epi64(t2, t3);
-#ifdef HAVE_FANCY_SIMD
-            if (online) {
+            if (online && unsigned_quants) {
                 m0 = _mm256_add_epi8(m0, _mm256_set1_epi8(127));
                 m1 = _mm256_add_epi8(m1, _mm256_set1_epi8(127));
                 m2 = _mm256_add_epi8(m2, _mm256_set1_epi8(127));
                 m3 = _mm256_add_epi8(m3, _mm256_set1_epi8(127));
             }
-#endif
             _mm256_storeu_si256((__m256i *)qy + 4*ib+0, m0);
             _mm256_storeu_si256((__m256i *)qy + 4*ib+1, m1);
             _mm256_storeu_si256((__m256i *)qy + 4*ib+2, m2);
@@ -6754,12 +6810,9 @@ static void repack_q8_KV(int nrows, int n_per_row, const char * cx, char * cy, [
         //So, if we are run-time-repacking (online = true) we don't want to change the stride, so we just leave some unused space at the end of each row
     }
 }
-#ifdef HAVE_FANCY_SIMD
 static void modify_q8_KV_r8(int64_t k, char * cy) {
-    int8_t * q8 = (int8_t *)(cy + 8*sizeof(float));
-    for (int j = 0; j < k; ++j) q8[j] += 127;
+    iqk_offset_quants((int8_t *)(cy + 8*sizeof(float)), k, 127);
 }
-#endif
 
 size_t quantize_q8_KV_r8(const float * src, void * dst, int64_t nrows, int64_t n_per_row, [[maybe_unused]] const float * imatrix) {
     GGML_ASSERT(nrows%8 == 0);
@@ -7896,15 +7949,19 @@ const Modify * get_modify_info(ggml_type type) {
     static const std::unordered_map<ggml_type, Modify> k_mod_map = {
 #ifdef __ARM_NEON
         { GGML_TYPE_Q4_0_R8, {modify_q4_0_r8, 8} },
-#endif
-#ifdef HAVE_FANCY_SIMD
+#else
+        // only for kernels that use unsigned quants (IQK_FEATURE_FANCY_SIMD)
         { GGML_TYPE_Q8_0_R8,  {modify_q8_0_r8,  8} },
         { GGML_TYPE_Q8_K_R8,  {modify_q8_k_r8,  8} },
         { GGML_TYPE_Q8_KV_R8, {modify_q8_KV_r8, 8} },
 #endif
     };
     auto it = k_mod_map.find(type);
-    return it != k_mod_map.end() ? &it->second : nullptr;
+    if (it == k_mod_map.end()) return nullptr;
+#ifndef __ARM_NEON
+    if (!(iqk_kernel_features_cached() & IQK_FEATURE_FANCY_SIMD)) return nullptr;
+#endif
+    return &it->second;
 }
 bool is_forbidden_tensor(const std::string& name) {
     static const std::string kTokenEmbd{"token_embd.weight"};
@@ -7973,18 +8030,22 @@ const Repack * get_repack_info(ggml_type type) {
         { GGML_TYPE_Q5_K,   { GGML_TYPE_Q5_K_R4,   4,  (Repack::repack_func)repack_q5_k}    },
         { GGML_TYPE_Q6_K,   { GGML_TYPE_Q6_K_R4,   4,  (Repack::repack_func)repack_q6_k}    },
         { GGML_TYPE_Q4_0,   { GGML_TYPE_Q4_0_R8,   8,  (Repack::repack_func)repack_q4_0}    },
+        { GGML_TYPE_Q4_0_4_4, { GGML_TYPE_Q4_0_R8, 8, (Repack::repack_func)repack_q4_0_aarch64<block_q4_0x4, 4, 4>} },
+        { GGML_TYPE_Q4_0_4_8, { GGML_TYPE_Q4_0_R8, 8, (Repack::repack_func)repack_q4_0_aarch64<block_q4_0x4, 4, 8>} },
+        { GGML_TYPE_Q4_0_8_8, { GGML_TYPE_Q4_0_R8, 8, (Repack::repack_func)repack_q4_0_aarch64<block_q4_0x8, 8, 8>} },
         { GGML_TYPE_Q5_0,   { GGML_TYPE_Q5_0_R4,   4,  (Repack::repack_func)repack_q5_0}    },
         { GGML_TYPE_Q6_0,   { GGML_TYPE_Q6_0_R4,   4,  (Repack::repack_func)repack_q6_0}    },
         { GGML_TYPE_Q8_0,   { GGML_TYPE_Q8_0_R8,   8,  (Repack::repack_func)repack_q8_0}    },
         { GGML_TYPE_Q8_K,   { GGML_TYPE_Q8_K_R8,   8,  (Repack::repack_func)repack_q8_k}    },
         { GGML_TYPE_Q8_KV,  { GGML_TYPE_Q8_KV_R8,  8,  (Repack::repack_func)repack_q8_KV}   },
-#ifdef __AVX512BF16__
+        // only for kernels with AVX512-BF16 (IQK_FEATURE_BF16_R16)
         { GGML_TYPE_BF16,   { GGML_TYPE_BF16_R16, 16,  (Repack::repack_func)repack_bf16<ggml_bf16_t>}},
         { GGML_TYPE_F16,    { GGML_TYPE_BF16_R16, 16,  (Repack::repack_func)repack_bf16<ggml_half>}  },
-#endif
     };
     auto it = k_map.find(type);
-    return it != k_map.end() ? &it->second : nullptr;
+    if (it == k_map.end()) return nullptr;
+    if (it->second.new_type == GGML_TYPE_BF16_R16 && !(iqk_kernel_features_cached() & IQK_FEATURE_BF16_R16)) return nullptr;
+    return &it->second;
 }
 }
 
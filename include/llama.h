@@ -52,6 +52,9 @@
 #define LLAMA_STATE_SEQ_MAGIC   LLAMA_FILE_MAGIC_GGSQ
 #define LLAMA_STATE_SEQ_VERSION 2
 
+// the two-stage output head is only used for ubatches with at most this many outputs (generation, draft verification)
+#define LLAMA_OUTPUT_HEAD_MAX_OUTPUTS 16
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -272,6 +275,14 @@ extern "C" {
         LLAMA_SPLIT_MODE_ROW     = 2, // split rows across GPUs
     };
 
+    // memory used for buffers that live in plain CPU memory (linux only)
+    enum llama_hugepages {
+        LLAMA_HUGEPAGES_NONE = 0, // regular pages
+        LLAMA_HUGEPAGES_THP  = 1, // transparent huge pages (madvise)
+        LLAMA_HUGEPAGES_2M   = 2, // 2 MiB hugetlbfs pages, falls back to THP if the pool is too small
+        LLAMA_HUGEPAGES_1G   = 3, // 1 GiB hugetlbfs pages, falls back to THP if the pool is too small
+    };
+
 
     typedef struct llama_token_data {
         llama_token id; // token id
@@ -372,6 +383,9 @@ extern "C" {
 
         const struct llama_model_tensor_buft_override * tensor_buft_overrides;
 
+        // huge pages for weights in CPU memory, these are then loaded into anonymous memory instead of being mmapped
+        enum llama_hugepages hugepages_weights;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
@@ -425,6 +439,25 @@ extern "C" {
         int  min_experts;
         float thresh_experts;
         bool only_active_experts;
+        bool logits_zero_copy;  // if possible, return logits directly from the compute buffer instead of copying them [EXPERIMENTAL]
+
+        // two-stage output head [EXPERIMENTAL]
+        // if output_head_rank > 0, a low-rank approximation of the output matrix is used to select the
+        // output_head_top most likely tokens, and exact logits are computed only for these. Outputs where the
+        // candidates carry less than output_head_min_mass of the probability mass are recomputed exactly.
+        // The logits of the other tokens are approximate, see llama_get_logits_candidates_ith.
+        // Requires the output tensor in host memory.
+        int32_t output_head_rank;
+        int32_t output_head_top;
+        float   output_head_min_mass;
+
+        int32_t cpu_partition; // CPU partition to run on (see llama_cpu_partition_add), -1 = none
+        int32_t cpu_priority;  // contexts with higher priority compute first within the partition
+
+        enum llama_hugepages hugepages_kv;      // huge pages for the KV cache in CPU memory
+        enum llama_hugepages hugepages_compute; // huge pages for the CPU compute buffer
+
+        bool lazy_k_shift; // apply pending K-shifts in the next decode graph instead of a separate one, see llama_kv_cache_update [EXPERIMENTAL]
 
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
@@ -534,6 +567,13 @@ extern "C" {
     //optional:
     LLAMA_API void llama_numa_init(enum ggml_numa_strategy numa);
 
+    // Create a process-wide CPU partition from a list of cores [EXPERIMENTAL]
+    // Contexts in the same partition pin their compute threads to its cores and compute their graphs one
+    // at a time (by cpu_priority, then in arrival order), contexts in different partitions run concurrently.
+    // Asking for the same list of cores again returns the existing partition.
+    // Returns the partition id to use in llama_context_params.cpu_partition, or -1 on error
+    LLAMA_API int32_t llama_cpu_partition_add(const int32_t * cores, int32_t n_cores);
+
     // Call once at the end of the program - currently only used for MPI
     LLAMA_API void llama_backend_free(void);
 
@@ -610,6 +650,15 @@ extern "C" {
     // Returns the total number of parameters in the model
     LLAMA_API uint64_t llama_model_n_params(const struct llama_model * model);
 
+    // Pages in the mmapped weights of the model in a background thread, in the order in which the layers are evaluated,
+    // so that a following llama_decode waits on read-ahead I/O instead of faulting the weights in page by page.
+    // A prefetch that is still running is stopped first. With wait = true, returns when all weights were paged in.
+    // Does nothing for weights that are not mmapped. Not thread safe with respect to the model.
+    LLAMA_API void llama_model_prefetch(struct llama_model * model, bool wait);
+
+    // Returns the fraction of the mmapped weights that is resident in memory (1 if there are none or it is unknown)
+    LLAMA_API float llama_model_resident_fraction(const struct llama_model * model);
+
     // Get a llama model tensor
     LLAMA_API struct ggml_tensor * llama_get_model_tensor(struct llama_model * model, const char * name);
 
@@ -670,6 +719,25 @@ extern "C" {
                          int32_t   il_start,
                          int32_t   il_end);
 
+    // Set steering vector id (> 0), or clear it if data is NULL. The arguments are as for llama_control_vector_apply.
+    // A steering vector only applies to the tokens of the sequences it was selected for with
+    // llama_control_vector_set_seq, in addition to the control vector, so sequences with different steering vectors
+    // can share a batch.
+    LLAMA_API int32_t llama_control_vector_set(
+            struct llama_context * lctx,
+                         int32_t   id,
+                     const float * data,
+                          size_t   len,
+                         int32_t   n_embd,
+                         int32_t   il_start,
+                         int32_t   il_end);
+
+    // Select the steering vector for the tokens of a sequence, 0 for none
+    LLAMA_API void llama_control_vector_set_seq(
+            struct llama_context * lctx,
+                    llama_seq_id   seq_id,
+                         int32_t   id);
+
     //
     // KV cache
     //
@@ -755,6 +823,19 @@ extern "C" {
                        llama_pos   p0,
                        llama_pos   p1);
 
+    // Copy the tokens of seq_id_src in [p0, p1) into new cells of seq_id_dst, at positions shifted by delta
+    // Unlike llama_kv_cache_seq_cp, this allocates new KV cells and copies the K and V data, so the copy can be
+    // placed at another position (e.g. a cached document chunk spliced into a prompt). The keys are re-rotated
+    // by the next K-shift, like after llama_kv_cache_seq_add.
+    // Returns the number of copied tokens, or -1 if there are not enough free cells
+    LLAMA_API int32_t llama_kv_cache_seq_cp_shift(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id_src,
+                    llama_seq_id   seq_id_dst,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                       llama_pos   delta);
+
     // Removes all tokens that do not belong to the specified sequence
     LLAMA_API void llama_kv_cache_seq_keep(
             struct llama_context * ctx,
@@ -798,6 +879,9 @@ extern "C" {
     LLAMA_API void llama_kv_cache_defrag(struct llama_context * ctx);
 
     // Apply the KV cache updates (such as K-shifts, defragmentation, etc.)
+    // With llama_context_params.lazy_k_shift, llama_decode does not run a separate graph for K-shifts: K caches in host
+    // memory are rotated in place as here, other K caches by the next decode graph, which rotates the range of shifted
+    // cells and writes it back. Calling this applies a pending shift right away.
     // Positive return values does not mean a fatal error, but rather a warning.
     //    0 - success
     //    1 - Context overflow in a model where k-shift is not supported
@@ -965,6 +1049,13 @@ extern "C" {
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
 
+    // Compute logits only for the given tokens (e.g. tokens allowed by a grammar, classification labels,
+    // tokens of a speculative draft), instead of for the entire vocabulary.
+    // The logits of all other tokens are set to -INFINITY. Applies to all subsequent llama_decode() calls.
+    // Pass n_tokens = 0 to compute the logits for the entire vocabulary again (default).
+    // Returns 0 on success, -1 if a token id is out of range
+    LLAMA_API int32_t llama_set_output_vocab(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
@@ -978,6 +1069,8 @@ extern "C" {
     // in the order they have appeared in the batch.
     // Rows: number of tokens for which llama_batch.logits[i] != 0
     // Cols: n_vocab
+    // With llama_context_params.logits_zero_copy the returned pointer may point into the compute buffer,
+    // in which case it is only valid until the next call to llama_decode(), llama_encode() or llama_kv_cache_update()
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Logits for the ith token. For positive indices, Equivalent to:
@@ -986,6 +1079,12 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // With the two-stage output head (output_head_rank > 0), only the logits of the candidate tokens are exact,
+    // the logits of all other tokens are low-rank approximations.
+    // Returns the ids of the candidates of the ith token and sets *n_candidates, same indexing as llama_get_logits_ith.
+    // Returns NULL (and sets *n_candidates = 0) if all logits of this token are exact.
+    LLAMA_API const llama_token * llama_get_logits_candidates_ith(struct llama_context * ctx, int32_t i, int32_t * n_candidates);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
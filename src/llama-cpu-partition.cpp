@@ -0,0 +1,62 @@
+#include "llama-cpu-partition.h"
+#include "llama-impl.h"
+
+#include <deque>
+#include <memory>
+#include <thread>
+
+void llama_cpu_partition::acquire(int priority) {
+    std::unique_lock<std::mutex> lock(mutex);
+    const auto key = std::make_pair(-priority, n_tickets++);
+    waiting.insert(key);
+    cv.wait(lock, [this, &key] { return !busy && *waiting.begin() == key; });
+    waiting.erase(waiting.begin());
+    busy = true;
+}
+
+void llama_cpu_partition::release() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busy = false;
+    }
+    cv.notify_all();
+}
+
+// partitions are never removed, so pointers to them (and to their cores) stay valid
+static std::mutex                                       g_cpu_partitions_mutex;
+static std::deque<std::unique_ptr<llama_cpu_partition>> g_cpu_partitions;
+
+llama_cpu_partition * llama_cpu_partition_get(int32_t id) {
+    std::lock_guard<std::mutex> lock(g_cpu_partitions_mutex);
+    if (id < 0 || id >= (int32_t)g_cpu_partitions.size()) {
+        return nullptr;
+    }
+    return g_cpu_partitions[id].get();
+}
+
+int32_t llama_cpu_partition_add(const int32_t * cores, int32_t n_cores) {
+    if (!cores || n_cores <= 0) {
+        LLAMA_LOG_ERROR("%s: a partition needs at least one core\n", __func__);
+        return -1;
+    }
+    const int n_cpus = (int)std::thread::hardware_concurrency();
+    std::vector<int> list;
+    for (int32_t i = 0; i < n_cores; ++i) {
+        if (cores[i] < 0 || (n_cpus > 0 && cores[i] >= n_cpus)) {
+            LLAMA_LOG_ERROR("%s: invalid core %d (%d cores available)\n", __func__, cores[i], n_cpus);
+            return -1;
+        }
+        list.push_back(cores[i]);
+    }
+
+    std::lock_guard<std::mutex> lock(g_cpu_partitions_mutex);
+    // contexts asking for the same cores share the partition
+    for (size_t id = 0; id < g_cpu_partitions.size(); ++id) {
+        if (g_cpu_partitions[id]->cores == list) {
+            return id;
+        }
+    }
+    g_cpu_partitions.emplace_back(new llama_cpu_partition);
+    g_cpu_partitions.back()->cores = std::move(list);
+    return g_cpu_partitions.size() - 1;
+}
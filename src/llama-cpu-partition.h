@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+//
+// process-wide CPU partitions
+//
+// A partition is a set of cores. Contexts assigned to a partition pin their compute threads to its cores and
+// compute their graphs one at a time: the highest priority waiter goes first, waiters with the same priority
+// are served in arrival order. Contexts in different partitions run concurrently on disjoint cores.
+//
+
+struct llama_cpu_partition {
+    std::vector<int> cores;
+
+    // blocks until the partition is free and there is no waiter ahead of us
+    void acquire(int priority);
+    void release();
+
+private:
+    std::mutex              mutex;
+    std::condition_variable cv;
+    bool                    busy = false;
+    uint64_t                n_tickets = 0;
+
+    // (-priority, ticket) of the waiting contexts, the first entry is next in line
+    std::set<std::pair<int, uint64_t>> waiting;
+};
+
+struct llama_cpu_partition_lock {
+    llama_cpu_partition & partition;
+
+    llama_cpu_partition_lock(llama_cpu_partition & partition, int priority) : partition(partition) {
+        partition.acquire(priority);
+    }
+    ~llama_cpu_partition_lock() {
+        partition.release();
+    }
+};
+
+// returns nullptr if there is no partition with this id
+llama_cpu_partition * llama_cpu_partition_get(int32_t id);
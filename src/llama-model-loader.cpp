@@ -765,6 +765,29 @@ struct ggml_tensor * llama_model_loader::create_tensor(struct ggml_context * ctx
     return create_tensor_for(ctx, cur, flags & TENSOR_DUPLICATED);
 }
 
+struct ggml_tensor * llama_model_loader::create_tensor_slice(struct ggml_context * ctx, const std::string & name,
+        const std::vector<int64_t> & ne, int dim, int64_t i0, int64_t n, int idx) {
+    const struct ggml_tensor * cur = check_tensor_dims(name, ne, true);
+
+    GGML_ASSERT(dim == 0 || dim == 1);
+    GGML_ASSERT(ggml_n_dims(cur) <= 2 && i0 >= 0 && n > 0 && i0 + n <= cur->ne[dim]);
+    if (dim == 0 && (i0 % ggml_blck_size(cur->type) != 0 || n % ggml_blck_size(cur->type) != 0)) {
+        throw std::runtime_error(format("%s: cannot slice columns [%" PRId64 ", %" PRId64 ") of tensor '%s' of type %s",
+                    __func__, i0, i0 + n, name.c_str(), ggml_type_name(cur->type)));
+    }
+
+    struct ggml_tensor * tensor = dim == 0 ? ggml_new_tensor_2d(ctx, cur->type, n, cur->ne[1])
+                                           : ggml_new_tensor_2d(ctx, cur->type, cur->ne[0], n);
+    ggml_format_name(tensor, "%s.%d", name.c_str(), idx);
+
+    slices[tensor] = { get_weight(name.c_str()), dim, i0 };
+    if (i0 == 0) {
+        n_created++;
+    }
+
+    return tensor;
+}
+
 struct ggml_tensor * llama_model_loader::create_tensor_as_view(struct ggml_context * ctx, struct ggml_tensor * base,
         const std::string & name, const std::vector<int64_t> & ne, size_t offset, bool required) {
     const struct ggml_tensor * cur = check_tensor_dims(name, ne, required);
@@ -870,6 +893,36 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+void llama_model_loader::load_slice(struct ggml_tensor * cur, const llama_tensor_slice & slice, std::vector<no_init<uint8_t>> & read_buf) const {
+    const auto & w = *slice.weight;
+    const size_t n_size   = ggml_nbytes(cur);
+    const size_t row_size = w.tensor->nb[1];
+
+    // rows are contiguous in the file, columns are gathered row by row
+    const size_t offs  = slice.dim == 1 ? slice.i0*row_size : ggml_row_size(w.tensor->type, slice.i0);
+    const size_t len   = slice.dim == 1 ? n_size : cur->nb[1];
+    const int64_t nrow = slice.dim == 1 ? 1 : cur->ne[1];
+
+    read_buf.resize(n_size);
+    uint8_t * dst = (uint8_t *) read_buf.data();
+    if (use_mmap) {
+        const uint8_t * src = (const uint8_t *) mappings.at(w.idx)->addr() + w.offs + offs;
+        for (int64_t ir = 0; ir < nrow; ++ir) {
+            memcpy(dst + ir*len, src + ir*row_size, len);
+        }
+    } else {
+        const auto & file = files.at(w.idx);
+        for (int64_t ir = 0; ir < nrow; ++ir) {
+            file->seek(w.offs + offs + ir*row_size, SEEK_SET);
+            file->read_raw(dst + ir*len, len);
+        }
+    }
+    if (check_tensors && !ggml_validate_row_data(cur->type, dst, n_size)) {
+        throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(cur)));
+    }
+    ggml_backend_tensor_set(cur, dst, 0, n_size);
+}
+
 // Returns false if cancelled by progress_callback
 bool llama_model_loader::load_all_data(
             struct ggml_context * ctx,
@@ -923,7 +976,11 @@ bool llama_model_loader::load_all_data(
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
-            // this can happen with split experts models
+            if (auto it = slices.find(cur); it != slices.end()) {
+                load_slice(cur, it->second, read_buf);
+                size_done += ggml_nbytes(cur);
+            }
+            // otherwise this can happen with split experts models
             continue;
         }
 
@@ -66,6 +66,14 @@ struct llama_model_loader {
     };
     std::vector<llama_tensor_weight> weights;
 
+    // a range of rows (dim = 1) or columns (dim = 0) of a weight, created for tensor parallelism
+    struct llama_tensor_slice {
+        const llama_tensor_weight * weight;
+        int     dim;
+        int64_t i0;
+    };
+    std::unordered_map<const ggml_tensor *, llama_tensor_slice> slices;
+
     std::unordered_map<std::string, struct llama_model_kv_override> kv_overrides;
     const llama_model_tensor_buft_override * tensor_buft_overrides;
 
@@ -143,6 +151,11 @@ struct llama_model_loader {
 
     struct ggml_tensor * create_tensor(struct ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne, int flags = 0);
 
+    // creates the slice [i0, i0 + n) along dim of a weight, named <name>.<idx>
+    // the weight counts as created with its first slice (i0 = 0)
+    struct ggml_tensor * create_tensor_slice(struct ggml_context * ctx, const std::string & name, const std::vector<int64_t> & ne,
+            int dim, int64_t i0, int64_t n, int idx);
+
     struct ggml_tensor * create_tensor_as_view(struct ggml_context * ctx, struct ggml_tensor * base,
             const std::string & name, const std::vector<int64_t> & ne, size_t offset, bool required = true);
 
@@ -159,6 +172,8 @@ struct llama_model_loader {
     size_t size_data = 0;
     std::vector<std::pair<size_t, size_t>> mmaps_used;
 
+    void load_slice(struct ggml_tensor * cur, const llama_tensor_slice & slice, std::vector<no_init<uint8_t>> & read_buf) const;
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -0,0 +1,305 @@
+#include "llama-output-head.h"
+#include "llama-impl.h"
+
+#include "ggml-alloc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+#include <random>
+#include <thread>
+
+llama_output_head_factors::~llama_output_head_factors() {
+    ggml_backend_buffer_free(buf);
+    if (ctx) {
+        ggml_free(ctx);
+    }
+}
+
+llama_output_head::~llama_output_head() {
+    if (n_rows > 0) {
+        LLAMA_LOG_INFO("%s: %" PRId64 " outputs, %" PRId64 " (%.2f%%) recomputed exactly\n", __func__,
+                n_rows, n_fallback, 100.0*n_fallback/n_rows);
+    }
+}
+
+static bool llama_output_head_supported(const ggml_tensor * output) {
+    const ggml_type type = output->type;
+    // interleaved types store several rows together and cannot be dequantized row by row
+    if (type >= GGML_TYPE_Q4_0_R8 || type == GGML_TYPE_Q4_0_4_4 || type == GGML_TYPE_Q4_0_4_8 || type == GGML_TYPE_Q4_0_8_8) {
+        return false;
+    }
+    return type == GGML_TYPE_F32 || ggml_internal_get_type_traits(type).to_float != nullptr;
+}
+
+static void llama_output_head_get_row(const ggml_tensor * output, int64_t i, float * y) {
+    const char * row = (const char *)output->data + i*output->nb[1];
+    if (output->type == GGML_TYPE_F32) {
+        std::memcpy(y, row, output->ne[0]*sizeof(float));
+    } else {
+        ggml_internal_get_type_traits(output->type).to_float(row, y, output->ne[0]);
+    }
+}
+
+// run f(ith, i0, i1) on n_threads threads, splitting [0, n) into contiguous chunks
+template <typename F>
+static void llama_output_head_parallel(int64_t n, int n_threads, F && f) {
+    n_threads = std::max(1, std::min<int>(n_threads, (int)std::min<int64_t>(n, 1024)));
+    const int64_t chunk = (n + n_threads - 1)/n_threads;
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back([&f, ith, chunk, n] { f(ith, std::min(n, ith*chunk), std::min(n, (ith + 1)*chunk)); });
+    }
+    f(0, 0, std::min(n, chunk));
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// Y <- Y R^{-1}, where Y^T Y = R^T R (CholeskyQR)
+static bool llama_output_head_orthonormalize(std::vector<float> & Y, int64_t n_rows, int r, int n_threads) {
+    std::vector<std::vector<double>> partial(n_threads, std::vector<double>(r*r, 0.0));
+    llama_output_head_parallel(n_rows, n_threads, [&](int ith, int64_t i0, int64_t i1) {
+        auto & G = partial[ith];
+        for (int64_t i = i0; i < i1; ++i) {
+            const float * y = Y.data() + i*r;
+            for (int a = 0; a < r; ++a) {
+                const double ya = y[a];
+                for (int b = a; b < r; ++b) G[a*r + b] += ya*y[b];
+            }
+        }
+    });
+    std::vector<double> L(r*r, 0.0);
+    for (auto & G : partial) {
+        for (int a = 0; a < r; ++a) for (int b = a; b < r; ++b) L[b*r + a] += G[a*r + b];
+    }
+    double trace = 0;
+    for (int a = 0; a < r; ++a) trace += L[a*r + a];
+    if (!(trace > 0)) {
+        return false;
+    }
+    const double eps = 1e-10*trace/r;
+    // in-place lower Cholesky factor
+    for (int j = 0; j < r; ++j) {
+        double d = L[j*r + j] + eps;
+        for (int k = 0; k < j; ++k) d -= L[j*r + k]*L[j*r + k];
+        if (!(d > 0)) {
+            return false;
+        }
+        d = std::sqrt(d);
+        L[j*r + j] = d;
+        for (int i = j + 1; i < r; ++i) {
+            double s = L[i*r + j];
+            for (int k = 0; k < j; ++k) s -= L[i*r + k]*L[j*r + k];
+            L[i*r + j] = s/d;
+        }
+    }
+    // each row y of Y becomes L^{-1} y (forward substitution)
+    llama_output_head_parallel(n_rows, n_threads, [&](int, int64_t i0, int64_t i1) {
+        for (int64_t i = i0; i < i1; ++i) {
+            float * y = Y.data() + i*r;
+            for (int a = 0; a < r; ++a) {
+                double s = y[a];
+                for (int k = 0; k < a; ++k) s -= L[a*r + k]*y[k];
+                y[a] = s/L[a*r + a];
+            }
+        }
+    });
+    return true;
+}
+
+// randomized range finder, see the comment in llama-output-head.h
+static std::shared_ptr<llama_output_head_factors> llama_output_head_factorize(const ggml_tensor * output, int32_t rank, int n_threads) {
+    const int64_t n_embd  = output->ne[0];
+    const int64_t n_vocab = output->ne[1];
+
+    const int64_t t_start_us = ggml_time_us();
+    const int r = rank;
+    n_threads = std::max(1, n_threads);
+
+    // Y = W Omega with a Gaussian test matrix, then one power iteration Y = W (W^T Q) to sharpen the spectrum
+    std::vector<float> omega(n_embd*r);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> dist;
+        for (auto & x : omega) x = dist(rng);
+    }
+
+    std::vector<float> Y(n_vocab*r, 0.0f);
+    auto project = [&](const std::vector<float> & B) {
+        // Y = W B, B is [n_embd x r]
+        llama_output_head_parallel(n_vocab, n_threads, [&](int, int64_t i0, int64_t i1) {
+            std::vector<float> w(n_embd);
+            for (int64_t i = i0; i < i1; ++i) {
+                llama_output_head_get_row(output, i, w.data());
+                float * y = Y.data() + i*r;
+                std::fill(y, y + r, 0.0f);
+                for (int64_t j = 0; j < n_embd; ++j) {
+                    const float wj = w[j];
+                    const float * b = B.data() + j*r;
+                    for (int k = 0; k < r; ++k) y[k] += wj*b[k];
+                }
+            }
+        });
+    };
+    // returns W^T Y as [n_embd x r]
+    auto project_t = [&]() {
+        std::vector<std::vector<float>> partial(std::max(1, n_threads));
+        llama_output_head_parallel(n_vocab, n_threads, [&](int ith, int64_t i0, int64_t i1) {
+            auto & P = partial[ith];
+            P.assign(n_embd*r, 0.0f);
+            std::vector<float> w(n_embd);
+            for (int64_t i = i0; i < i1; ++i) {
+                llama_output_head_get_row(output, i, w.data());
+                const float * y = Y.data() + i*r;
+                for (int64_t j = 0; j < n_embd; ++j) {
+                    const float wj = w[j];
+                    float * p = P.data() + j*r;
+                    for (int k = 0; k < r; ++k) p[k] += wj*y[k];
+                }
+            }
+        });
+        std::vector<float> B(n_embd*r, 0.0f);
+        for (auto & P : partial) {
+            for (size_t i = 0; i < P.size(); ++i) B[i] += P[i];
+        }
+        return B;
+    };
+
+    bool ok = true;
+    project(omega);
+    ok = ok && llama_output_head_orthonormalize(Y, n_vocab, r, n_threads);
+    if (ok) {
+        project(project_t());
+        // CholeskyQR2: the second pass restores orthogonality lost to rounding
+        ok = llama_output_head_orthonormalize(Y, n_vocab, r, n_threads) && llama_output_head_orthonormalize(Y, n_vocab, r, n_threads);
+    }
+    if (!ok) {
+        LLAMA_LOG_WARN("%s: failed to factorize the output matrix - two-stage output head disabled\n", __func__);
+        return nullptr;
+    }
+    // V^T = W^T Q
+    std::vector<float> Vt = project_t();
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ 2*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+    auto factors = std::make_shared<llama_output_head_factors>();
+    factors->ctx = ggml_init(params);
+    if (!factors->ctx) {
+        return nullptr;
+    }
+    factors->U = ggml_new_tensor_2d(factors->ctx, GGML_TYPE_F16, r, n_vocab);
+    factors->V = ggml_new_tensor_2d(factors->ctx, GGML_TYPE_F32, n_embd, r);
+    ggml_set_name(factors->U, "output_head_u");
+    ggml_set_name(factors->V, "output_head_v");
+    factors->buf = ggml_backend_alloc_ctx_tensors_from_buft(factors->ctx, ggml_backend_buffer_get_type(output->buffer));
+    if (!factors->buf) {
+        LLAMA_LOG_WARN("%s: failed to allocate the output head buffer - two-stage output head disabled\n", __func__);
+        return nullptr;
+    }
+    ggml_fp32_to_fp16_row(Y.data(), (ggml_fp16_t *)factors->U->data, n_vocab*r);
+    float * V = (float *)factors->V->data;
+    for (int k = 0; k < r; ++k) {
+        for (int64_t j = 0; j < n_embd; ++j) V[k*n_embd + j] = Vt[j*r + k];
+    }
+    factors->rank = rank;
+
+    LLAMA_LOG_INFO("%s: rank = %d, calibrated in %.2f s, %.2f MiB\n", __func__,
+            rank, 1e-6*(ggml_time_us() - t_start_us), ggml_backend_buffer_get_size(factors->buf)/1024.0/1024.0);
+    return factors;
+}
+
+bool llama_output_head_init(llama_output_head & head, const ggml_tensor * output,
+        int32_t rank, int32_t n_top, float min_mass, int n_threads,
+        std::shared_ptr<llama_output_head_factors> & cache) {
+    const int64_t n_embd  = output->ne[0];
+    const int64_t n_vocab = output->ne[1];
+
+    if (!output->buffer || !ggml_backend_buffer_is_host(output->buffer) || !output->data) {
+        LLAMA_LOG_WARN("%s: the output tensor is not in host memory - two-stage output head disabled\n", __func__);
+        return false;
+    }
+    if (!llama_output_head_supported(output)) {
+        LLAMA_LOG_WARN("%s: output tensor type %s is not supported - two-stage output head disabled\n", __func__,
+                ggml_type_name(output->type));
+        return false;
+    }
+    if (rank <= 0 || rank >= n_embd || n_top <= 0 || n_top >= n_vocab) {
+        LLAMA_LOG_WARN("%s: invalid rank = %d or n_top = %d - two-stage output head disabled\n", __func__, rank, n_top);
+        return false;
+    }
+
+    if (!cache || cache->rank != rank) {
+        cache = llama_output_head_factorize(output, rank, n_threads);
+        if (!cache) {
+            return false;
+        }
+    }
+
+    head.factors  = cache;
+    head.U        = cache->U;
+    head.V        = cache->V;
+    head.rank     = rank;
+    head.n_top    = n_top;
+    head.min_mass = min_mass;
+
+    LLAMA_LOG_INFO("%s: rank = %d, n_top = %d, min_mass = %g\n", __func__, rank, n_top, min_mass);
+    return true;
+}
+
+void llama_output_head_select(ggml_tensor * dst, const ggml_tensor * a, const ggml_tensor * b, int ith, int nth, void * userdata) {
+    GGML_UNUSED(a);
+    const auto * head = (const llama_output_head *)userdata;
+    const int64_t n_vocab = b->ne[0];
+    const int64_t n_rows  = b->ne[1];
+    const int     n_top   = head->n_top;
+    std::vector<int32_t> idx(n_vocab);
+    for (int64_t row = ith; row < n_rows; row += nth) {
+        const float * x = (const float *)((const char *)b->data + row*b->nb[1]);
+        std::iota(idx.begin(), idx.end(), 0);
+        std::nth_element(idx.begin(), idx.begin() + (n_top - 1), idx.end(), [x](int32_t i, int32_t j) { return x[i] > x[j]; });
+        std::memcpy((int32_t *)dst->data + row*n_top, idx.data(), n_top*sizeof(int32_t));
+    }
+}
+
+void llama_output_head_merge(ggml_tensor * dst, const ggml_tensor * a, const ggml_tensor * b, const ggml_tensor * c,
+        int ith, int nth, void * userdata) {
+    auto * head = (llama_output_head *)userdata;
+    const int64_t n_vocab = a->ne[0];
+    const int64_t n_rows  = a->ne[1];
+    const int     n_top   = head->n_top;
+    for (int64_t row = ith; row < n_rows; row += nth) {
+        const float   * x  = (const float *)((const char *)a->data + row*a->nb[1]);
+        const int32_t * id = (const int32_t *)b->data + row*n_top;
+        const float   * e  = (const float *)((const char *)c->data + row*c->nb[2]);
+        float * y = (float *)((char *)dst->data + row*dst->nb[1]);
+        std::memcpy(y, x, n_vocab*sizeof(float));
+        for (int k = 0; k < n_top; ++k) y[id[k]] = e[k];
+        if (head->min_mass > 0) {
+            float max = -INFINITY;
+            for (int64_t i = 0; i < n_vocab; ++i) max = std::max(max, y[i]);
+            double sum = 0, sum_top = 0;
+            for (int64_t i = 0; i < n_vocab; ++i) sum += expf(y[i] - max);
+            for (int k = 0; k < n_top; ++k) sum_top += expf(e[k] - max);
+            head->fallback[row] = sum_top < head->min_mass*sum;
+        }
+    }
+}
+
+void llama_output_head_exact(const ggml_tensor * output, const float * h, float * logits, int n_threads) {
+    const int64_t n_embd = output->ne[0];
+    llama_output_head_parallel(output->ne[1], n_threads, [&](int, int64_t i0, int64_t i1) {
+        std::vector<float> w(n_embd);
+        for (int64_t i = i0; i < i1; ++i) {
+            llama_output_head_get_row(output, i, w.data());
+            float sum = 0;
+            for (int64_t j = 0; j < n_embd; ++j) sum += w[j]*h[j];
+            logits[i] = sum;
+        }
+    });
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ggml.h"
+#include "ggml-backend.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+//
+// two-stage output head
+//
+// The output matrix W [n_vocab x n_embd] is approximated as Q (Q^T W), where Q [n_vocab x rank] has orthonormal
+// columns spanning the dominant range of W. Q and V = Q^T W are computed once from the model weights
+// (randomized range finder). At decode time the approximate logits Q (V h) are used to select the n_top most
+// likely tokens, for which the exact logits are then computed with the original output matrix.
+// If the selected candidates carry less than min_mass of the probability mass, the output is recomputed exactly.
+// The logits of the other tokens are the low-rank approximations, see llama_get_logits_candidates_ith.
+//
+// The factors depend only on the model and the rank, they are computed once and shared by all contexts of a model.
+//
+
+// low-rank factors of the output matrix
+struct llama_output_head_factors {
+    int32_t rank = 0;
+
+    struct ggml_context * ctx = nullptr;
+    ggml_backend_buffer_t buf = nullptr;
+
+    struct ggml_tensor * U = nullptr; // F16 [rank,   n_vocab]
+    struct ggml_tensor * V = nullptr; // F32 [n_embd, rank   ]
+
+    ~llama_output_head_factors();
+};
+
+struct llama_output_head {
+    int32_t rank     = 0;
+    int32_t n_top    = 0;
+    float   min_mass = 0.0f;
+
+    std::shared_ptr<llama_output_head_factors> factors;
+
+    struct ggml_tensor * U = nullptr; // factors->U
+    struct ggml_tensor * V = nullptr; // factors->V
+
+    // set by the merge op for every output row whose candidates fall below min_mass
+    std::vector<uint8_t> fallback;
+
+    // per output of the last llama_decode: the ids of the n_top candidates with exact logits,
+    // and whether the other logits are approximate (0 if the head was not used or the output was recomputed)
+    std::vector<int32_t> candidates;
+    std::vector<uint8_t> approx;
+
+    int64_t n_rows     = 0;
+    int64_t n_fallback = 0;
+
+    bool enabled() const { return U != nullptr; }
+
+    ~llama_output_head();
+};
+
+// set up the head with the low-rank factors of the output matrix, which must be in host memory
+// the factors are taken from cache if they were computed for the same rank, otherwise they are computed and cached
+// returns false (and leaves the head disabled) if the output tensor is not supported
+bool llama_output_head_init(llama_output_head & head, const struct ggml_tensor * output,
+        int32_t rank, int32_t n_top, float min_mass, int n_threads,
+        std::shared_ptr<llama_output_head_factors> & cache);
+
+// custom ops used in the graph, userdata is the llama_output_head
+// select: dst I32 [n_top*n_outputs], b = approximate logits
+void llama_output_head_select(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b,
+        int ith, int nth, void * userdata);
+// merge: dst F32 [n_vocab, n_outputs], a = approximate logits, b = candidate ids, c = exact candidate logits
+void llama_output_head_merge(struct ggml_tensor * dst, const struct ggml_tensor * a, const struct ggml_tensor * b,
+        const struct ggml_tensor * c, int ith, int nth, void * userdata);
+
+// exact logits for a single hidden state h [n_embd]
+void llama_output_head_exact(const struct ggml_tensor * output, const float * h, float * logits, int n_threads);
@@ -0,0 +1,167 @@
+#include "llama-prefetch.h"
+#include "llama-impl.h"
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+        #endif
+    #endif
+#endif
+
+#if defined(_POSIX_MAPPED_FILES) && defined(MADV_WILLNEED)
+#define LLAMA_PREFETCH_SUPPORTED
+#endif
+
+// chunks are read ahead one at a time, and at most k_window bytes are in flight
+static constexpr size_t k_chunk  = 16ull*1024*1024;
+static constexpr size_t k_window = 256ull*1024*1024;
+
+#ifdef LLAMA_PREFETCH_SUPPORTED
+
+static size_t llama_page_size() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// number of resident bytes in a page aligned range, or 0 if residency cannot be queried, so that the range is read
+static size_t llama_resident_bytes(uint8_t * addr, size_t size) {
+#ifdef __linux__
+    const size_t page_size = llama_page_size();
+    std::vector<unsigned char> vec((size + page_size - 1)/page_size);
+    if (mincore(addr, size, vec.data()) != 0) {
+        return 0;
+    }
+    size_t n_resident = 0;
+    for (auto v : vec) {
+        n_resident += v & 1;
+    }
+    return std::min(size, n_resident*page_size);
+#else
+    GGML_UNUSED(addr);
+    GGML_UNUSED(size);
+    return 0;
+#endif
+}
+
+#endif
+
+llama_prefetcher::llama_prefetcher(std::vector<llama_prefetch_range> input) {
+#ifdef LLAMA_PREFETCH_SUPPORTED
+    // align to pages and merge ranges that continue where the previous one ends
+    const size_t page_size = llama_page_size();
+    for (const auto & range : input) {
+        if (range.size == 0) {
+            continue;
+        }
+        const uintptr_t first = (uintptr_t)range.addr & ~(page_size - 1);
+        const uintptr_t last  = ((uintptr_t)range.addr + range.size + page_size - 1) & ~(page_size - 1);
+        if (!ranges.empty()) {
+            auto & prev = ranges.back();
+            const uintptr_t prev_first = (uintptr_t)prev.addr;
+            const uintptr_t prev_last  = prev_first + prev.size;
+            if (first >= prev_first && first <= prev_last) {
+                prev.size = std::max(prev_last, last) - prev_first;
+                continue;
+            }
+        }
+        ranges.push_back({(uint8_t *)first, size_t(last - first)});
+    }
+    worker = std::thread([this] { run(); });
+#else
+    GGML_UNUSED(input);
+#endif
+}
+
+llama_prefetcher::~llama_prefetcher() {
+    stop = true;
+    wait();
+}
+
+void llama_prefetcher::wait() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+void llama_prefetcher::run() {
+#ifdef LLAMA_PREFETCH_SUPPORTED
+    const size_t  page_size = llama_page_size();
+    const int64_t t_start   = ggml_time_us();
+
+    std::deque<llama_prefetch_range> in_flight;
+    size_t n_in_flight = 0;
+    size_t n_read      = 0;
+    size_t n_total     = 0;
+
+    // waits for the pages of a chunk by touching them
+    auto complete = [page_size](const llama_prefetch_range & chunk) {
+        for (size_t offset = 0; offset < chunk.size; offset += page_size) {
+            (void)*(volatile const uint8_t *)(chunk.addr + offset);
+        }
+    };
+
+    for (const auto & range : ranges) {
+        for (size_t offset = 0; offset < range.size && !stop; offset += k_chunk) {
+            const llama_prefetch_range chunk = {range.addr + offset, std::min(k_chunk, range.size - offset)};
+            n_total += chunk.size;
+            if (llama_resident_bytes(chunk.addr, chunk.size) == chunk.size) {
+                continue;
+            }
+            if (madvise(chunk.addr, chunk.size, MADV_WILLNEED) != 0) {
+                LLAMA_LOG_WARN("llama_prefetcher: madvise(MADV_WILLNEED) failed: %s\n", strerror(errno));
+                return;
+            }
+            in_flight.push_back(chunk);
+            n_in_flight += chunk.size;
+            n_read      += chunk.size;
+            while (n_in_flight > k_window) {
+                complete(in_flight.front());
+                n_in_flight -= in_flight.front().size;
+                in_flight.pop_front();
+            }
+        }
+    }
+
+    if (stop) {
+        return;
+    }
+    for (const auto & chunk : in_flight) {
+        complete(chunk);
+    }
+    if (n_read > 0) {
+        const double t = 1e-6*(ggml_time_us() - t_start);
+        LLAMA_LOG_INFO("llama_prefetcher: paged in %.2f MiB of %.2f MiB in %.2f s (%.2f MiB/s)\n",
+                n_read/1024./1024., n_total/1024./1024., t, n_read/1024./1024./std::max(t, 1e-6));
+    }
+#endif
+}
+
+float llama_prefetcher::resident_fraction(const std::vector<llama_prefetch_range> & ranges) {
+#if defined(LLAMA_PREFETCH_SUPPORTED) && defined(__linux__)
+    const size_t page_size = llama_page_size();
+    size_t n_total    = 0;
+    size_t n_resident = 0;
+    for (const auto & range : ranges) {
+        const uintptr_t first = (uintptr_t)range.addr & ~(page_size - 1);
+        const uintptr_t last  = ((uintptr_t)range.addr + range.size + page_size - 1) & ~(page_size - 1);
+        for (uintptr_t addr = first; addr < last; addr += k_chunk) {
+            const size_t size = std::min<size_t>(k_chunk, last - addr);
+            n_total    += size;
+            n_resident += llama_resident_bytes((uint8_t *)addr, size);
+        }
+    }
+    return n_total > 0 ? float(double(n_resident)/n_total) : 1.0f;
+#else
+    GGML_UNUSED(ranges);
+    return 1.0f;
+#endif
+}
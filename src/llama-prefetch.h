@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+//
+// background page-in of mmapped model weights
+//
+// The ranges are given in the order in which the graph uses them. A background thread reads them ahead in large
+// chunks with madvise(MADV_WILLNEED), skipping chunks that mincore reports as resident. It keeps at most a bounded
+// amount of I/O in flight by touching the oldest chunk before issuing the next one, so compute threads that run
+// behind it wait on pending reads instead of faulting the weights in one page at a time.
+//
+
+struct llama_prefetch_range {
+    uint8_t * addr;
+    size_t    size;
+};
+
+struct llama_prefetcher {
+    explicit llama_prefetcher(std::vector<llama_prefetch_range> ranges);
+    ~llama_prefetcher(); // stops prefetching and joins the thread
+
+    void wait(); // returns when all ranges were paged in
+
+    // fraction of the bytes in the ranges that is resident in memory, 1 if this cannot be determined
+    static float resident_fraction(const std::vector<llama_prefetch_range> & ranges);
+
+private:
+    void run();
+
+    std::vector<llama_prefetch_range> ranges; // page aligned
+    std::atomic<bool>                 stop{false};
+    std::thread                       worker;
+};
@@ -12,6 +12,9 @@
 #include "llama-arch.h"
 #include "llama-mmap.h"
 #include "llama-model-loader.h"
+#include "llama-output-head.h"
+#include "llama-cpu-partition.h"
+#include "llama-prefetch.h"
 
 #include "unicode.h"
 
@@ -85,6 +88,8 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
@@ -109,6 +114,7 @@
 #include <set>
 #include <sstream>
 #include <thread>
+#include <tuple>
 #include <type_traits>
 #include <unordered_map>
 #include <regex>
@@ -120,6 +126,7 @@
 // bump if necessary
 #define LLAMA_MAX_LAYERS  512
 #define LLAMA_MAX_EXPERTS 384  // Kimi-K2
+#define LLAMA_MAX_SEQ     256  // max. number of sequences a KV cache cell can belong to
 
 //
 // helpers
@@ -1774,6 +1781,19 @@ ggml_backend_buffer_type_t llama_default_buffer_type_cpu(bool host_buffer) {
     GGML_UNUSED(host_buffer);
 }
 
+// plain CPU buffers are moved to huge pages if requested
+// pinned/HBM host buffer types are kept as they are, they are needed by the backend that provides them
+static ggml_backend_buffer_type_t llama_hugepage_buffer_type(ggml_backend_buffer_type_t buft, enum llama_hugepages hugepages) {
+    if (hugepages == LLAMA_HUGEPAGES_NONE || buft != ggml_backend_cpu_buffer_type()) {
+        return buft;
+    }
+    switch (hugepages) {
+        case LLAMA_HUGEPAGES_2M: return ggml_backend_cpu_hugepage_buffer_type(size_t(1) << 21, -1);
+        case LLAMA_HUGEPAGES_1G: return ggml_backend_cpu_hugepage_buffer_type(size_t(1) << 30, -1);
+        default:                 return ggml_backend_cpu_hugepage_buffer_type(0, -1);
+    }
+}
+
 //
 // globals
 //
@@ -2119,6 +2139,17 @@ struct llama_cparams {
     bool fused_up_gate;
     int  min_experts;
     float thresh_experts;
+    bool logits_zero_copy;
+
+    int32_t output_head_rank;
+    int32_t output_head_top;
+    float   output_head_min_mass;
+
+    int32_t cpu_priority;
+
+    enum llama_hugepages hugepages_kv;
+
+    bool lazy_k_shift;
 
     enum llama_pooling_type pooling_type;
 
@@ -2135,6 +2166,19 @@ struct llama_layer_nextn {
     struct ggml_tensor * shared_head_norm = nullptr;
 };
 
+// the slices of a layer's matrices held by one device with tensor parallelism
+// a device without heads (or FFN columns) has null attention (FFN) slices
+struct llama_layer_tp {
+    struct ggml_tensor * wq = nullptr; // rows of the device's heads
+    struct ggml_tensor * wk = nullptr;
+    struct ggml_tensor * wv = nullptr;
+    struct ggml_tensor * wo = nullptr; // columns of the device's heads
+
+    struct ggml_tensor * ffn_gate = nullptr; // rows
+    struct ggml_tensor * ffn_up   = nullptr;
+    struct ggml_tensor * ffn_down = nullptr; // columns
+};
+
 // TODO: separate into "llama_layer_enc" and "llama_layer_dec"
 struct llama_layer {
     // normalization
@@ -2263,6 +2307,9 @@ struct llama_layer {
 
     struct llama_layer_nextn nextn;
 
+    // one entry per tensor parallel device, empty if the layer is not split
+    std::vector<llama_layer_tp> tp;
+
     std::unique_ptr<ggml_tensor> computed_wk_b;
     std::unique_ptr<ggml_tensor> computed_wv_b;
     std::unique_ptr<ggml_tensor> computed_wkv_b;
@@ -2273,14 +2320,32 @@ struct llama_kv_cell {
     llama_pos delta = 0;
     int32_t   src   = 0; // used by recurrent state models to copy states
 
-    std::set<llama_seq_id> seq_id;
+    // sequence membership as a fixed-width bitset: no heap allocations per cell,
+    // and membership tests are a single bit test instead of a tree lookup
+    std::bitset<LLAMA_MAX_SEQ> seq_id;
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return id >= 0 && id < LLAMA_MAX_SEQ && seq_id[id];
+    }
+
+    void add_seq_id(const llama_seq_id & id) {
+        seq_id.set(id);
+    }
+
+    void rm_seq_id(const llama_seq_id & id) {
+        seq_id.reset(id);
+    }
+
+    void clear_seq_id() {
+        seq_id.reset();
+    }
+
+    uint32_t n_seq_id() const {
+        return seq_id.count();
     }
 
     bool is_empty() const {
-        return seq_id.empty();
+        return seq_id.none();
     }
 
     bool is_same_seq(const llama_kv_cell & other) const {
@@ -2335,36 +2400,52 @@ struct llama_kv_cache {
     }
 };
 
+// The control vector and the steering vectors of a layer are the columns of one tensor: column 0 is the control
+// vector and column k > 0 is the control vector plus steering vector k. The graph adds the column selected by the
+// sequence of each token (inp_cvec_ids), so sequences with different steering vectors can share a ubatch.
 struct llama_control_vector {
-    std::vector<struct ggml_tensor *> tensors; // per layer
+    std::vector<struct ggml_tensor *> tensors; // per layer, F32 [n_embd, n_vectors]
     std::vector<struct ggml_context *> ctxs;
     std::vector<ggml_backend_buffer_t> bufs;
 
+    std::vector<std::vector<float>> vectors;    // host copies, n_embd x n_layer each, empty if not set
+    std::vector<bool>               layer_used; // the layer has a non-zero column
+    std::vector<int32_t>            seq_vector; // column used by the tokens of a sequence
+
     int32_t layer_start = -1;
     int32_t layer_end   = -1;
 
+    int64_t n_vectors = 0; // columns of the allocated tensors, 0 if not allocated
+
     struct ggml_tensor * tensor_for(int il) const {
-        if (il < 0 || il < layer_start || il > layer_end || (size_t) il >= tensors.size()) {
+        if (il < 0 || (size_t) il >= tensors.size() || !layer_used[il]) {
             return nullptr;
         }
         return tensors[il];
     }
 
-    struct ggml_tensor * apply_to(struct ggml_context * ctx, struct ggml_tensor * cur, int  il) const {
-        ggml_tensor * layer_dir = tensor_for(il);
-        if (layer_dir != nullptr) {
-            cur = ggml_add(ctx, cur, layer_dir);
+    int32_t vector_for_seq(llama_seq_id seq_id) const {
+        if (seq_id < 0 || (size_t) seq_id >= seq_vector.size() || (size_t) seq_vector[seq_id] >= vectors.size()) {
+            return 0;
         }
-        return cur;
+        return seq_vector[seq_id];
     }
 
-    ~llama_control_vector() {
+    void free_buffers() {
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
         }
         for (ggml_backend_buffer_t buf : bufs) {
             ggml_backend_buffer_free(buf);
         }
+        tensors.clear();
+        ctxs.clear();
+        bufs.clear();
+        n_vectors = 0;
+    }
+
+    ~llama_control_vector() {
+        free_buffers();
     }
 };
 
@@ -2378,17 +2459,17 @@ struct llama_model {
     llama_hparams hparams = {};
     llama_vocab   vocab;
 
-    struct ggml_tensor * tok_embd;
-    struct ggml_tensor * type_embd;
-    struct ggml_tensor * pos_embd;
-    struct ggml_tensor * tok_norm;
-    struct ggml_tensor * tok_norm_b;
+    struct ggml_tensor * tok_embd   = nullptr;
+    struct ggml_tensor * type_embd  = nullptr;
+    struct ggml_tensor * pos_embd   = nullptr;
+    struct ggml_tensor * tok_norm   = nullptr;
+    struct ggml_tensor * tok_norm_b = nullptr;
 
-    struct ggml_tensor * output_norm;
-    struct ggml_tensor * output_norm_b;
-    struct ggml_tensor * output;
-    struct ggml_tensor * output_b;
-    struct ggml_tensor * output_norm_enc;
+    struct ggml_tensor * output_norm     = nullptr;
+    struct ggml_tensor * output_norm_b   = nullptr;
+    struct ggml_tensor * output          = nullptr;
+    struct ggml_tensor * output_b        = nullptr;
+    struct ggml_tensor * output_norm_enc = nullptr;
 
     std::vector<llama_layer> layers;
 
@@ -2398,6 +2479,10 @@ struct llama_model {
 
     std::vector<std::string> rpc_servers;
 
+    // devices sharing the repeating layers with tensor parallelism (LLAMA_SPLIT_MODE_ROW without a split buffer type)
+    std::vector<ggml_backend_buffer_type_t> tp_bufts;
+    std::vector<float>                      tp_splits; // cumulative fraction of the heads and FFN columns
+
     // gguf metadata
     std::unordered_map<std::string, std::string> gguf_kv;
 
@@ -2437,7 +2522,15 @@ struct llama_model {
     // keep track of loaded lora adapters
     std::set<struct llama_lora_adapter *> lora_adapters;
 
+    // background page-in of the mmapped weights, see llama_model_prefetch
+    std::unique_ptr<llama_prefetcher> prefetcher;
+
+    // low-rank factors of the two-stage output head, shared by the contexts of the model
+    std::shared_ptr<llama_output_head_factors> out_head_factors;
+    std::mutex                                 out_head_mutex;
+
     ~llama_model() {
+        prefetcher.reset();
         for (struct ggml_context * ctx : ctxs) {
             ggml_free(ctx);
         }
@@ -2481,6 +2574,9 @@ struct llama_context {
 
     std::vector<float> scale_data;
 
+    // scratch buffer used when filling the KQ mask (position of each cell in the sequence being processed)
+    std::vector<llama_pos> kq_mask_cell_pos;
+
     std::unordered_map<struct llama_lora_adapter *, float> lora_adapters;
 
     std::vector<ggml_backend_t> backends;
@@ -2512,6 +2608,11 @@ struct llama_context {
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // with cparams.logits_zero_copy, points to the logits of the last decode in the compute buffer
+    // (when they are in host memory), in which case they are not copied to logits.
+    // Only valid until the next graph is computed with the scheduler.
+    float * logits_ext  = nullptr;
+
     std::vector<int32_t> output_ids; // map batch token positions to ids of the logits and embd buffers
     size_t  output_size = 0; // capacity (of tokens positions) for the output buffers
     int32_t n_outputs   = 0; // number of actually-used outputs in the current ubatch or last logical batch
@@ -2541,6 +2642,9 @@ struct llama_context {
     ggml_abort_callback abort_callback      = nullptr;
     void *              abort_callback_data = nullptr;
 
+    // process-wide CPU partition the graphs are computed on, if any
+    llama_cpu_partition * cpu_partition = nullptr;
+
     // input tensors
     struct ggml_tensor * inp_tokens;      // I32 [n_batch]
     struct ggml_tensor * inp_embd;        // F32 [n_embd, n_batch]
@@ -2549,6 +2653,8 @@ struct llama_context {
     struct ggml_tensor * inp_KQ_mask;     // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_KQ_mask_swa; // F32 [kv_size, n_batch]
     struct ggml_tensor * inp_K_shift;     // I32 [kv_size]
+    struct ggml_tensor * inp_K_delta = nullptr; // I32 [n], pending K-shift of the cells [K_delta_first, K_delta_first + n) (lazy_k_shift)
+    uint32_t             K_delta_first = 0;
     struct ggml_tensor * inp_mean;        // F32 [n_batch, n_batch]
     struct ggml_tensor * inp_cls;         // I32 [n_batch]
     struct ggml_tensor * inp_s_copy;      // I32 [kv_size]
@@ -2558,6 +2664,18 @@ struct llama_context {
     struct ggml_tensor * inp_embd_enc;      // F32 [n_embd, n_outputs_enc]
     struct ggml_tensor * inp_KQ_mask_cross; // F32 [n_outputs_enc, n_batch]
     struct ggml_tensor * inp_scale = nullptr; // F32 [n_tokens]
+    struct ggml_tensor * inp_out_vocab;     // I32 [n_output_vocab]
+    struct ggml_tensor * inp_cvec_ids;      // I32 [n_batch, 1], control vector column per token
+    struct ggml_tensor * inp_cvec_out_ids;  // I32 [n_outputs, 1], same for the output rows of the last layer
+
+    // tokens to compute logits for (empty = all of the vocabulary), see llama_set_output_vocab
+    std::vector<llama_token> output_vocab;
+    std::vector<float>       output_vocab_logits; // scratch buffer for the logits of output_vocab
+
+    // two-stage output head (cparams.output_head_rank > 0)
+    llama_output_head    out_head;
+    struct ggml_tensor * out_head_inp = nullptr; // F32 [n_embd, n_outputs], input to the output head
+    struct ggml_tensor * out_head_ids = nullptr; // I32 [n_top*n_outputs], candidates of the output head
 };
 
 struct llama_lora_weight {
@@ -2892,7 +3010,7 @@ static bool llama_kv_cache_init(
 
     // allocate tensors and initialize the buffers to avoid NaNs in the padding
     for (auto it : ctx_map) {
-        ggml_backend_buffer_type_t buft = it.first;
+        ggml_backend_buffer_type_t buft = llama_hugepage_buffer_type(it.first, cparams.hugepages_kv);
         ggml_context * ctx = it.second;
         ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
         if (!buf) {
@@ -2969,6 +3087,16 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    for (uint32_t i = 0; i < n_tokens; ++i) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            const llama_seq_id seq_id = batch.seq_id[i][j];
+            if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: seq_id=%d is out of range [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
+                return false;
+            }
+        }
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -2999,10 +3127,11 @@ static bool llama_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        cache.cells[cache.head + i].pos   = batch.pos[i];
+        cache.cells[cache.head + i].delta = 0;
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.cells[cache.head + i].add_seq_id(batch.seq_id[i][j]);
         }
     }
 
@@ -3024,10 +3153,16 @@ static uint32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
     return 0;
 }
 
+// whether K-shifts are left pending and applied in attention (see llm_build_kqv)
+static bool llama_kv_cache_lazy_shift(const llama_context & lctx) {
+    return lctx.cparams.lazy_k_shift && !lctx.kv_self.recurrent &&
+        lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.model.arch != LLM_ARCH_DEEPSEEK2;
+}
+
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].clear_seq_id();
     }
     cache.head = 0;
     cache.used = 0;
@@ -3069,9 +3204,9 @@ static bool llama_kv_cache_seq_rm(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].clear_seq_id();
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].rm_seq_id(seq_id);
             } else {
                 continue;
             }
@@ -3110,9 +3245,9 @@ static void llama_kv_cache_seq_cp(
 
             // preserve the "keep or clear" status of the copied sequence
             if (cache.cells[seq_id_src].has_seq_id(seq_id_src)) {
-                cache.cells[seq_id_dst].seq_id.insert(seq_id_dst);
+                cache.cells[seq_id_dst].add_seq_id(seq_id_dst);
             } else {
-                cache.cells[seq_id_dst].seq_id.erase(seq_id_dst);
+                cache.cells[seq_id_dst].rm_seq_id(seq_id_dst);
             }
 
             cache.do_copy = true;
@@ -3123,15 +3258,125 @@ static void llama_kv_cache_seq_cp(
     }
     // otherwise, this is the KV cache of a Transformer-like model
 
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: seq_id=%d is out of range [0, %d)\n", __func__, seq_id_dst, LLAMA_MAX_SEQ);
+        return;
+    }
+
     cache.head = 0;
 
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cells[i].add_seq_id(seq_id_dst);
         }
     }
 }
 
+// copy n bytes of t from offset offs_src to offset offs_dst
+static void llama_kv_cache_copy_data(ggml_tensor * t, size_t offs_src, size_t offs_dst, size_t n, std::vector<uint8_t> & buf) {
+    if (ggml_backend_buffer_is_host(t->buffer)) {
+        std::memmove((char *) t->data + offs_dst, (const char *) t->data + offs_src, n);
+    } else {
+        buf.resize(n);
+        ggml_backend_tensor_get(t, buf.data(), offs_src, n);
+        ggml_backend_tensor_set(t, buf.data(), offs_dst, n);
+    }
+}
+
+static int32_t llama_kv_cache_seq_cp_shift(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id_src,
+                 llama_seq_id   seq_id_dst,
+                    llama_pos   p0,
+                    llama_pos   p1,
+                    llama_pos   delta) {
+    if (cache.recurrent) {
+        LLAMA_LOG_ERROR("%s: not supported for recurrent models\n", __func__);
+        return -1;
+    }
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: seq_id=%d is out of range [0, %d)\n", __func__, seq_id_dst, LLAMA_MAX_SEQ);
+        return -1;
+    }
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    std::vector<uint32_t> src;
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            src.push_back(i);
+        }
+    }
+    const uint32_t n = src.size();
+    if (n == 0) {
+        return 0;
+    }
+
+    // destination cells: a contiguous run of free cells if there is one (fewer, larger copies), any free cells otherwise
+    std::vector<uint32_t> dst;
+    for (uint32_t i = 0, n_free = 0; i < cache.size; ++i) {
+        n_free = cache.cells[i].is_empty() ? n_free + 1 : 0;
+        if (n_free == n) {
+            for (uint32_t k = 0; k < n; ++k) {
+                dst.push_back(i + 1 - n + k);
+            }
+            break;
+        }
+    }
+    if (dst.empty()) {
+        for (uint32_t i = 0; i < cache.size && dst.size() < n; ++i) {
+            if (cache.cells[i].is_empty()) {
+                dst.push_back(i);
+            }
+        }
+        if (dst.size() < n) {
+            LLAMA_LOG_ERROR("%s: not enough free KV cells (%u needed, %zu available)\n", __func__, n, dst.size());
+            return -1;
+        }
+    }
+
+    // copy the K and V data, in runs of consecutive source and destination cells
+    std::vector<uint8_t> buf;
+    for (uint32_t k0 = 0, k1 = 1; k0 < n; k0 = k1++) {
+        while (k1 < n && src[k1] == src[k1 - 1] + 1 && dst[k1] == dst[k1 - 1] + 1) {
+            ++k1;
+        }
+        const size_t len = k1 - k0;
+        for (auto * k : cache.k_l) {
+            const size_t row = ggml_nbytes(k)/cache.size;
+            llama_kv_cache_copy_data(k, src[k0]*row, dst[k0]*row, len*row, buf);
+        }
+        for (auto * v : cache.v_l) {
+            if (!cache.v_trans) {
+                const size_t row = ggml_nbytes(v)/cache.size;
+                llama_kv_cache_copy_data(v, src[k0]*row, dst[k0]*row, len*row, buf);
+            } else {
+                // element j of cell i is at j*size + i
+                const size_t  es     = ggml_type_size(v->type);
+                const int64_t n_embd = ggml_nelements(v)/cache.size;
+                for (int64_t j = 0; j < n_embd; ++j) {
+                    llama_kv_cache_copy_data(v, (j*cache.size + src[k0])*es, (j*cache.size + dst[k0])*es, len*es, buf);
+                }
+            }
+        }
+    }
+
+    for (uint32_t k = 0; k < n; ++k) {
+        const llama_kv_cell & cell_src = cache.cells[src[k]];
+        llama_kv_cell       & cell_dst = cache.cells[dst[k]];
+        // the copied keys are rotated for the position of the source cell, so the shift goes into the delta
+        cell_dst.pos   = cell_src.pos   + delta;
+        cell_dst.delta = cell_src.delta + delta;
+        cell_dst.add_seq_id(seq_id_dst);
+    }
+    cache.used += n;
+    if (delta != 0) {
+        cache.has_shift = true;
+    }
+
+    return n;
+}
+
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
@@ -3139,11 +3384,11 @@ static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id
         if (!cache.cells[i].has_seq_id(seq_id)) {
             if (cache.cells[i].pos >= 0) cache.used--;
             cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
+            cache.cells[i].clear_seq_id();
             if (new_head == cache.size) new_head = i;
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cache.cells[i].clear_seq_id();
+            cache.cells[i].add_seq_id(seq_id);
         }
     }
 
@@ -3186,7 +3431,7 @@ static void llama_kv_cache_seq_add(
                     cache.used--;
                 }
                 cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].clear_seq_id();
                 if (new_head == cache.size) {
                     new_head = i;
                 }
@@ -4807,6 +5052,36 @@ static void llm_prepare_mla(llama_model & model, int mla) {
 }
 
 // Returns false if cancelled by progress_callback
+// tensor parallelism is implemented for the dense LLaMA graph without biases,
+// with matrix types that can be sliced along both dimensions
+static bool llama_tp_supported(const llama_model_loader & ml, const llama_model & model) {
+    const auto & hparams = model.hparams;
+    if (model.arch != LLM_ARCH_LLAMA || hparams.n_expert > 0 || hparams.f_attention_scale != 0.0f) {
+        return false;
+    }
+    const auto tn = LLM_TN(model.arch);
+    for (int i = 0; i < (int) hparams.n_layer; ++i) {
+        if (hparams.n_head(i) != hparams.n_head() || hparams.n_head_kv(i) != hparams.n_head_kv() || hparams.n_ff(i) != hparams.n_ff() ||
+            hparams.n_embd_head_k != hparams.n_embd_head_v) {
+            return false;
+        }
+        for (auto t : { LLM_TENSOR_ATTN_Q, LLM_TENSOR_ATTN_K, LLM_TENSOR_ATTN_V, LLM_TENSOR_ATTN_OUT,
+                        LLM_TENSOR_FFN_GATE, LLM_TENSOR_FFN_UP, LLM_TENSOR_FFN_DOWN }) {
+            const ggml_tensor * w = ml.get_tensor_meta(tn(t, "weight", i).c_str());
+            if (!w || ml.get_tensor_meta(tn(t, "bias", i).c_str())) {
+                return false;
+            }
+            // row-interleaved (repacked) types and types with per-row data cannot be sliced by columns
+            const char * type_name = ggml_type_name(w->type);
+            const char * suffix = strrchr(type_name, '_');
+            if (ggml_internal_get_type_traits(w->type).row_meta_size != 0 || (suffix && suffix[1] == 'r' && isdigit(suffix[2]))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 static bool llm_load_tensors(
         llama_model_loader & ml,
         llama_model & model,
@@ -4817,6 +5092,7 @@ static bool llm_load_tensors(
         const float * tensor_split,
         bool use_mlock,
         bool validate_quants,
+        enum llama_hugepages hugepages,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -4841,11 +5117,11 @@ static bool llm_load_tensors(
         model.buft_layer[i] = llama_default_buffer_type_cpu(true);
     }
 
-    if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
-        // calculate the split points
-        int device_count = llama_get_device_count(model);
+    // calculate the split points
+    int device_count = llama_get_device_count(model);
+    std::vector<float> splits(device_count);
+    if (split_mode != LLAMA_SPLIT_MODE_NONE) {
         bool all_zero = tensor_split == nullptr || std::all_of(tensor_split, tensor_split + device_count, [](float x) { return x == 0.0f; });
-        std::vector<float> splits(device_count);
         if (all_zero) {
             // default split, by free memory
             for (int i = 0; i < device_count; ++i) {
@@ -4864,7 +5140,9 @@ static bool llm_load_tensors(
         for (int i = 0; i < device_count; ++i) {
             splits[i] /= split_sum;
         }
+    }
 
+    if (split_mode == LLAMA_SPLIT_MODE_LAYER) {
         // assign the repeating layers to the devices according to the splits
         int act_gpu_layers = std::min(n_gpu_layers, (int)n_layer + 1);
         for (int i = i_gpu_start; i < n_layer; ++i) {
@@ -4882,6 +5160,36 @@ static bool llm_load_tensors(
         ggml_backend_buffer_type_t split_buft;
         if (split_mode == LLAMA_SPLIT_MODE_ROW) {
             split_buft = llama_default_buffer_type_split(model, main_gpu, tensor_split);
+            if (split_buft == llama_default_buffer_type_offload(model, main_gpu) && device_count > 1 && i_gpu_start < n_layer) {
+                // no split buffer type (CPU, RPC): the matrices of the repeating layers are split in the graph instead
+                if (llama_tp_supported(ml, model)) {
+                    // each device needs at least one KV head, the coarsest unit of the split, or its slices would be
+                    // empty: smaller shares go to the other devices
+                    const float min_share = 1.0f/std::max<uint32_t>(1, hparams.n_head_kv());
+                    float tp_sum = 0.0f;
+                    for (int i = 0; i < device_count; ++i) {
+                        const float share = splits[i] - (i > 0 ? splits[i - 1] : 0.0f);
+                        if (share >= min_share) {
+                            tp_sum += share;
+                            model.tp_bufts.push_back(llama_default_buffer_type_offload(model, i));
+                            model.tp_splits.push_back(tp_sum);
+                        }
+                    }
+                    for (auto & split : model.tp_splits) {
+                        split /= tp_sum;
+                    }
+                    if (model.tp_bufts.size() < 2) {
+                        model.tp_bufts.clear();
+                        model.tp_splits.clear();
+                    }
+                    for (int d = 0; d < (int) model.tp_bufts.size(); ++d) {
+                        LLAMA_LOG_INFO("%s: tensor parallel device %d: %s, %.1f%% of the split matrices\n", __func__, d,
+                                ggml_backend_buft_name(model.tp_bufts[d]), 100.0f*(model.tp_splits[d] - (d > 0 ? model.tp_splits[d - 1] : 0.0f)));
+                    }
+                } else {
+                    LLAMA_LOG_WARN("%s: row split is not supported for this model with these backends, using device %d only\n", __func__, main_gpu);
+                }
+            }
         } else {
             // LLAMA_SPLIT_MODE_NONE or LLAMA_SPLIT_MODE_LAYER in backends where it is not supported
             split_buft = llama_default_buffer_type_offload(model, main_gpu);
@@ -4958,6 +5266,35 @@ static bool llm_load_tensors(
 
     LLAMA_LOG_INFO("%s: ggml ctx size = %7.2f MiB\n", __func__, model.ctxs.size()*ctx_size/1024.0/1024.0);
 
+    // with tensor parallelism the slices of each device go to a separate context that is never backed by the mmap
+    std::vector<ggml_context *> ctx_map_tp(model.tp_bufts.size(), nullptr);
+    auto ctx_for_tp = [&model, &ctx_map_tp, n_layer](int d) -> ggml_context * {
+        if (ctx_map_tp[d]) return ctx_map_tp[d];
+
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead()*7*n_layer,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+
+        ggml_context * ctx = ggml_init(params);
+        if (!ctx) {
+            throw std::runtime_error(format("failed to create ggml context"));
+        }
+
+        ctx_map_tp[d] = ctx;
+        model.ctxs.emplace_back(ctx);
+
+        return ctx;
+    };
+
+    // [first, last) of the n_units units of a split matrix that go to tensor parallel device d
+    auto tp_range = [&model](int d, int64_t n_units) {
+        const int64_t first = d > 0 ? std::llround(model.tp_splits[d - 1]*n_units) : 0;
+        const int64_t last  = std::llround(model.tp_splits[d]*n_units);
+        return std::make_pair(first, last);
+    };
+
     const auto TENSOR_DUPLICATED   = llama_model_loader::TENSOR_DUPLICATED;
     const auto TENSOR_NOT_REQUIRED = llama_model_loader::TENSOR_NOT_REQUIRED;
     const auto TENSOR_SKIP         = llama_model_loader::TENSOR_SKIP;
@@ -5037,10 +5374,45 @@ static bool llm_load_tensors(
 
                         layer.attn_norm = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_NORM, "weight", i), {n_embd});
 
-                        layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
-                        layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
-                        layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
-                        layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
+                        if (!model.tp_bufts.empty() && i >= i_gpu_start) {
+                            // Q, K, V are split by rows and the output by columns in units of whole KV heads (and their
+                            // query heads), gate and up by rows and down by columns in units of the down type block size
+                            const int64_t n_gqa    = n_head/n_head_kv;
+                            const int64_t blck_o   = ggml_blck_size(ml.require_tensor_meta(tn(LLM_TENSOR_ATTN_OUT, "weight", i).c_str())->type);
+                            const int64_t blck_ffn = ggml_blck_size(ml.require_tensor_meta(tn(LLM_TENSOR_FFN_DOWN, "weight", i).c_str())->type);
+                            int64_t unit_kv = 1;
+                            while (n_head_kv % unit_kv != 0 || (unit_kv*n_gqa*n_embd_head_k) % blck_o != 0) {
+                                if (++unit_kv >= n_head_kv) { unit_kv = n_head_kv; break; }
+                            }
+                            const int64_t unit_k = unit_kv*n_embd_head_k;
+                            const int64_t unit_q = unit_k*n_gqa;
+
+                            layer.tp.resize(model.tp_bufts.size());
+                            for (int d = 0; d < (int) model.tp_bufts.size(); ++d) {
+                                auto & tp = layer.tp[d];
+                                ggml_context * ctx = ctx_for_tp(d);
+
+                                auto [a0, a1] = tp_range(d, n_head_kv/unit_kv);
+                                if (a1 > a0) {
+                                    tp.wq = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head}, 1, a0*unit_q, (a1 - a0)*unit_q, d);
+                                    tp.wk = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa},           1, a0*unit_k, (a1 - a0)*unit_k, d);
+                                    tp.wv = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa},           1, a0*unit_k, (a1 - a0)*unit_k, d);
+                                    tp.wo = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd}, 0, a0*unit_q, (a1 - a0)*unit_q, d);
+                                }
+
+                                auto [f0, f1] = tp_range(d, n_ff/blck_ffn);
+                                if (f1 > f0) {
+                                    tp.ffn_gate = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff}, 1, f0*blck_ffn, (f1 - f0)*blck_ffn, d);
+                                    tp.ffn_down = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd}, 0, f0*blck_ffn, (f1 - f0)*blck_ffn, d);
+                                    tp.ffn_up   = ml.create_tensor_slice(ctx, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff}, 1, f0*blck_ffn, (f1 - f0)*blck_ffn, d);
+                                }
+                            }
+                        } else {
+                            layer.wq = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_Q,   "weight", i), {n_embd, n_embd_head_k * n_head});
+                            layer.wk = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_K,   "weight", i), {n_embd, n_embd_k_gqa});
+                            layer.wv = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_V,   "weight", i), {n_embd, n_embd_v_gqa});
+                            layer.wo = create_tensor(ctx_split, tn(LLM_TENSOR_ATTN_OUT, "weight", i), {n_embd_head_k * n_head, n_embd});
+                        }
 
                         // optional bias tensors
                         layer.bq = create_tensor(ctx_layer, tn(LLM_TENSOR_ATTN_Q,   "bias", i), {n_embd},     llama_model_loader::TENSOR_NOT_REQUIRED);
@@ -5053,9 +5425,11 @@ static bool llm_load_tensors(
                         layer.rope_freqs = create_tensor(ctx_layer, tn(LLM_TENSOR_ROPE_FREQS, "weight"), {n_embd/n_head/2}, llama_model_loader::TENSOR_NOT_REQUIRED | (i != 0 ? llama_model_loader::TENSOR_DUPLICATED : 0));
 
                         if (n_expert == 0) {
-                            layer.ffn_gate = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff});
-                            layer.ffn_down = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd});
-                            layer.ffn_up   = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff});
+                            if (layer.tp.empty()) {
+                                layer.ffn_gate = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "weight", i), {n_embd,   n_ff});
+                                layer.ffn_down = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_DOWN, "weight", i), {  n_ff, n_embd});
+                                layer.ffn_up   = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_UP,   "weight", i), {n_embd,   n_ff});
+                            }
 
                             // optional MLP bias
                             layer.ffn_gate_b = create_tensor(ctx_split, tn(LLM_TENSOR_FFN_GATE, "bias", i), {n_ff}, llama_model_loader::TENSOR_NOT_REQUIRED);
@@ -7248,7 +7622,8 @@ static bool llm_load_tensors(
     model.bufs.reserve(n_max_backend_buffer);
 
     for (auto & it : ctx_map) {
-        ggml_backend_buffer_type_t buft = it.first;
+        // weights in huge pages are copied out of the file mapping instead of being used in place
+        ggml_backend_buffer_type_t buft = llama_hugepage_buffer_type(it.first, hugepages);
         ggml_context * ctx              = it.second;
 
         llama_buf_map bufs;
@@ -7329,6 +7704,25 @@ static bool llm_load_tensors(
         ctx_bufs.emplace_back(ctx, bufs);
     }
 
+    // the tensor parallel slices are copied out of the model file, so they are loaded last (before unmapping)
+    for (int d = 0; d < (int) ctx_map_tp.size(); ++d) {
+        if (!ctx_map_tp[d]) {
+            continue;
+        }
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx_map_tp[d], model.tp_bufts[d]);
+        if (buf == nullptr) {
+            throw std::runtime_error("unable to allocate backend buffer");
+        }
+        ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+        model.bufs.push_back(buf);
+
+        llama_buf_map bufs;
+        for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
+            bufs.emplace(idx, buf);
+        }
+        ctx_bufs.emplace_back(ctx_map_tp[d], bufs);
+    }
+
     if (llama_supports_gpu_offload()) {
         const int n_gpu = std::min(n_gpu_layers, int(hparams.n_layer));
 
@@ -7496,7 +7890,7 @@ static int llama_model_load(const std::string & fname, llama_model & model, llam
 
         if (!llm_load_tensors(
             ml, model, params.n_gpu_layers, params.mla, params.split_mode,  params.main_gpu, params.tensor_split,
-            params.use_mlock, params.validate_quants,
+            params.use_mlock, params.validate_quants, params.hugepages_weights,
             params.progress_callback, params.progress_callback_user_data
         )) {
             return -2;
@@ -8090,6 +8484,23 @@ llm_expert_gating_func_type   gating_op,
             gating_op, cb, il, graph);
 }
 
+static struct ggml_tensor * llm_rope_factors(const llama_context & lctx, int il) {
+    const auto & model = lctx.model;
+
+    // choose long/short freq factors based on the context size
+    const auto n_ctx_pre_seq = lctx.cparams.n_ctx / lctx.cparams.n_seq_max;
+
+    if (model.layers[il].rope_freqs != nullptr) {
+        return model.layers[il].rope_freqs;
+    }
+
+    if (n_ctx_pre_seq > model.hparams.n_ctx_orig_yarn) {
+        return model.layers[il].rope_long;
+    }
+
+    return model.layers[il].rope_short;
+}
+
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
        struct llama_context & lctx,
@@ -8128,6 +8539,24 @@ static struct ggml_tensor * llm_build_kqv(
                 0);
     cb(k, "k", il);
 
+    if (lctx.inp_K_delta) {
+        // pending K-shift: rotate the keys of the shifted cells by their position delta, as build_k_shift would, and
+        // write them back before the attention reads them, the shift is then cleared after this graph (llama_decode)
+        struct ggml_tensor * k_rows = ggml_view_3d(ctx, kv.k_l[il], n_embd_head_k, n_head_kv, lctx.inp_K_delta->ne[0],
+                ggml_row_size(kv.k_l[il]->type, n_embd_head_k),
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa),
+                ggml_row_size(kv.k_l[il]->type, n_embd_k_gqa)*lctx.K_delta_first);
+        struct ggml_tensor * k_shifted = k_rows;
+        if (k_shifted->type != GGML_TYPE_F32) {
+            k_shifted = ggml_cast(ctx, k_shifted, GGML_TYPE_F32);
+        }
+        k_shifted = ggml_rope_ext(ctx, k_shifted, lctx.inp_K_delta, llm_rope_factors(lctx, il),
+                hparams.n_rot, hparams.rope_type, cparams.n_ctx_orig_yarn, cparams.rope_freq_base, cparams.rope_freq_scale,
+                cparams.yarn_ext_factor, cparams.yarn_attn_factor, cparams.yarn_beta_fast, cparams.yarn_beta_slow);
+        cb(k_shifted, "k_shifted", il);
+        ggml_build_forward_expand(graph, ggml_cpy(ctx, k_shifted, k_rows));
+    }
+
 #ifdef GGML_USE_VULKAN
     constexpr bool use_f32_precision = true;
 #else
@@ -8367,6 +8796,10 @@ struct llm_build_context {
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= kv_self.size)
     const int32_t n_outputs;
     const int32_t n_outputs_enc;
+    const int32_t n_output_vocab; // number of tokens to compute logits for (0 = all of the vocabulary)
+    const bool    use_output_head;
+    const bool    lazy_k_shift;    // apply the pending K-shift in attention
+    const bool    worst_case;
     const int32_t kv_head;  // index of where we store new KV data in the cache
     const int32_t n_ctx_orig;
 
@@ -8387,6 +8820,11 @@ struct llm_build_context {
 
     struct ggml_context * ctx0 = nullptr;
 
+    // RoPE tables shared by the RoPE ops of the graph, see build_rope
+    using rope_cache_key = std::tuple<const ggml_tensor *, const ggml_tensor *, int, int, int, float, float, float, float, float, float>;
+    const bool use_rope_cache;
+    std::map<rope_cache_key, ggml_tensor *> rope_caches;
+
     // TODO: consider making the entire interface noexcept
     llm_build_context(
         llama_context  & lctx,
@@ -8424,6 +8862,10 @@ struct llm_build_context {
         n_kv             (worst_case ? kv_self.size : kv_self.n),
         n_outputs        (worst_case ? n_tokens : lctx.n_outputs),
         n_outputs_enc    (worst_case ? n_tokens : lctx.embd_enc.size() / hparams.n_embd),
+        n_output_vocab   (worst_case ? 0 : lctx.output_vocab.size()),
+        use_output_head  (!worst_case && lctx.out_head.enabled() && lctx.n_outputs > 0 && lctx.n_outputs <= LLAMA_OUTPUT_HEAD_MAX_OUTPUTS),
+        lazy_k_shift     (llama_kv_cache_lazy_shift(lctx) && (worst_case || lctx.kv_self.has_shift)),
+        worst_case       (worst_case),
         kv_head          (worst_case ? (kv_self.recurrent ? 0 : kv_self.size - n_tokens) : kv_self.head),
         n_ctx_orig       (cparams.n_ctx_orig_yarn),
         flash_attn       (cparams.flash_attn),
@@ -8436,7 +8878,8 @@ struct llm_build_context {
         pooling_type     (cparams.pooling_type),
         rope_type        (hparams.rope_type),
         cb               (cb),
-        buf_compute_meta (lctx.buf_compute_meta) {
+        buf_compute_meta (lctx.buf_compute_meta),
+        use_rope_cache   (lctx.backends.size() == 1 && lctx.backends[0] == lctx.backend_cpu) {
             // all initializations should be done in init()
         }
 
@@ -8464,6 +8907,33 @@ struct llm_build_context {
         lctx.inp_pos_bucket    = nullptr;
         lctx.inp_embd_enc      = nullptr;
         lctx.inp_KQ_mask_cross = nullptr;
+        lctx.inp_out_vocab     = nullptr;
+        lctx.inp_cvec_ids      = nullptr;
+        lctx.inp_cvec_out_ids  = nullptr;
+        lctx.out_head_inp      = nullptr;
+        lctx.out_head_ids      = nullptr;
+        lctx.inp_K_delta       = nullptr;
+
+        if (lazy_k_shift) {
+            // only the cells from the first to the last shifted one are rotated, all of them in the worst case
+            uint32_t first = 0;
+            uint32_t last  = n_kv;
+            if (!worst_case) {
+                std::swap(first, last);
+                for (uint32_t i = 0; i < (uint32_t) n_kv; ++i) {
+                    if (kv_self.cells[i].delta != 0 && !kv_self.cells[i].is_empty()) {
+                        first = std::min(first, i);
+                        last  = i + 1;
+                    }
+                }
+            }
+            if (first < last) {
+                lctx.K_delta_first = first;
+                lctx.inp_K_delta   = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, last - first);
+                cb(lctx.inp_K_delta, "K_delta", -1);
+                ggml_set_input(lctx.inp_K_delta);
+            }
+        }
     }
 
     void free() {
@@ -8471,6 +8941,7 @@ struct llm_build_context {
             ggml_free(ctx0);
             ctx0 = nullptr;
         }
+        rope_caches.clear();
     }
 
     struct ggml_cgraph * build_k_shift() {
@@ -8635,18 +9106,39 @@ struct llm_build_context {
     }
 
     struct ggml_tensor * build_rope_factors(int il) {
-        // choose long/short freq factors based on the context size
-        const auto n_ctx_pre_seq = cparams.n_ctx / cparams.n_seq_max;
-
-        if (model.layers[il].rope_freqs != nullptr) {
-            return model.layers[il].rope_freqs;
+        return llm_rope_factors(lctx, il);
+    }
+
+    // same as ggml_rope_ext, but the cos/sin table is computed once per graph for each set of positions and RoPE
+    // parameters and shared by Q and K of all layers (only on the CPU backend, where the table would otherwise be
+    // recomputed for every position by every RoPE op)
+    struct ggml_tensor * build_rope(
+            struct ggml_tensor * cur,
+            struct ggml_tensor * pos,
+            struct ggml_tensor * factors,
+            int   n_dims,
+            int   mode,
+            int   n_ctx_orig,
+            float freq_base,
+            float freq_scale,
+            float ext_factor,
+            float attn_factor,
+            float beta_fast,
+            float beta_slow) {
+        if (!use_rope_cache || (mode != LLAMA_ROPE_TYPE_NORM && mode != LLAMA_ROPE_TYPE_NEOX) ||
+            (cur->type != GGML_TYPE_F32 && cur->type != GGML_TYPE_F16)) {
+            return ggml_rope_ext(ctx0, cur, pos, factors, n_dims, mode, n_ctx_orig, freq_base, freq_scale,
+                    ext_factor, attn_factor, beta_fast, beta_slow);
         }
-
-        if (n_ctx_pre_seq > hparams.n_ctx_orig_yarn) {
-            return model.layers[il].rope_long;
+        const rope_cache_key key{pos, factors, n_dims, mode, n_ctx_orig, freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow};
+        auto it = rope_caches.find(key);
+        if (it == rope_caches.end()) {
+            struct ggml_tensor * cache = ggml_rope_cache(ctx0, pos, factors, n_dims, mode, n_ctx_orig, freq_base, freq_scale,
+                    ext_factor, attn_factor, beta_fast, beta_slow);
+            cb(cache, "rope_cache", -1);
+            it = rope_caches.emplace(key, cache).first;
         }
-
-        return model.layers[il].rope_short;
+        return ggml_rope_fast(ctx0, cur, it->second);
     }
 
     struct ggml_tensor * build_inp_out_ids() {
@@ -8656,6 +9148,101 @@ struct llm_build_context {
         return lctx.inp_out_ids;
     }
 
+    // adds the control/steering vector column of each token's sequence to the layer output cur, which is either
+    // [n_embd, n_tokens] or, in the last layer, [n_embd, n_outputs]
+    struct ggml_tensor * build_cvec(struct ggml_tensor * cur, int il) {
+        struct ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
+        if (layer_dir == nullptr) {
+            return cur;
+        }
+        struct ggml_tensor *& ids = cur->ne[1] == n_tokens ? lctx.inp_cvec_ids : lctx.inp_cvec_out_ids;
+        if (ids == nullptr) {
+            GGML_ASSERT(cur->ne[1] == n_tokens || cur->ne[1] == n_outputs);
+            ids = ggml_new_tensor_2d(ctx0, GGML_TYPE_I32, cur->ne[1], 1);
+            cb(ids, cur->ne[1] == n_tokens ? "inp_cvec_ids" : "inp_cvec_out_ids", -1);
+            ggml_set_input(ids);
+        }
+        return ggml_add_id(ctx0, cur, layer_dir, ids);
+    }
+
+    // lm_head
+    // If logits are only needed for a subset of the vocabulary (llama_set_output_vocab), we gather
+    // the corresponding rows of the output matrix and multiply with just these.
+    // With the two-stage output head, the logits are approximated with the low-rank factors of the output
+    // matrix, and only the logits of the top candidates are computed exactly.
+    // The output bias (if any) is added here, gathered like the output matrix when using a subset.
+    // raw_logits is false when the caller transforms the logits further (e.g. softcap or logit scale). The two-stage
+    // head is not used then, because its candidate selection and exact fallback work on the untransformed logits.
+    struct ggml_tensor * build_output(struct ggml_tensor * cur, bool raw_logits = true) {
+        bool use_subset = n_output_vocab > 0;
+        bool use_head   = use_output_head && raw_logits && n_output_vocab == 0 && model.output_b == nullptr;
+        for (auto & it : lctx.lora_adapters) {
+            if (it.first->get_weight(model.output)) {
+                use_subset = use_head = false;
+                break;
+            }
+        }
+        if (use_head) {
+            return build_output_head(cur);
+        }
+        if (!use_subset) {
+            cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+            if (model.output_b) {
+                cb(cur, "result_output_no_bias", -1);
+                cur = ggml_add(ctx0, cur, model.output_b);
+            }
+            return cur;
+        }
+        lctx.inp_out_vocab = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_output_vocab);
+        cb(lctx.inp_out_vocab, "inp_out_vocab", -1);
+        ggml_set_input(lctx.inp_out_vocab);
+
+        struct ggml_tensor * output = ggml_get_rows(ctx0, model.output, lctx.inp_out_vocab);
+        cb(output, "output_subset", -1);
+
+        cur = ggml_mul_mat(ctx0, output, cur);
+        if (model.output_b) {
+            cb(cur, "result_output_no_bias", -1);
+            struct ggml_tensor * output_b = ggml_get_rows(ctx0,
+                    ggml_reshape_2d(ctx0, model.output_b, 1, model.output_b->ne[0]), lctx.inp_out_vocab);
+            cb(output_b, "output_b_subset", -1);
+            cur = ggml_add(ctx0, cur, ggml_reshape_1d(ctx0, output_b, n_output_vocab));
+        }
+        return cur;
+    }
+
+    struct ggml_tensor * build_output_head(struct ggml_tensor * cur) {
+        auto & head = lctx.out_head;
+        const int64_t n_top = head.n_top;
+
+        if (!ggml_is_contiguous(cur)) {
+            cur = ggml_cont(ctx0, cur);
+        }
+        // kept for the exact fallback in llama_decode_internal
+        lctx.out_head_inp = cur;
+        ggml_set_output(cur);
+        head.fallback.assign(n_outputs, 0);
+
+        struct ggml_tensor * approx = ggml_mul_mat(ctx0, head.U, ggml_mul_mat(ctx0, head.V, cur));
+        cb(approx, "output_approx", -1);
+
+        // the content of the placeholder is not used, it only provides the shape of the candidate ids
+        struct ggml_tensor * ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_top*n_outputs);
+        ggml_set_input(ids);
+        ids = ggml_map_custom2(ctx0, ids, approx, llama_output_head_select, GGML_N_TASKS_MAX, &head);
+        cb(ids, "output_top", -1);
+        // kept for llama_get_logits_candidates_ith
+        lctx.out_head_ids = ids;
+        ggml_set_output(ids);
+
+        struct ggml_tensor * rows = ggml_get_rows(ctx0, model.output, ids);
+        rows = ggml_reshape_3d(ctx0, rows, n_embd, n_top, n_outputs);
+        struct ggml_tensor * exact = ggml_mul_mat(ctx0, rows, ggml_reshape_3d(ctx0, cur, n_embd, 1, n_outputs));
+        cb(exact, "output_exact", -1);
+
+        return ggml_map_custom3(ctx0, approx, ids, exact, llama_output_head_merge, GGML_N_TASKS_MAX, &head);
+    }
+
     struct ggml_tensor * build_inp_KQ_mask(bool causal = true) {
         lctx.inp_KQ_mask = causal
             ? ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv,     GGML_PAD(n_tokens, GGML_KQ_MASK_PAD))
@@ -8804,6 +9391,122 @@ struct llm_build_context {
         return lctx.inp_KQ_mask_cross;
     }
 
+    //
+    // tensor parallelism (row split without a split buffer type, see llm_load_tensors)
+    //
+    // The attention and FFN matrices of a layer are sliced over the devices. Each device computes its part of Q, K, V
+    // and of the FFN, and its part of the attention output projection from the heads it owns. Q, K, V are gathered and
+    // the partial sums of the output projections are reduced on the backend of the layer, which also runs the attention
+    // itself and holds the KV cache. The parts of the other devices are added to the graph first, so that they are
+    // computed while the layer backend computes its own part.
+    //
+
+    void tp_pin_to_layer(ggml_tensor * cur, int il) {
+        for (auto * backend : lctx.backends) {
+            if (ggml_backend_supports_buft(backend, model.buft_layer[il].buft)) {
+                ggml_backend_sched_set_tensor_backend(lctx.sched, cur, backend);
+                break;
+            }
+        }
+    }
+
+    std::vector<int> tp_devices(int il) const {
+        std::vector<int> order;
+        int d_layer = -1;
+        for (int d = 0; d < (int) model.tp_bufts.size(); ++d) {
+            if (model.tp_bufts[d] == model.buft_layer[il].buft) {
+                d_layer = d;
+            } else {
+                order.push_back(d);
+            }
+        }
+        if (d_layer >= 0) {
+            order.push_back(d_layer);
+        }
+        return order;
+    }
+
+    ggml_tensor * tp_concat(const std::vector<ggml_tensor *> & parts, int il) {
+        ggml_tensor * result = nullptr;
+        for (auto * part : parts) {
+            if (!part) continue;
+            if (result) {
+                result = ggml_concat(ctx0, result, part, 0);
+                tp_pin_to_layer(result, il);
+            } else {
+                result = part;
+            }
+        }
+        return result;
+    }
+
+    ggml_tensor * tp_sum(const std::vector<ggml_tensor *> & parts, int il) {
+        ggml_tensor * result = nullptr;
+        for (auto * part : parts) {
+            if (!part) continue;
+            if (result) {
+                result = ggml_add(ctx0, result, part);
+                tp_pin_to_layer(result, il);
+            } else {
+                result = part;
+            }
+        }
+        return result;
+    }
+
+    void build_qkv_tp(ggml_cgraph * gf, ggml_tensor * cur, int il, ggml_tensor *& Qcur, ggml_tensor *& Kcur, ggml_tensor *& Vcur) {
+        const auto & tp = model.layers[il].tp;
+        std::vector<ggml_tensor *> q(tp.size(), nullptr), k(tp.size(), nullptr), v(tp.size(), nullptr);
+        for (int d : tp_devices(il)) {
+            if (!tp[d].wq) continue;
+            q[d] = ggml_mul_mat(ctx0, tp[d].wq, cur);
+            k[d] = ggml_mul_mat(ctx0, tp[d].wk, cur);
+            v[d] = ggml_mul_mat(ctx0, tp[d].wv, cur);
+            ggml_build_forward_expand(gf, q[d]);
+            ggml_build_forward_expand(gf, k[d]);
+            ggml_build_forward_expand(gf, v[d]);
+        }
+        Qcur = tp_concat(q, il);
+        Kcur = tp_concat(k, il);
+        Vcur = tp_concat(v, il);
+    }
+
+    ggml_tensor * build_wo_tp(ggml_cgraph * gf, ggml_tensor * cur, int il) {
+        const auto & tp = model.layers[il].tp;
+        std::vector<ggml_tensor *> parts(tp.size(), nullptr);
+        std::vector<int64_t> offsets(tp.size(), 0);
+        for (int d = 1; d < (int) tp.size(); ++d) {
+            offsets[d] = offsets[d - 1] + (tp[d - 1].wo ? tp[d - 1].wo->ne[0] : 0);
+        }
+        for (int d : tp_devices(il)) {
+            if (!tp[d].wo) continue;
+            // only the heads of the device are copied to it
+            ggml_tensor * heads = ggml_cont(ctx0, ggml_view_2d(ctx0, cur, tp[d].wo->ne[0], cur->ne[1], cur->nb[1], offsets[d]*ggml_element_size(cur)));
+            tp_pin_to_layer(heads, il);
+            parts[d] = ggml_mul_mat(ctx0, tp[d].wo, heads);
+            ggml_build_forward_expand(gf, parts[d]);
+        }
+        cur = tp_sum(parts, il);
+        cb(cur, "kqv_wo", il);
+        return cur;
+    }
+
+    ggml_tensor * build_ffn_tp(ggml_cgraph * gf, ggml_tensor * cur, int il) {
+        const auto & tp = model.layers[il].tp;
+        std::vector<ggml_tensor *> parts(tp.size(), nullptr);
+        for (int d : tp_devices(il)) {
+            if (!tp[d].ffn_down) continue;
+            parts[d] = llm_build_ffn(ctx0, lctx, cur,
+                    tp[d].ffn_up,   NULL, NULL,
+                    tp[d].ffn_gate, NULL, NULL,
+                    tp[d].ffn_down, NULL, NULL,
+                    NULL,
+                    LLM_FFN_SILU, LLM_FFN_PAR, cb, il);
+            ggml_build_forward_expand(gf, parts[d]);
+        }
+        return tp_sum(parts, il);
+    }
+
     struct ggml_cgraph * build_llama() {
         struct ggml_cgraph * gf = ggml_new_graph_custom(ctx0, llama_model_max_nodes(model), false);
 
@@ -8856,7 +9559,15 @@ struct llm_build_context {
                 struct ggml_tensor * rope_factors = build_rope_factors(il);
 
                 // compute Q and K and RoPE them
-                struct ggml_tensor * Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
+                struct ggml_tensor * Qcur, * Kcur, * Vcur;
+                if (!model.layers[il].tp.empty()) {
+                    build_qkv_tp(gf, cur, il, Qcur, Kcur, Vcur);
+                } else {
+                    Qcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wq, cur);
+                    Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
+                    Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
+                }
+
                 if (hparams.f_attention_scale != 0) {
                     // Why is hparams.f_attention_scale not simply absorbed into model.layers[il].wq ?
                     Qcur = ggml_scale(ctx0, Qcur, hparams.f_attention_scale);
@@ -8867,14 +9578,12 @@ struct llm_build_context {
                     cb(Qcur, "Qcur", il);
                 }
 
-                struct ggml_tensor * Kcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wk, cur);
                 cb(Kcur, "Kcur", il);
                 if (model.layers[il].bk) {
                     Kcur = ggml_add(ctx0, Kcur, model.layers[il].bk);
                     cb(Kcur, "Kcur", il);
                 }
 
-                struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
                 if (model.layers[il].bv) {
                     Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
@@ -8882,11 +9591,11 @@ struct llm_build_context {
                 }
 
                 if (use_rope) {
-                    Qcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                    Qcur = build_rope(ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
 
-                    Kcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                    Kcur = build_rope(ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow);
                 } else if (inp_attn_scale) {
@@ -8909,6 +9618,9 @@ struct llm_build_context {
                         model.layers[il].wo, model.layers[il].bo,
                         Kcur, Vcur, Qcur, this_KQ_mask, n_tokens, kv_head, n_kv, kq_scale, cb, il, nullptr,
                         this_KQ_mask == KQ_mask_swa ? hparams.n_swa : 0);
+                if (!model.layers[il].tp.empty()) {
+                    cur = build_wo_tp(gf, cur, il);
+                }
             }
 
             if (il == n_layer - 1) {
@@ -8936,12 +9648,16 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(cur, "ffn_norm", il);
 
-                cur = llm_build_ffn(ctx0, lctx, cur,
-                        model.layers[il].ffn_up,   model.layers[il].ffn_up_b,   NULL,
-                        model.layers[il].ffn_gate, model.layers[il].ffn_gate_b, NULL,
-                        model.layers[il].ffn_down, model.layers[il].ffn_down_b, NULL,
-                        NULL,
-                        LLM_FFN_SILU, LLM_FFN_PAR, cb, il);
+                if (!model.layers[il].tp.empty()) {
+                    cur = build_ffn_tp(gf, cur, il);
+                } else {
+                    cur = llm_build_ffn(ctx0, lctx, cur,
+                            model.layers[il].ffn_up,   model.layers[il].ffn_up_b,   NULL,
+                            model.layers[il].ffn_gate, model.layers[il].ffn_gate_b, NULL,
+                            model.layers[il].ffn_down, model.layers[il].ffn_down_b, NULL,
+                            NULL,
+                            LLM_FFN_SILU, LLM_FFN_PAR, cb, il);
+                }
                 cb(cur, "ffn_out", il);
             } else if (model.arch == LLM_ARCH_LLAMA4) {
                 // llama4 MoE
@@ -9004,7 +9720,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9019,7 +9735,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, hparams.f_logit_scale == 0.0f);
 
         // For Granite architecture
         if (hparams.f_logit_scale) {
@@ -9102,15 +9818,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -9168,7 +9884,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9183,7 +9899,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, hparams.f_logit_scale == 0.0f);
 
         if (hparams.f_logit_scale) {
             cur = ggml_scale(ctx0, cur, 1.0f / hparams.f_logit_scale);
@@ -9235,13 +9951,13 @@ struct llm_build_context {
 
                 switch (model.type) {
                     case MODEL_7B:
-                        Qcur = ggml_rope_ext(
-                            ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                        Qcur = build_rope(
+                            ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow
                         );
-                        Kcur = ggml_rope_ext(
-                            ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                        Kcur = build_rope(
+                            ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                             n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                             ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -9288,7 +10004,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9303,7 +10019,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9348,15 +10064,15 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -9393,7 +10109,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9406,7 +10122,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9470,14 +10186,14 @@ struct llm_build_context {
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
                 // using mode = 2 for neox mode
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
@@ -9510,7 +10226,7 @@ struct llm_build_context {
 
             cur = ggml_add(ctx0, cur, ffn_inp);
             cur = ggml_add(ctx0, cur, inpL);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9526,7 +10242,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9592,15 +10308,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -9664,7 +10380,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9679,7 +10395,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, false);
 
         // Grok
         // multiply logits by output_multiplier_scale of 0.5773502691896257
@@ -9744,15 +10460,15 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -9797,7 +10513,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9812,7 +10528,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
 
@@ -9904,7 +10620,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -9917,7 +10633,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -9996,7 +10712,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10011,7 +10727,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10100,15 +10816,15 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -10293,7 +11009,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10306,7 +11022,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10431,7 +11147,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10446,7 +11162,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10528,15 +11244,15 @@ struct llm_build_context {
                 }
 
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -10580,7 +11296,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10596,7 +11312,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10649,14 +11365,14 @@ struct llm_build_context {
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
                 // using mode = 2 for neox mode
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
@@ -10693,7 +11409,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10708,7 +11424,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10761,15 +11477,15 @@ struct llm_build_context {
                 Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -10805,7 +11521,7 @@ struct llm_build_context {
             cb(cur, "ffn_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10820,7 +11536,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -10876,15 +11592,15 @@ struct llm_build_context {
                 Vcur = ggml_add(ctx0, Vcur, model.layers[il].bv);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -10953,7 +11669,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -10968,7 +11684,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11019,8 +11735,8 @@ struct llm_build_context {
                 Qcur = llm_build_norm(ctx0, Qcur, hparams, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Qcur, "Qcur_normed", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11030,8 +11746,8 @@ struct llm_build_context {
                 Kcur = llm_build_norm(ctx0, Kcur, hparams, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Kcur, "Kcur_normed", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11067,7 +11783,7 @@ struct llm_build_context {
             cb(cur, "ffn_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11082,7 +11798,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11137,8 +11853,8 @@ struct llm_build_context {
                 Qcur = llm_build_norm(ctx0, Qcur, hparams, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Qcur, "Qcur_normed", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11148,8 +11864,8 @@ struct llm_build_context {
                 Kcur = llm_build_norm(ctx0, Kcur, hparams, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Kcur, "Kcur_normed", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11192,7 +11908,7 @@ struct llm_build_context {
             cb(cur, "ffn_moe_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11207,7 +11923,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11271,8 +11987,8 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Qcur = build_rope(
+                    Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
@@ -11282,8 +11998,8 @@ struct llm_build_context {
                 Qcur = ggml_scale(ctx0, Qcur, 1.0f/sqrtf(float(n_embd_head)));
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
+                Kcur = build_rope(
+                    Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
@@ -11314,7 +12030,7 @@ struct llm_build_context {
 
             cur = ggml_add(ctx0, cur, ffn_output);
             cur = ggml_add(ctx0, cur, inpL);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11327,10 +12043,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
-        cb(cur, "result_output_no_bias", -1);
-
-        cur = ggml_add(ctx0, cur, model.output_b);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
         ggml_build_forward_expand(gf, cur);
         return gf;
@@ -11392,8 +12105,8 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, rope_factors, n_rot, rope_type, n_ctx_orig,
+                Qcur = build_rope(
+                    Qcur, inp_pos, rope_factors, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
@@ -11401,8 +12114,8 @@ struct llm_build_context {
                 Qcur = ggml_scale(ctx0, Qcur, 1.0f / sqrtf(float(n_embd_head)));
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, rope_factors, n_rot, rope_type, n_ctx_orig,
+                Kcur = build_rope(
+                    Kcur, inp_pos, rope_factors, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
@@ -11441,7 +12154,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, residual, cur);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11454,7 +12167,7 @@ struct llm_build_context {
             LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11503,14 +12216,14 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Qcur, n_rot, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                        ggml_reshape_3d(ctx0, Qcur, n_rot, n_head,    n_tokens), inp_pos, nullptr,
                         n_embd_head, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_rot, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                        ggml_reshape_3d(ctx0, Kcur, n_rot, n_head_kv, n_tokens), inp_pos, nullptr,
                         n_embd_head, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
@@ -11544,7 +12257,7 @@ struct llm_build_context {
 
             cur = ggml_add(ctx0, cur, sa_out);
             cur = ggml_add(ctx0, cur, inpL);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11559,7 +12272,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11651,7 +12364,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11664,7 +12377,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11714,15 +12427,15 @@ struct llm_build_context {
                 cb(tmpk, "tmpk", il);
                 cb(Vcur, "Vcur", il);
 
-                struct ggml_tensor * Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                struct ggml_tensor * Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                struct ggml_tensor * Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                struct ggml_tensor * Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11762,7 +12475,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11775,7 +12488,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11834,15 +12547,15 @@ struct llm_build_context {
                 //     cb(Vcur, "Vcur", il);
                 // }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11878,7 +12591,7 @@ struct llm_build_context {
             cb(cur, "ffn_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -11893,7 +12606,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -11952,15 +12665,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -11996,7 +12709,7 @@ struct llm_build_context {
             cb(cur, "ffn_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12011,7 +12724,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -12083,15 +12796,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -12138,7 +12851,7 @@ struct llm_build_context {
             cb(cur, "hidden_scaled_ffn", -1);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12158,7 +12871,7 @@ struct llm_build_context {
         cb(cur, "lmhead_scaling", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -12204,8 +12917,8 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                        ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -12213,8 +12926,8 @@ struct llm_build_context {
                 Qcur = ggml_scale(ctx0, Qcur, 1.0f / sqrtf(float(n_embd_head_k)));
                 cb(Qcur, "Qcur_scaled", il);
 
-                Kcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                        ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
@@ -12251,7 +12964,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, sa_out);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12266,7 +12979,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -12317,8 +13030,8 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                        ggml_reshape_3d(ctx0, Qcur, n_embd_head_k, n_head,    n_tokens), inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -12332,8 +13045,8 @@ struct llm_build_context {
                 };
                 cb(Qcur, "Qcur_scaled", il);
 
-                Kcur = ggml_rope_ext(
-                        ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                        ggml_reshape_3d(ctx0, Kcur, n_embd_head_k, n_head_kv, n_tokens), inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
@@ -12381,7 +13094,7 @@ struct llm_build_context {
             cb(cur, "ffn_post_norm", -1);
 
             cur = ggml_add(ctx0, cur, sa_out);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12396,7 +13109,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, false);
 
         // final logit soft-capping
         cur = ggml_softcap(ctx0, cur, 1.0f / hparams.f_final_logit_softcapping, hparams.f_final_logit_softcapping);
@@ -12465,7 +13178,7 @@ struct llm_build_context {
                 Qcur = llm_build_norm(ctx0, Qcur, hparams, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Qcur, "Qcur_normed", il);
 
-                Qcur = ggml_rope_ext(ctx0, Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
+                Qcur = build_rope(Qcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
 
@@ -12473,7 +13186,7 @@ struct llm_build_context {
                 Kcur = llm_build_norm(ctx0, Kcur, hparams, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Kcur, "Kcur_normed", il);
 
-                Kcur = ggml_rope_ext(ctx0, Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
+                Kcur = build_rope(Kcur, inp_pos, nullptr, n_rot, rope_type, n_ctx_orig, freq_base_l, freq_scale_l,
                         ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
 
@@ -12511,7 +13224,7 @@ struct llm_build_context {
             cb(cur, "ffn_post_norm", -1);
 
             cur = ggml_add(ctx0, cur, sa_out);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12524,7 +13237,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
 
@@ -12584,15 +13297,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -12629,7 +13342,7 @@ struct llm_build_context {
             cb(cur, "ffn_out", il);
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12644,7 +13357,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -12778,7 +13491,7 @@ struct llm_build_context {
 
             // residual
             cur = ggml_add(ctx0, cur, inpL);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12792,7 +13505,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -12877,15 +13590,15 @@ struct llm_build_context {
                     cb(Kcur, "Kcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -12920,7 +13633,7 @@ struct llm_build_context {
             // add together residual + FFN + self-attention
             cur = ggml_add(ctx0, cur, inpL);
             cur = ggml_add(ctx0, cur, attn_out);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -12935,7 +13648,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, f_logit_scale == 0.0f);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -13009,15 +13722,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -13056,7 +13769,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -13071,7 +13784,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -13135,14 +13848,14 @@ struct llm_build_context {
                         LLM_NORM_RMS, cb, il);
                 cb(Kcur, "Kcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, Qcur, inp_pos, NULL, n_rot, rope_type, n_ctx_orig,
+                Qcur = build_rope(
+                    Qcur, inp_pos, NULL, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, Kcur, inp_pos, NULL, n_rot, rope_type, n_ctx_orig,
+                Kcur = build_rope(
+                    Kcur, inp_pos, NULL, n_rot, rope_type, n_ctx_orig,
                     freq_base, freq_scale, ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Kcur, "Kcur", il);
@@ -13182,7 +13895,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             inpL = cur;
@@ -13196,7 +13909,7 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -13245,15 +13958,15 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -13296,7 +14009,7 @@ struct llm_build_context {
                 cb(cur, "ffn_out", il);
 
                 cur = ggml_add(ctx0, cur, attn_out);
-                cur = lctx.cvec.apply_to(ctx0, cur, il);
+                cur = build_cvec(cur, il);
                 cb(cur, "l_out", il);
 
                 // input for next layer
@@ -13324,7 +14037,7 @@ struct llm_build_context {
                 cb(cur, "ffn_out", il);
 
                 cur = ggml_add(ctx0, cur, ffn_inp);
-                cur = lctx.cvec.apply_to(ctx0, cur, il);
+                cur = build_cvec(cur, il);
                 cb(cur, "l_out", il);
 
                 // input for next layer
@@ -13338,7 +14051,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -13388,15 +14101,15 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = llm_build_lora_mm(lctx, ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -13457,7 +14170,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_out);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -13472,7 +14185,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -13563,8 +14276,8 @@ struct llm_build_context {
                         ggml_row_size(q->type, n_embd_head_qk_nope));
                 cb(q_rope, "q_rope", il);
 
-                q_rope = ggml_rope_ext(
-                        ctx0, q_rope, inp_pos, nullptr,
+                q_rope = build_rope(
+                        q_rope, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor_scaled, beta_fast, beta_slow
                         );
@@ -13582,8 +14295,8 @@ struct llm_build_context {
                 cb(k_rope, "k_rope", il);
 
                 // shared RoPE key
-                k_rope = ggml_rope_ext(
-                        ctx0, k_rope, inp_pos, nullptr,
+                k_rope = build_rope(
+                        k_rope, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor_scaled, beta_fast, beta_slow
                         );
@@ -13959,7 +14672,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -13973,8 +14686,7 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -14059,10 +14771,10 @@ struct llm_build_context {
                 }
 
                 // apply RoPE
-                Qcur = ggml_rope_ext(ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(Qcur, inp_pos, nullptr,
                                      n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                                      ext_factor, attn_factor, beta_fast, beta_slow);
-                Kcur = ggml_rope_ext(ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(Kcur, inp_pos, nullptr,
                                      n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                                      ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -14135,7 +14847,7 @@ struct llm_build_context {
 
             // residual and context vector
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // prepare next layer input
@@ -14151,7 +14863,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -14217,15 +14929,15 @@ struct llm_build_context {
                 }
                 cb(Vcur, "Vcur", il);
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -14306,7 +15018,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -14371,15 +15083,15 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, rope_factors,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -14454,7 +15166,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
 
@@ -14525,12 +15237,12 @@ struct llm_build_context {
                 }
 
                 if (is_sliding) {
-                    Qcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
+                    Qcur = build_rope(ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, rope_factors,
                                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale, ext_factor, attn_factor,
                                         beta_fast, beta_slow);
                     cb(Qcur, "Qcur", il);
 
-                    Kcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos,
+                    Kcur = build_rope(ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos,
                                         rope_factors, n_rot, rope_type, n_ctx_orig, freq_base, freq_scale, ext_factor,
                                         attn_factor, beta_fast, beta_slow);
                     cb(Kcur, "Kcur", il);
@@ -14569,7 +15281,7 @@ struct llm_build_context {
             // add together residual + FFN + self-attention
             cur = ggml_add(ctx0, cur, inpL);
             cur = ggml_add(ctx0, cur, attn_out);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -14582,7 +15294,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur, f_logit_scale == 0.0f);
 
         if (f_logit_scale) {
             cur = ggml_scale(ctx0, cur, f_logit_scale);
@@ -14704,10 +15416,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -14905,10 +15614,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            ggml_tensor * layer_dir = lctx.cvec.tensor_for(il);
-            if (layer_dir != nullptr) {
-                cur = ggml_add(ctx0, cur, layer_dir);
-            }
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -14924,7 +15630,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -15015,7 +15721,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
 
@@ -15071,15 +15777,15 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
                 //printf("freq_base: %f freq_scale: %f ext_factor: %f attn_factor: %f\n", freq_base, freq_scale, ext_factor, attn_factor);
-                Qcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(
+                    ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
                 cb(Qcur, "Qcur_rope", il);
 
-                Kcur = ggml_rope_ext(
-                    ctx0, ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(
+                    ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens), inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow
                 );
@@ -15130,7 +15836,7 @@ struct llm_build_context {
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -15198,14 +15904,14 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(
+                        Qcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
 
-                Kcur = ggml_rope_ext(
-                        ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(
+                        Kcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -15264,7 +15970,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // Output projection
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -15317,8 +16023,8 @@ struct llm_build_context {
                 Qcur = llm_build_norm(ctx0, Qcur, hparams, model.layers[il].attn_q_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Qcur, "Qcur_normed", il);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(
+                        Qcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -15326,8 +16032,8 @@ struct llm_build_context {
                 Kcur = llm_build_norm(ctx0, Kcur, hparams, model.layers[il].attn_k_norm, NULL, LLM_NORM_RMS, cb, il);
                 cb(Kcur, "Kcur_normed", il);
 
-                Kcur = ggml_rope_ext(
-                        ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(
+                        Kcur, inp_pos, nullptr,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -15395,7 +16101,7 @@ struct llm_build_context {
             }
 
             cur = ggml_add(ctx0, cur, ffn_inp);
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -15411,7 +16117,7 @@ struct llm_build_context {
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
         cb(cur, "result_output", -1);
 
         ggml_build_forward_expand(gf, cur);
@@ -15478,10 +16184,10 @@ struct llm_build_context {
                 // Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
 
                 // apply RoPE
-                Qcur = ggml_rope_ext(ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
-                Kcur = ggml_rope_ext(ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -15523,7 +16229,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -15538,7 +16244,7 @@ struct llm_build_context {
 
         cb(cur, "result_norm", -1);
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
         ggml_build_forward_expand(gf, cur);
@@ -15609,10 +16315,10 @@ struct llm_build_context {
                 // Vcur = ggml_reshape_3d(ctx0, Vcur, n_embd_head, n_head_kv, n_tokens);
 
                 // apply RoPE
-                Qcur = ggml_rope_ext(ctx0, Qcur, inp_pos, nullptr,
+                Qcur = build_rope(Qcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
-                Kcur = ggml_rope_ext(ctx0, Kcur, inp_pos, nullptr,
+                Kcur = build_rope(Kcur, inp_pos, nullptr,
                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                     ext_factor, attn_factor, beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
@@ -15694,7 +16400,7 @@ struct llm_build_context {
             cur = ggml_add(ctx0, cur, ffn_inp);
             cb(cur, "ffn_out", il);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -15709,7 +16415,7 @@ struct llm_build_context {
 
         cb(cur, "result_norm", -1);
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
         ggml_build_forward_expand(gf, cur);
@@ -15775,8 +16481,8 @@ struct llm_build_context {
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
 
-                Qcur = ggml_rope_ext(
-                        ctx0, Qcur, inp_pos, rope_factors,
+                Qcur = build_rope(
+                        Qcur, inp_pos, rope_factors,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -15785,8 +16491,8 @@ struct llm_build_context {
                 cb(Kcur, "Kcur", il);
                 cb(Vcur, "Vcur", il);
 
-                Kcur = ggml_rope_ext(
-                        ctx0, Kcur, inp_pos, rope_factors,
+                Kcur = build_rope(
+                        Kcur, inp_pos, rope_factors,
                         n_rot, rope_type, n_ctx_orig, freq_base, freq_scale,
                         ext_factor, attn_factor, beta_fast, beta_slow
                         );
@@ -15843,7 +16549,7 @@ struct llm_build_context {
 
             cur = ggml_add(ctx0, ffn_out, ffn_inp);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -15858,7 +16564,7 @@ struct llm_build_context {
         //res->t_embd = cur;
 
         // lm_head
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
         //res->t_logits = cur;
@@ -15921,12 +16627,12 @@ struct llm_build_context {
                     cb(Vcur, "Vcur", il);
                 }
 
-                Qcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Qcur, n_rot, n_head, n_tokens), inp_pos, nullptr,
+                Qcur = build_rope(ggml_reshape_3d(ctx0, Qcur, n_rot, n_head, n_tokens), inp_pos, nullptr,
                                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale, ext_factor, attn_factor,
                                     beta_fast, beta_slow);
                 cb(Qcur, "Qcur", il);
 
-                Kcur = ggml_rope_ext(ctx0, ggml_reshape_3d(ctx0, Kcur, n_rot, n_head_kv, n_tokens), inp_pos, nullptr,
+                Kcur = build_rope(ggml_reshape_3d(ctx0, Kcur, n_rot, n_head_kv, n_tokens), inp_pos, nullptr,
                                     n_rot, rope_type, n_ctx_orig, freq_base, freq_scale, ext_factor,
                                     attn_factor, beta_fast, beta_slow);
                 cb(Kcur, "Kcur", il);
@@ -15968,7 +16674,7 @@ struct llm_build_context {
 
             cur = ggml_add(ctx0, cur, ffn_inp);
 
-            cur = lctx.cvec.apply_to(ctx0, cur, il);
+            cur = build_cvec(cur, il);
             cb(cur, "l_out", il);
 
             // input for next layer
@@ -15980,7 +16686,7 @@ struct llm_build_context {
         cur = llm_build_norm(ctx0, cur, hparams, model.output_norm, nullptr, LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = llm_build_lora_mm(lctx, ctx0, model.output, cur);
+        cur = build_output(cur);
 
         cb(cur, "result_output", -1);
 
@@ -16405,6 +17111,21 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         ggml_backend_tensor_set(lctx.inp_pos, batch.pos, 0, n_tokens*ggml_element_size(lctx.inp_pos));
     }
 
+    if (lctx.inp_out_vocab) {
+        ggml_backend_tensor_set(lctx.inp_out_vocab, lctx.output_vocab.data(), 0, lctx.output_vocab.size()*sizeof(llama_token));
+    }
+
+    if (lctx.inp_K_delta) {
+        const int64_t n = lctx.inp_K_delta->ne[0];
+
+        GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_K_delta->buffer));
+        int32_t * data = (int32_t *) lctx.inp_K_delta->data;
+
+        for (int64_t i = 0; i < n; ++i) {
+            data[i] = lctx.kv_self.cells[lctx.K_delta_first + i].delta;
+        }
+    }
+
     if (lctx.inp_pos && lctx.inp_scale) {
         int n_tokens = batch.n_tokens;
         GGML_ASSERT(ggml_nelements(lctx.inp_scale) >= n_tokens);
@@ -16444,6 +17165,29 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
         }
     }
 
+    if (lctx.inp_cvec_ids || lctx.inp_cvec_out_ids) {
+        const auto & cvec = lctx.cvec;
+        auto column = [&](int i) {
+            return batch.seq_id ? cvec.vector_for_seq(batch.seq_id[i][0]) : cvec.vector_for_seq(batch.all_seq_id);
+        };
+
+        if (lctx.inp_cvec_ids) {
+            GGML_ASSERT(ggml_backend_buffer_is_host(lctx.inp_cvec_ids->buffer));
+            int32_t * data = (int32_t *) lctx.inp_cvec_ids->data;
+            for (int i = 0; i < batch.n_tokens; ++i) {
+                data[i] = column(i);
+            }
+        }
+        if (lctx.inp_cvec_out_ids) {
+            GGML_ASSERT(lctx.inp_out_ids && ggml_backend_buffer_is_host(lctx.inp_cvec_out_ids->buffer));
+            const int32_t * out_ids = (const int32_t *) lctx.inp_out_ids->data;
+            int32_t * data = (int32_t *) lctx.inp_cvec_out_ids->data;
+            for (int i = 0; i < lctx.inp_cvec_out_ids->ne[0]; ++i) {
+                data[i] = column(out_ids[i]);
+            }
+        }
+    }
+
     GGML_ASSERT(
         // (!a || b) is a logical implication (a -> b)
         // !hparams.causal_attn -> !cparams.causal_attn
@@ -16474,40 +17218,61 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
             // For causal attention, use only the previous KV cells
             // of the correct sequence for each token of the batch.
             // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
+            //
+            // Instead of checking the sequence membership of every cell for every token, we process
+            // the tokens one sequence at a time. The positions of the cells that belong to the sequence
+            // are gathered once (cells not in the sequence get a position larger than any token position),
+            // so each mask row becomes a simple position comparison that the compiler can vectorize.
+            auto & cell_pos = lctx.kq_mask_cell_pos;
+            cell_pos.resize(n_kv);
+            std::vector<bool> row_done(n_tokens, false);
             for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const llama_pos    pos    = batch.pos[j];
-                    const llama_seq_id seq_id = batch.seq_id[j][0];
+                for (int j0 = 0; j0 < n_tokens; ++j0) {
+                    if (row_done[j0]) continue;
+                    const llama_seq_id seq_id = batch.seq_id[j0][0];
 
                     for (int i = 0; i < n_kv; ++i) {
-                        float f;
-                        if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                            f = -INFINITY;
-                        } else {
+                        const auto & cell = kv_self.cells[i];
+                        cell_pos[i] = cell.has_seq_id(seq_id) ? cell.pos : std::numeric_limits<llama_pos>::max();
+                    }
+
+                    for (int j = j0; j < n_tokens; ++j) {
+                        if (row_done[j] || batch.seq_id[j][0] != seq_id) continue;
+                        row_done[j] = true;
+
+                        const llama_pos pos = batch.pos[j];
+
+                        if (data) {
+                            float * row = data + h*(n_kv*n_tokens) + j*n_kv;
                             if (hparams.use_alibi) {
-                                f = -std::abs(lctx.kv_self.cells[i].pos - pos);
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = cell_pos[i] <= pos ? -(float)std::abs(cell_pos[i] - pos) : -INFINITY;
+                                }
                             } else {
-                                f = 0.0f;
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = cell_pos[i] <= pos ? 0.0f : -INFINITY;
+                                }
                             }
                         }
 
-                        if (data) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = f;
-                        }
-
                         // may need to cut off old tokens for sliding window
                         if (data_swa) {
+                            llama_pos pos_min;
                             if (hparams.n_attn_chunk) {
-                                llama_pos pos_chunk_start = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
-                                if (lctx.kv_self.cells[i].pos < pos_chunk_start || pos < pos_chunk_start) {
-                                    f = -INFINITY;
+                                pos_min = (pos / hparams.n_attn_chunk) * hparams.n_attn_chunk;
+                            } else {
+                                pos_min = pos - (int32_t)hparams.n_swa + 1;
+                            }
+                            float * row = data_swa + h*(n_kv*n_tokens) + j*n_kv;
+                            if (hparams.use_alibi) {
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = cell_pos[i] >= pos_min && cell_pos[i] <= pos ? -(float)std::abs(cell_pos[i] - pos) : -INFINITY;
                                 }
                             } else {
-                                if (pos - kv_self.cells[i].pos >= (int32_t)hparams.n_swa) {
-                                    f = -INFINITY;
+                                for (int i = 0; i < n_kv; ++i) {
+                                    row[i] = cell_pos[i] >= pos_min && cell_pos[i] <= pos ? 0.0f : -INFINITY;
                                 }
                             }
-                            data_swa[h*(n_kv*n_tokens) + j*n_kv + i] = f;
                         }
                     }
                 }
@@ -16666,7 +17431,7 @@ static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
 
                 // ensure current sequences will be kept
                 if (!has_self_seq && kv_cell.pos >= 0) {
-                    kv_cell.seq_id.insert(seq_id);
+                    kv_cell.add_seq_id(seq_id);
                 }
             }
         }
@@ -16817,6 +17582,7 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 
     lctx.logits = has_logits ? output_base               : nullptr;
     lctx.embd   = has_embd   ? output_base + logits_size : nullptr;
+    lctx.logits_ext = nullptr;
 
     lctx.output_size = n_outputs_max;
     lctx.logits_size = logits_size;
@@ -16833,7 +17599,8 @@ static size_t llama_output_reserve(llama_context & lctx, size_t n_outputs) {
 }
 
 
-static void llama_graph_compute(
+// returns the status of the graph, a failure of an asynchronous backend (e.g. RPC) can be reported by the next graph
+static enum ggml_status llama_graph_compute(
         llama_context & lctx,
           ggml_cgraph * gf,
                   int   n_threads) {
@@ -16843,9 +17610,17 @@ static void llama_graph_compute(
     }
 #endif
 
+    llama_cpu_partition * partition = lctx.backend_cpu ? lctx.cpu_partition : nullptr;
+    if (partition) {
+        n_threads = std::min(n_threads, (int)partition->cores.size());
+    }
+
     if (lctx.backend_cpu != nullptr) {
         ggml_backend_cpu_set_n_threads(lctx.backend_cpu, n_threads);
         ggml_backend_cpu_set_abort_callback(lctx.backend_cpu, lctx.abort_callback, lctx.abort_callback_data);
+        if (partition) {
+            ggml_backend_cpu_set_cpu_cores(lctx.backend_cpu, partition->cores.data(), partition->cores.size());
+        }
     }
 #ifdef GGML_USE_BLAS
     if (lctx.backend_blas != nullptr) {
@@ -16853,9 +17628,78 @@ static void llama_graph_compute(
     }
 #endif
 
-    ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    enum ggml_status status;
+    if (partition) {
+        // take our turn on the partition cores and hold them until the graph is done
+        llama_cpu_partition_lock lock(*partition, lctx.cparams.cpu_priority);
+        status = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+        ggml_backend_sched_synchronize(lctx.sched);
+    } else {
+        status = ggml_backend_sched_graph_compute_async(lctx.sched, gf);
+    }
 
     // fprintf(stderr, "splits: %d\n", ggml_backend_sched_get_n_splits(lctx.sched));
+    return status;
+}
+
+static int32_t llama_kv_cache_update_internal(struct llama_context & lctx, bool apply_shift);
+
+// Order in which the tokens of a batch that needs several ubatches are processed: first the tokens of sequences
+// with a single token in the batch (i.e. sequences that are generating), then the tokens of the remaining
+// sequences grouped by sequence, keeping the order within each sequence. Tokens that belong to several
+// sequences would constrain the order across sequences, so such batches are kept as they are.
+// Returns false if the batch order is kept.
+static bool llama_batch_seq_order(const llama_batch & batch, std::vector<int32_t> & order) {
+    if (!batch.pos || !batch.seq_id || !batch.n_seq_id || !batch.logits) {
+        return false;
+    }
+    std::vector<int32_t> n_seq_tokens(LLAMA_MAX_SEQ, 0);
+    std::vector<int32_t> seq_rank(LLAMA_MAX_SEQ, -1);
+    int32_t n_ranks = 0;
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const llama_seq_id s = batch.seq_id[i][0];
+        if (batch.n_seq_id[i] != 1 || s < 0 || s >= LLAMA_MAX_SEQ) {
+            return false;
+        }
+        if (n_seq_tokens[s]++ == 0) {
+            seq_rank[s] = ++n_ranks;
+        }
+    }
+    if (n_ranks < 2) {
+        return false;
+    }
+    order.resize(batch.n_tokens);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int32_t i, int32_t j) {
+        const llama_seq_id si = batch.seq_id[i][0];
+        const llama_seq_id sj = batch.seq_id[j][0];
+        const int32_t ri = n_seq_tokens[si] == 1 ? 0 : seq_rank[si];
+        const int32_t rj = n_seq_tokens[sj] == 1 ? 0 : seq_rank[sj];
+        return ri < rj;
+    });
+    for (int32_t k = 0; k < batch.n_tokens; ++k) {
+        if (order[k] != k) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// move row r of data to row target[r], where target is a permutation
+template <typename T>
+static void llama_permute_rows(T * data, const std::vector<int32_t> & target, size_t row_size) {
+    std::vector<bool> done(target.size(), false);
+    std::vector<T>    carry(row_size);
+    for (size_t i = 0; i < target.size(); ++i) {
+        if (done[i] || target[i] == (int32_t)i) {
+            continue;
+        }
+        std::copy(data + i*row_size, data + (i + 1)*row_size, carry.begin());
+        for (size_t j = target[i]; !done[j]; j = target[j]) {
+            std::swap_ranges(carry.begin(), carry.end(), data + j*row_size);
+            done[j] = true;
+        }
+    }
 }
 
 // decode a batch of tokens by evaluating the transformer
@@ -16931,6 +17775,11 @@ static int llama_decode_internal(
         return -2;
     };
 
+    if (lctx.out_head.enabled()) {
+        lctx.out_head.candidates.resize(size_t(n_outputs)*lctx.out_head.n_top);
+        lctx.out_head.approx.assign(n_outputs, 0);
+    }
+
     // set output mappings
     if (batch_all.logits) {
         int32_t i_logits = 0;
@@ -16945,6 +17794,49 @@ static int llama_decode_internal(
         }
     }
 
+    // Continuous batching: when several ubatches are needed, the generating sequences go into the first one
+    // instead of waiting behind the prefills of other sequences (see llama_batch_seq_order).
+    // The output rows are put back into batch order at the end, so callers see no difference.
+    std::vector<int32_t>        order;
+    std::vector<int32_t>        out_target; // output row in batch order of each output row in processing order
+    std::vector<llama_token>    order_token;
+    std::vector<float>          order_embd;
+    std::vector<llama_pos>      order_pos;
+    std::vector<int32_t>        order_n_seq_id;
+    std::vector<llama_seq_id *> order_seq_id;
+    std::vector<int8_t>         order_logits;
+    if (!embd_pooled && hparams.causal_attn && !kv_self.recurrent && n_tokens_all > n_ubatch &&
+        llama_batch_seq_order(batch_all, order)) {
+        if (batch_all.token) order_token.resize(n_tokens_all);
+        if (batch_all.embd)  order_embd.resize(n_tokens_all*n_embd);
+        order_pos.resize(n_tokens_all);
+        order_n_seq_id.resize(n_tokens_all);
+        order_seq_id.resize(n_tokens_all);
+        order_logits.resize(n_tokens_all);
+        for (uint32_t k = 0; k < n_tokens_all; ++k) {
+            const int32_t i = order[k];
+            if (batch_all.token) {
+                order_token[k] = batch_all.token[i];
+            }
+            if (batch_all.embd) {
+                std::memcpy(order_embd.data() + k*n_embd, batch_all.embd + i*n_embd, n_embd*sizeof(float));
+            }
+            order_pos[k]      = batch_all.pos[i];
+            order_n_seq_id[k] = batch_all.n_seq_id[i];
+            order_seq_id[k]   = batch_all.seq_id[i];
+            order_logits[k]   = batch_all.logits[i];
+            if (batch_all.logits[i]) {
+                out_target.push_back(lctx.output_ids[i]);
+            }
+        }
+        batch_all.token    = batch_all.token ? order_token.data() : nullptr;
+        batch_all.embd     = batch_all.embd  ? order_embd.data()  : nullptr;
+        batch_all.pos      = order_pos.data();
+        batch_all.n_seq_id = order_n_seq_id.data();
+        batch_all.seq_id   = order_seq_id.data();
+        batch_all.logits   = order_logits.data();
+    }
+
     for (uint32_t cur_token = 0; cur_token < n_tokens_all; cur_token += n_ubatch) {
         const uint32_t n_tokens = std::min(n_ubatch, n_tokens_all - cur_token);
         llama_batch u_batch = {
@@ -17012,7 +17904,7 @@ static int llama_decode_internal(
 
         // non-causal masks do not use the KV cache
         if (hparams.causal_attn) {
-            int32_t ret = llama_kv_cache_update(&lctx);
+            int32_t ret = llama_kv_cache_update_internal(lctx, !llama_kv_cache_lazy_shift(lctx));
             if (ret != 0) {
                 return ret;
             }
@@ -17072,7 +17964,21 @@ static int llama_decode_internal(
 
         llama_set_inputs(lctx, u_batch);
 
-        llama_graph_compute(lctx, gf, n_threads);
+        // an abort through abort_callback is not an error here
+        const enum ggml_status status = llama_graph_compute(lctx, gf, n_threads);
+        if (status != GGML_STATUS_SUCCESS && status != GGML_STATUS_ABORTED) {
+            LLAMA_LOG_ERROR("%s: graph compute failed (status %d)\n", __func__, (int) status);
+            return -3;
+        }
+
+        if (kv_self.has_shift && llama_kv_cache_lazy_shift(lctx)) {
+            // the graph wrote the shifted keys back to the cache
+            kv_self.has_shift = false;
+
+            for (uint32_t i = 0; i < kv_self.size; ++i) {
+                kv_self.cells[i].delta = 0;
+            }
+        }
 
         // update the kv ring buffer
         {
@@ -17101,7 +18007,49 @@ static int llama_decode_internal(
             if (n_outputs_new) {
                 GGML_ASSERT( n_outputs_prev + n_outputs_new <= n_outputs);
                 GGML_ASSERT((n_outputs_prev + n_outputs_new)*n_vocab <= (int64_t) lctx.logits_size);
-                ggml_backend_tensor_get_async(backend_res, res, logits_out, 0, n_outputs_new*n_vocab*sizeof(float));
+                if (lctx.inp_out_vocab) {
+                    // logits were computed only for lctx.output_vocab => scatter them into full rows
+                    const int64_t n_sub = lctx.output_vocab.size();
+                    GGML_ASSERT(res->ne[0] == n_sub);
+                    auto & sub = lctx.output_vocab_logits;
+                    sub.resize(n_outputs_new*n_sub);
+                    ggml_backend_tensor_get(res, sub.data(), 0, n_outputs_new*n_sub*sizeof(float));
+                    for (int32_t i = 0; i < n_outputs_new; ++i) {
+                        float * row = logits_out + i*n_vocab;
+                        std::fill(row, row + n_vocab, -INFINITY);
+                        for (int64_t k = 0; k < n_sub; ++k) {
+                            row[lctx.output_vocab[k]] = sub[i*n_sub + k];
+                        }
+                    }
+                }
+                // The whole batch fits into a single u_batch and the result is in host memory
+                // => no need to copy the logits, just remember where they are.
+                else if (cparams.logits_zero_copy && n_tokens == n_tokens_all && res->buffer &&
+                    ggml_backend_buffer_is_host(res->buffer) && ggml_is_contiguous(res)) {
+                    lctx.logits_ext = (float *)res->data;
+                } else {
+                    ggml_backend_tensor_get_async(backend_res, res, logits_out, 0, n_outputs_new*n_vocab*sizeof(float));
+                }
+                if (lctx.out_head_inp) {
+                    // recompute the outputs whose candidates did not carry enough of the probability mass
+                    auto & head = lctx.out_head;
+                    ggml_backend_sched_synchronize(lctx.sched);
+                    head.n_rows += n_outputs_new;
+                    ggml_backend_tensor_get(lctx.out_head_ids, head.candidates.data() + size_t(n_outputs_prev)*head.n_top,
+                            0, size_t(n_outputs_new)*head.n_top*sizeof(int32_t));
+                    std::vector<float> h;
+                    for (int32_t i = 0; i < n_outputs_new; ++i) {
+                        head.approx[n_outputs_prev + i] = !head.fallback[i];
+                        if (!head.fallback[i]) {
+                            continue;
+                        }
+                        h.resize(n_embd);
+                        ggml_backend_tensor_get(lctx.out_head_inp, h.data(), i*lctx.out_head_inp->nb[1], n_embd*sizeof(float));
+                        float * row = (lctx.logits_ext ? lctx.logits_ext : logits_out) + i*n_vocab;
+                        llama_output_head_exact(model.output, h.data(), row, n_threads);
+                        ++head.n_fallback;
+                    }
+                }
             }
         }
 
@@ -17153,6 +18101,22 @@ static int llama_decode_internal(
     // set to total number of outputs in the batch, for use in llama_get_logits_ith
     lctx.n_outputs = n_outputs;
 
+    if (!out_target.empty()) {
+        ggml_backend_sched_synchronize(lctx.sched);
+        if (lctx.logits && lctx.logits_size >= (size_t) n_outputs*n_vocab) {
+            llama_permute_rows(lctx.logits, out_target, n_vocab);
+        }
+        if (lctx.embd && lctx.embd_size >= (size_t) n_outputs*n_embd) {
+            llama_permute_rows(lctx.embd, out_target, n_embd);
+        }
+        // the candidates of the output head are looked up by output index too
+        auto & head = lctx.out_head;
+        if (head.enabled() && head.approx.size() == (size_t) n_outputs) {
+            llama_permute_rows(head.candidates.data(), out_target, head.n_top);
+            llama_permute_rows(head.approx.data(),     out_target, 1);
+        }
+    }
+
     // wait for the computation to finish (automatically done when obtaining the model output)
     //llama_synchronize(&lctx);
 
@@ -17578,16 +18542,107 @@ static void llama_kv_cache_defrag_internal(struct llama_context & lctx) {
     //LLAMA_LOG_INFO("(tmp log) KV defrag time: %.3f ms\n", (t_end - t_start)/1000.0);
 }
 
-static int32_t llama_kv_cache_update_internal(struct llama_context & lctx) {
+// If the logits of the last decode are still in the compute buffer (zero-copy outputs),
+// copy them to the output buffer before the scheduler is used to compute something else.
+static void llama_output_materialize(llama_context & lctx) {
+    if (lctx.logits_ext) {
+        llama_synchronize(&lctx);
+        std::memcpy(lctx.logits, lctx.logits_ext, size_t(lctx.n_outputs)*lctx.model.hparams.n_vocab*sizeof(float));
+        lctx.logits_ext = nullptr;
+    }
+}
+
+// Apply the K-shift directly to a K cache in host memory: only the shifted cells are rotated by their delta, in place,
+// with the work split over layers and chunks of cells. This is the same computation as the graph built by
+// build_k_shift, but avoids rotating (and for quantized caches converting) every cell of every layer.
+// Returns false if the graph has to be used instead.
+static bool llama_kv_cache_shift_host(llama_context & lctx) {
+    const auto & model   = lctx.model;
+    const auto & hparams = model.hparams;
+    const auto & cparams = lctx.cparams;
+    const auto & kv_self = lctx.kv_self;
+
+    const int     rope_type = hparams.rope_type;
+    const int64_t n_layer   = hparams.n_layer;
+
+    std::vector<const float *> freq_factors(n_layer, nullptr);
+    for (int64_t il = 0; il < n_layer; ++il) {
+        const ggml_tensor * k = kv_self.k_l[il];
+        if (!k->buffer || !ggml_backend_buffer_is_host(k->buffer) || !ggml_rope_rows_supported(k->type, rope_type)) {
+            return false;
+        }
+        // same choice as in build_rope_factors
+        const ggml_tensor * f = model.layers[il].rope_freqs;
+        if (!f) {
+            f = cparams.n_ctx / cparams.n_seq_max > hparams.n_ctx_orig_yarn ? model.layers[il].rope_long : model.layers[il].rope_short;
+        }
+        if (f) {
+            if (!f->buffer || !ggml_backend_buffer_is_host(f->buffer) || f->type != GGML_TYPE_F32) {
+                return false;
+            }
+            freq_factors[il] = (const float *) f->data;
+        }
+    }
+
+    std::vector<int32_t> rows;
+    std::vector<int32_t> pos;
+    for (uint32_t i = 0; i < kv_self.size; ++i) {
+        if (kv_self.cells[i].delta != 0 && !kv_self.cells[i].is_empty()) {
+            rows.push_back(i);
+            pos.push_back(kv_self.cells[i].delta);
+        }
+    }
+
+    const int64_t n_rows   = rows.size();
+    const int64_t chunk    = 64;
+    const int64_t n_chunks = (n_rows + chunk - 1)/chunk;
+    const int64_t n_work   = n_layer*n_chunks;
+
+    std::atomic<int64_t> counter(0);
+    auto compute = [&]() {
+        for (int64_t iw = counter++; iw < n_work; iw = counter++) {
+            const int64_t il = iw / n_chunks;
+            const int64_t i0 = (iw % n_chunks)*chunk;
+            ggml_tensor * k = kv_self.k_l[il];
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            ggml_rope_rows_inplace(k->type, k->data, ggml_row_size(k->type, n_embd_k_gqa), n_embd_k_gqa, hparams.n_embd_head_k,
+                    rows.data() + i0, pos.data() + i0, std::min(chunk, n_rows - i0), freq_factors[il],
+                    hparams.n_rot, rope_type, cparams.n_ctx_orig_yarn, cparams.rope_freq_base, cparams.rope_freq_scale,
+                    cparams.yarn_ext_factor, cparams.yarn_attn_factor, cparams.yarn_beta_fast, cparams.yarn_beta_slow);
+        }
+    };
+
+    const int n_threads = std::max<int64_t>(1, std::min<int64_t>(cparams.n_threads_batch, n_work));
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int ith = 1; ith < n_threads; ++ith) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return true;
+}
+
+// with apply_shift = false a K-shift that needs a graph is left pending, the next decode graph applies it (lazy_k_shift)
+static int32_t llama_kv_cache_update_internal(struct llama_context & lctx, bool apply_shift) {
     bool need_reserve = false;
 
+    if (lctx.kv_self.has_shift || lctx.kv_self.do_copy || lctx.kv_self.do_defrag) {
+        llama_output_materialize(lctx);
+    }
+
     // apply K-shift if needed
     if (lctx.model.hparams.rope_type != LLAMA_ROPE_TYPE_NONE && lctx.kv_self.has_shift) {
         if (lctx.model.arch == LLM_ARCH_DEEPSEEK2) { // not supported due to MLA
             return 1;
         }
 
-        {
+        bool shifted = llama_kv_cache_shift_host(lctx);
+
+        if (!shifted && apply_shift) {
             ggml_backend_sched_reset(lctx.sched);
 
             ggml_cgraph * gf = llama_build_graph_k_shift(lctx);
@@ -17599,9 +18654,10 @@ static int32_t llama_kv_cache_update_internal(struct llama_context & lctx) {
             llama_graph_compute(lctx, gf, lctx.cparams.n_threads);
 
             need_reserve = true;
+            shifted      = true;
         }
 
-        {
+        if (shifted) {
             auto & kv_self = lctx.kv_self;
 
             kv_self.has_shift = false;
@@ -19358,6 +20414,7 @@ struct llama_model_params llama_model_default_params() {
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_buft_overrides       =*/ nullptr,
+        /*.hugepages_weights           =*/ LLAMA_HUGEPAGES_NONE,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
@@ -19409,6 +20466,15 @@ struct llama_context_params llama_context_default_params() {
         /*.min_experts                 =*/ -1,
         /*.thtesh_experts              =*/ 0.0f,
         /*.only_active_experts         =*/ false,
+        /*.logits_zero_copy            =*/ false,
+        /*.output_head_rank            =*/ 0,
+        /*.output_head_top             =*/ 1024,
+        /*.output_head_min_mass        =*/ 0.99f,
+        /*.cpu_partition               =*/ -1,
+        /*.cpu_priority                =*/ 0,
+        /*.hugepages_kv                =*/ LLAMA_HUGEPAGES_NONE,
+        /*.hugepages_compute           =*/ LLAMA_HUGEPAGES_NONE,
+        /*.lazy_k_shift                =*/ false,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.offload_policy              =*/ nullptr,
@@ -19580,6 +20646,20 @@ struct llama_context * llama_new_context_with_model(
         return nullptr;
     }
 
+    if (params.n_seq_max > LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: n_seq_max must be <= %d\n", __func__, LLAMA_MAX_SEQ);
+        return nullptr;
+    }
+
+    llama_cpu_partition * cpu_partition = nullptr;
+    if (params.cpu_partition >= 0) {
+        cpu_partition = llama_cpu_partition_get(params.cpu_partition);
+        if (!cpu_partition) {
+            LLAMA_LOG_ERROR("%s: invalid CPU partition %d\n", __func__, params.cpu_partition);
+            return nullptr;
+        }
+    }
+
     if (params.flash_attn && model->arch == LLM_ARCH_GROK) {
         LLAMA_LOG_WARN("%s: flash_attn is not compatible with Grok - forcing off\n", __func__);
         params.flash_attn = false;
@@ -19617,6 +20697,13 @@ struct llama_context * llama_new_context_with_model(
     cparams.fused_up_gate    = params.fused_up_gate;
     cparams.min_experts      = params.min_experts;
     cparams.thresh_experts   = params.thresh_experts;
+    cparams.logits_zero_copy = params.logits_zero_copy;
+    cparams.output_head_rank     = params.output_head_rank;
+    cparams.output_head_top      = params.output_head_top;
+    cparams.output_head_min_mass = params.output_head_min_mass;
+    cparams.cpu_priority         = params.cpu_priority;
+    cparams.hugepages_kv         = params.hugepages_kv;
+    cparams.lazy_k_shift         = params.lazy_k_shift;
 
     cparams.pooling_type     = params.pooling_type;
 
@@ -19701,6 +20788,7 @@ struct llama_context * llama_new_context_with_model(
 
     ctx->abort_callback      = params.abort_callback;
     ctx->abort_callback_data = params.abort_callback_data;
+    ctx->cpu_partition       = cpu_partition;
 
     ctx->sampling.rng = std::mt19937(params.seed);
     ctx->logits_all   = params.logits_all;
@@ -19928,7 +21016,7 @@ struct llama_context * llama_new_context_with_model(
             for (auto * backend : ctx->backends) {
                 if (ggml_backend_is_cpu(backend)) {
                     // use host buffers for the CPU backend compute buffer
-                    backend_buft.push_back(llama_default_buffer_type_cpu(true));
+                    backend_buft.push_back(llama_hugepage_buffer_type(llama_default_buffer_type_cpu(true), params.hugepages_compute));
                 } else {
                     backend_buft.push_back(ggml_backend_get_default_buffer_type(backend));
                 }
@@ -19956,6 +21044,14 @@ struct llama_context * llama_new_context_with_model(
                 LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(ctx->sched));
             }
 
+            if (cparams.output_head_rank > 0 && model->output_b) {
+                LLAMA_LOG_WARN("%s: the two-stage output head does not support an output bias, disabling it\n", __func__);
+            } else if (cparams.output_head_rank > 0 && model->output) {
+                std::lock_guard<std::mutex> lock(model->out_head_mutex);
+                llama_output_head_init(ctx->out_head, model->output, cparams.output_head_rank, cparams.output_head_top,
+                        cparams.output_head_min_mass, cparams.n_threads_batch, model->out_head_factors);
+            }
+
             // build worst-case graph
             int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_ubatch);
             int n_past = cparams.n_ctx - n_tokens;
@@ -20199,6 +21295,63 @@ int32_t llama_model_desc(const struct llama_model * model, char * buf, size_t bu
             llama_model_ftype_name(model->ftype).c_str());
 }
 
+// host tensors in the model file mappings, in the order in which the graph uses them
+static std::vector<llama_prefetch_range> llama_model_mmap_ranges(const llama_model & model) {
+    const int n_layer = model.hparams.n_layer;
+    std::vector<std::pair<int, llama_prefetch_range>> tensors;
+    for (const auto & it : model.tensors_by_name) {
+        const ggml_tensor * t = it.second;
+        if (!t->data || !t->buffer || !ggml_backend_buffer_is_host(t->buffer)) {
+            continue;
+        }
+        bool mapped = false;
+        for (const auto & mapping : model.mappings) {
+            const char * base = (const char *)mapping->addr();
+            if ((const char *)t->data >= base && (const char *)t->data < base + mapping->size()) {
+                mapped = true;
+                break;
+            }
+        }
+        if (!mapped) {
+            continue;
+        }
+        // layers in order, then the output tensors, then the token embeddings, of which a batch only uses a few rows
+        int order = n_layer;
+        int il;
+        const char * blk = strstr(it.first.c_str(), "blk.");
+        if (blk && sscanf(blk, "blk.%d.", &il) == 1) {
+            order = il;
+        } else if (it.first.rfind("token_embd", 0) == 0) {
+            order = n_layer + 1;
+        }
+        tensors.push_back({order, {(uint8_t *)t->data, ggml_nbytes(t)}});
+    }
+    std::stable_sort(tensors.begin(), tensors.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
+    std::vector<llama_prefetch_range> ranges;
+    ranges.reserve(tensors.size());
+    for (const auto & t : tensors) {
+        ranges.push_back(t.second);
+    }
+    return ranges;
+}
+
+void llama_model_prefetch(struct llama_model * model, bool wait) {
+    model->prefetcher.reset();
+    auto ranges = llama_model_mmap_ranges(*model);
+    if (ranges.empty()) {
+        return;
+    }
+    model->prefetcher.reset(new llama_prefetcher(std::move(ranges)));
+    if (wait) {
+        model->prefetcher->wait();
+    }
+}
+
+float llama_model_resident_fraction(const struct llama_model * model) {
+    return llama_prefetcher::resident_fraction(llama_model_mmap_ranges(*model));
+}
+
 uint64_t llama_model_size(const struct llama_model * model) {
     uint64_t size = 0;
     for (const auto & it : model->tensors_by_name) {
@@ -20287,7 +21440,7 @@ struct llama_lora_adapter * llama_lora_adapter_init(struct llama_model * model,
     }
 }
 
-static bool llama_control_vector_init(struct llama_control_vector & cvec, const llama_model & model) {
+static bool llama_control_vector_init(struct llama_control_vector & cvec, const llama_model & model, int64_t n_vectors) {
     GGML_ASSERT(cvec.tensors.empty());
     GGML_ASSERT(cvec.ctxs.empty());
     GGML_ASSERT(cvec.bufs.empty());
@@ -20310,7 +21463,7 @@ static bool llama_control_vector_init(struct llama_control_vector & cvec, const
         ggml_context * ctx = ggml_init(params);
         if (!ctx) {
             LLAMA_LOG_ERROR("%s: failed to allocate context for control vector\n", __func__);
-            return 1;
+            return false;
         }
         ctx_map[it.first] = ctx;
     }
@@ -20320,7 +21473,7 @@ static bool llama_control_vector_init(struct llama_control_vector & cvec, const
     cvec.tensors.push_back(nullptr); // there's never a tensor for layer 0
     for (size_t il = 1; il < model.hparams.n_layer; il++) {
         struct ggml_context * ctx = ctx_map.at(model.buft_layer[il].buft);
-        ggml_tensor * tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, model.hparams.n_embd);
+        ggml_tensor * tensor = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, model.hparams.n_embd, n_vectors);
         cvec.tensors.push_back(tensor);
     }
 
@@ -20330,54 +21483,147 @@ static bool llama_control_vector_init(struct llama_control_vector & cvec, const
     for (auto it : ctx_map) {
         ggml_backend_buffer_type_t buft = it.first;
         ggml_context * ctx = it.second;
+        cvec.ctxs.push_back(ctx);
+        if (ggml_get_first_tensor(ctx) == nullptr) {
+            // e.g. a single layer model, layer 0 has no control vector
+            continue;
+        }
         ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
         if (!buf) {
             LLAMA_LOG_ERROR("%s: failed to allocate buffer for control vector\n", __func__);
             return false;
         }
         ggml_backend_buffer_clear(buf, 0);
-        cvec.ctxs.push_back(ctx);
         cvec.bufs.push_back(buf);
     }
+    cvec.n_vectors = n_vectors;
 
     return true;
 }
 
-int32_t llama_control_vector_apply(struct llama_context * lctx, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+// writes the columns of all layers from the host copies, reallocating the tensors when the number of vectors changed
+static bool llama_control_vector_upload(struct llama_control_vector & cvec, const llama_model & model) {
+    const int64_t n_embd    = model.hparams.n_embd;
+    const int64_t n_layer   = model.hparams.n_layer;
+    const int64_t n_vectors = cvec.vectors.size();
+
+    if (cvec.tensors.empty() || cvec.n_vectors != n_vectors) {
+        cvec.free_buffers();
+        if (!llama_control_vector_init(cvec, model, n_vectors)) {
+            cvec.free_buffers();
+            return false;
+        }
+    }
+
+    const std::vector<float> & control = cvec.vectors[0];
+
+    std::vector<float> data(n_embd*n_vectors);
+    cvec.layer_used.assign(n_layer, false);
+    for (int64_t il = 1; il < n_layer; il++) {
+        const bool use_control = !control.empty() && il >= cvec.layer_start && il <= cvec.layer_end;
+        bool used = false;
+        for (int64_t k = 0; k < n_vectors; k++) {
+            const std::vector<float> & steering = cvec.vectors[k];
+            float * col = data.data() + k*n_embd;
+            for (int64_t j = 0; j < n_embd; j++) {
+                col[j] = (use_control ? control[il*n_embd + j] : 0.0f) + (k > 0 && !steering.empty() ? steering[il*n_embd + j] : 0.0f);
+                used = used || col[j] != 0.0f;
+            }
+        }
+        cvec.layer_used[il] = used;
+        ggml_backend_tensor_set(cvec.tensors[il], data.data(), 0, ggml_nbytes(cvec.tensors[il]));
+    }
+
+    return true;
+}
+
+// copies n_embd x n_layers floats starting from layer 1 into vector id, zero outside [il_start, il_end]
+static int32_t llama_control_vector_store(struct llama_context * lctx, int32_t id, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
     const llama_model & model = lctx->model;
     llama_control_vector & cvec = lctx->cvec;
 
+    if (n_embd != (int) model.hparams.n_embd) {
+        LLAMA_LOG_ERROR("%s: control vector n_embd does not match model\n", __func__);
+        return 1;
+    }
+
+    if ((size_t) id >= cvec.vectors.size()) {
+        cvec.vectors.resize(id + 1);
+    }
+
+    std::vector<float> & vec = cvec.vectors[id];
+    vec.assign(model.hparams.n_layer*n_embd, 0.0f);
+    for (size_t il = 1; il < model.hparams.n_layer; il++) {
+        const size_t off = n_embd * (il - 1); // buffer doesn't have data for layer 0, since it's never present
+        if (off + n_embd <= len && (int) il >= il_start && (int) il <= il_end) {
+            std::copy(data + off, data + off + n_embd, vec.begin() + il*n_embd);
+        }
+    }
+
+    return 0;
+}
+
+int32_t llama_control_vector_apply(struct llama_context * lctx, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+    llama_control_vector & cvec = lctx->cvec;
+
     if (data == nullptr) {
         // disable the current control vector (but leave allocated for later)
         cvec.layer_start = -1;
         cvec.layer_end   = -1;
-        return 0;
+        return cvec.vectors.empty() || llama_control_vector_upload(cvec, lctx->model) ? 0 : 1;
     }
 
-    if (n_embd != (int) model.hparams.n_embd) {
-        LLAMA_LOG_ERROR("%s: control vector n_embd does not match model\n", __func__);
+    // the range is applied when uploading, so that the vector can be enabled again
+    if (llama_control_vector_store(lctx, 0, data, len, n_embd, 0, lctx->model.hparams.n_layer) != 0) {
         return 1;
     }
 
-    if (cvec.tensors.empty()) {
-        if (!llama_control_vector_init(cvec, model)) {
-            return 1;
-        }
-    }
-
     cvec.layer_start = il_start;
     cvec.layer_end   = il_end;
 
-    for (size_t il = 1; il < model.hparams.n_layer; il++) {
-        assert(cvec.tensors[il] != nullptr);
+    return llama_control_vector_upload(cvec, lctx->model) ? 0 : 1;
+}
 
-        const size_t off = n_embd * (il - 1); // buffer doesn't have data for layer 0, since it's never present
-        if (off + n_embd <= len) {
-            ggml_backend_tensor_set(cvec.tensors[il], data + off, 0, n_embd * ggml_element_size(cvec.tensors[il]));
+int32_t llama_control_vector_set(struct llama_context * lctx, int32_t id, const float * data, size_t len, int32_t n_embd, int32_t il_start, int32_t il_end) {
+    llama_control_vector & cvec = lctx->cvec;
+
+    if (id <= 0) {
+        LLAMA_LOG_ERROR("%s: invalid steering vector id %d\n", __func__, id);
+        return 1;
+    }
+
+    if (data == nullptr) {
+        if ((size_t) id < cvec.vectors.size()) {
+            cvec.vectors[id].clear();
+            // drop trailing unused columns
+            while (cvec.vectors.size() > 1 && cvec.vectors.back().empty()) {
+                cvec.vectors.pop_back();
+            }
+            return llama_control_vector_upload(cvec, lctx->model) ? 0 : 1;
         }
+        return 0;
     }
 
-    return 0;
+    if (cvec.vectors.empty()) {
+        cvec.vectors.resize(1); // no control vector
+    }
+    if (llama_control_vector_store(lctx, id, data, len, n_embd, il_start, il_end) != 0) {
+        return 1;
+    }
+
+    return llama_control_vector_upload(cvec, lctx->model) ? 0 : 1;
+}
+
+void llama_control_vector_set_seq(struct llama_context * lctx, llama_seq_id seq_id, int32_t id) {
+    llama_control_vector & cvec = lctx->cvec;
+
+    if (seq_id < 0) {
+        return;
+    }
+    if ((size_t) seq_id >= cvec.seq_vector.size()) {
+        cvec.seq_vector.resize(seq_id + 1, 0);
+    }
+    cvec.seq_vector[seq_id] = std::max(id, 0);
 }
 
 struct llama_kv_cache_view llama_kv_cache_view_init(const struct llama_context * ctx, int32_t n_seq_max) {
@@ -20426,7 +21672,7 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
     int32_t max_contig_idx = -1;
 
     for (int32_t i = 0; i < int32_t(ctx->kv_self.size); i++, c_curr++, cs_curr += view->n_seq_max) {
-        const size_t curr_size = kv_cells[i].seq_id.size();
+        const size_t curr_size = kv_cells[i].n_seq_id();
         token_count += curr_size;
         c_curr->pos = kv_cells[i].pos + kv_cells[i].delta;
 
@@ -20441,7 +21687,10 @@ void llama_kv_cache_view_update(const struct llama_context * ctx, struct llama_k
         }
 
         int seq_idx = 0;
-        for (const llama_seq_id it : kv_cells[i].seq_id) {
+        for (llama_seq_id it = 0; it < LLAMA_MAX_SEQ; ++it) {
+            if (!kv_cells[i].has_seq_id(it)) {
+                continue;
+            }
             if (seq_idx >= view->n_seq_max) {
                 break;
             }
@@ -20473,7 +21722,7 @@ int32_t llama_get_kv_cache_token_count(const struct llama_context * ctx) {
     int result = 0;
 
     for (uint32_t i = 0; i < ctx->kv_self.size; i++) {
-        result += ctx->kv_self.cells[i].seq_id.size();
+        result += ctx->kv_self.cells[i].n_seq_id();
     }
 
     return result;
@@ -20498,6 +21747,12 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
     llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
 }
 
+int32_t llama_kv_cache_seq_cp_shift(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1, llama_pos delta) {
+    // the cache data may still be written by the last graph
+    ggml_backend_sched_synchronize(ctx->sched);
+    return llama_kv_cache_seq_cp_shift(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1, delta);
+}
+
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
 }
@@ -20527,7 +21782,7 @@ void llama_kv_cache_defrag(struct llama_context * ctx) {
 }
 
 int32_t llama_kv_cache_update(struct llama_context * ctx) {
-    return llama_kv_cache_update_internal(*ctx);
+    return llama_kv_cache_update_internal(*ctx, true);
 }
 
 // deprecated
@@ -20619,7 +21874,7 @@ struct llama_data_write {
         write(&logits_size, sizeof(logits_size));
 
         if (logits_size) {
-            write(ctx->logits, logits_size * sizeof(float));
+            write(ctx->logits_ext ? ctx->logits_ext : ctx->logits, logits_size * sizeof(float));
         }
     }
 
@@ -20639,14 +21894,16 @@ struct llama_data_write {
             for (uint32_t i = range.first; i < range.second; ++i) {
                 const auto & cell = kv_self.cells[i];
                 const llama_pos pos      = cell.pos;
-                const uint32_t  n_seq_id = seq_id == -1 ? cell.seq_id.size() : 0;
+                const uint32_t  n_seq_id = seq_id == -1 ? cell.n_seq_id() : 0;
 
                 write(&pos,      sizeof(pos));
                 write(&n_seq_id, sizeof(n_seq_id));
 
                 if (n_seq_id) {
-                    for (auto seq_id : cell.seq_id) {
-                        write(&seq_id, sizeof(seq_id));
+                    for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                        if (cell.has_seq_id(seq_id)) {
+                            write(&seq_id, sizeof(seq_id));
+                        }
                     }
                 }
             }
@@ -20852,6 +22109,7 @@ struct llama_data_read {
             throw std::runtime_error("logits buffer too small");
         }
 
+        ctx->logits_ext = nullptr;
         if (logits_size) {
             read_to(ctx->logits, logits_size * sizeof(float));
         }
@@ -20943,7 +22201,7 @@ struct llama_data_read {
                         return false;
                     }
 
-                    cell.seq_id.insert(seq_id);
+                    cell.add_seq_id(seq_id);
                 }
             }
 
@@ -21239,6 +22497,11 @@ struct llama_data_read_file : llama_data_read {
 static size_t llama_state_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx) {
     llama_synchronize(ctx);
 
+    // the saved K must not depend on pending shifts
+    if (ctx->cparams.lazy_k_shift && ctx->kv_self.has_shift) {
+        llama_kv_cache_update_internal(*ctx, true);
+    }
+
     data_ctx.write_model_info(ctx);
 
     data_ctx.write_rng(ctx->sampling.rng);
@@ -21384,6 +22647,10 @@ bool llama_state_save_file(struct llama_context * ctx, const char * path_session
 static size_t llama_state_seq_get_data_internal(struct llama_context * ctx, llama_data_write & data_ctx, llama_seq_id seq_id) {
     llama_synchronize(ctx);
 
+    if (ctx->cparams.lazy_k_shift && ctx->kv_self.has_shift) {
+        llama_kv_cache_update_internal(*ctx, true);
+    }
+
     data_ctx.write_kv_cache(ctx, seq_id);
 
     return data_ctx.get_size_written();
@@ -21528,6 +22795,18 @@ void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn) {
     ctx->cparams.causal_attn = causal_attn;
 }
 
+int32_t llama_set_output_vocab(struct llama_context * ctx, const llama_token * tokens, int32_t n_tokens) {
+    const int32_t n_vocab = ctx->model.hparams.n_vocab;
+    for (int32_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token %d, must be in [0, %d)\n", __func__, tokens[i], n_vocab);
+            return -1;
+        }
+    }
+    ctx->output_vocab.assign(tokens, tokens + std::max(0, n_tokens));
+    return 0;
+}
+
 struct llama_batch llama_batch_get_one(
              llama_token * tokens,
                  int32_t   n_tokens,
@@ -21634,7 +22913,7 @@ void llama_synchronize(struct llama_context * ctx) {
 float * llama_get_logits(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
-    return ctx->logits;
+    return ctx->logits_ext ? ctx->logits_ext : ctx->logits;
 }
 
 float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
@@ -21665,7 +22944,7 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
             throw std::runtime_error(format("corrupt output buffer (j=%d, n_outputs=%d)", j, ctx->n_outputs));
         }
 
-        return ctx->logits + j*ctx->model.hparams.n_vocab;
+        return (ctx->logits_ext ? ctx->logits_ext : ctx->logits) + j*ctx->model.hparams.n_vocab;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -21675,6 +22954,20 @@ float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
     }
 }
 
+const llama_token * llama_get_logits_candidates_ith(struct llama_context * ctx, int32_t i, int32_t * n_candidates) {
+    *n_candidates = 0;
+    if (llama_get_logits_ith(ctx, i) == nullptr) {
+        return nullptr;
+    }
+    const auto & head = ctx->out_head;
+    const int32_t j = i < 0 ? ctx->n_outputs + i : ctx->output_ids[i];
+    if (!head.enabled() || j >= (int32_t) head.approx.size() || !head.approx[j]) {
+        return nullptr;
+    }
+    *n_candidates = head.n_top;
+    return head.candidates.data() + size_t(j)*head.n_top;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     llama_synchronize(ctx);
 
@@ -0,0 +1,155 @@
+// a chunk spliced from the chunk cache must give the same logits as the chunk decoded at its position
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static std::vector<float> decode_next(llama_context * ctx, llama_token token, llama_seq_id seq_id, llama_pos pos) {
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    llama_batch_add(batch, token, pos, { seq_id }, true);
+    std::vector<float> logits;
+    if (llama_decode(ctx, batch) == 0) {
+        const float * data = llama_get_logits_ith(ctx, 0);
+        logits.assign(data, data + llama_n_vocab(llama_get_model(ctx)));
+    }
+    llama_batch_free(batch);
+    return logits;
+}
+
+static bool decode(llama_context * ctx, const std::vector<llama_token> & tokens, llama_seq_id seq_id, llama_pos pos) {
+    llama_batch batch = llama_batch_init(tokens.size(), 0, 1);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        llama_batch_add(batch, tokens[i], pos + i, { seq_id }, false);
+    }
+    const bool ok = llama_decode(ctx, batch) == 0;
+    llama_batch_free(batch);
+    return ok;
+}
+
+// counts the lazily shifted keys in the decode graphs
+static bool count_k_shifted(struct ggml_tensor * t, bool ask, void * user_data) {
+    if (ask && strncmp(t->name, "k_shifted", strlen("k_shifted")) == 0) {
+        ++*(int *) user_data;
+    }
+    return false;
+}
+
+// max abs difference relative to the range of the reference logits
+static float logits_error(const std::vector<float> & ref, const std::vector<float> & x) {
+    if (ref.empty() || ref.size() != x.size()) {
+        return INFINITY;
+    }
+    const auto range = std::minmax_element(ref.begin(), ref.end());
+    float max_err = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        max_err = std::max(max_err, std::fabs(ref[i] - x[i]));
+    }
+    return max_err / (*range.second - *range.first);
+}
+
+static int run(llama_model * model, bool lazy_k_shift) {
+    int n_k_shifted = 0;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx             = 256;
+    cparams.n_batch           = 64;
+    cparams.n_seq_max         = 4;
+    cparams.lazy_k_shift      = lazy_k_shift;
+    cparams.type_k            = GGML_TYPE_F32; // the shifted keys are not rounded to F16 again
+    cparams.cb_eval           = count_k_shifted;
+    cparams.cb_eval_user_data = &n_k_shifted;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr) {
+        fprintf(stderr, "failed to create the context\n");
+        return 1;
+    }
+
+    const int32_t n_vocab = llama_n_vocab(model);
+    std::vector<llama_token> chunk_a, chunk_b;
+    for (int i = 0; i < 24; ++i) {
+        chunk_a.push_back(100 + (i*37) % (n_vocab - 100));
+        chunk_b.push_back(200 + (i*53) % (n_vocab - 200));
+    }
+    const llama_token next = 42;
+    const llama_pos   pos  = 40;
+
+    // reference: the chunk decoded at [pos, pos + n) on its own
+    if (!decode(ctx, chunk_a, 0, pos)) {
+        fprintf(stderr, "failed to decode the reference\n");
+        return 1;
+    }
+    const std::vector<float> ref       = decode_next(ctx, next, 0, pos + chunk_a.size());
+    const std::vector<float> ref_again = decode_next(ctx, next, 0, pos + chunk_a.size() + 1);
+    llama_kv_cache_clear(ctx);
+
+    int n_fail = 0;
+    auto check = [&](const char * name, bool ok) {
+        printf("lazy_k_shift = %d, %-36s %s\n", lazy_k_shift, name, ok ? "OK" : "FAIL");
+        n_fail += !ok;
+    };
+
+    // sequences 2 and 3 hold the cached chunks
+    llama_chunk_cache cache;
+    check("init (out of range)", !llama_chunk_cache_init(ctx, cache, llama_n_seq_max(ctx) - 1, 2) &&
+                                 !llama_chunk_cache_init(ctx, cache, -1, 2));
+    check("init", llama_chunk_cache_init(ctx, cache, 2, 2));
+    check("append (cache sequence)", !llama_chunk_cache_append(ctx, cache, chunk_a, 2, pos, 0, cparams.n_batch));
+
+    // miss: prefilled at [0, n), then shifted to pos
+    check("append (miss)", llama_chunk_cache_append(ctx, cache, chunk_a, 0, pos, 0, cparams.n_batch));
+    // the K cache is in host memory, so the shift is applied in place also with lazy_k_shift, not by the graph
+    n_k_shifted = 0;
+    const std::vector<float> spliced = decode_next(ctx, next, 0, pos + chunk_a.size());
+    check("shift not applied by the decode graph", n_k_shifted == 0);
+    const float err = logits_error(ref, spliced);
+    printf("lazy_k_shift = %d, spliced chunk: logits error = %g\n", lazy_k_shift, err);
+    check("spliced chunk matches the reference", err < 1e-4f);
+
+    // the shifted keys stay in the cache for the following decodes
+    n_k_shifted = 0;
+    const std::vector<float> again = decode_next(ctx, next, 0, pos + chunk_a.size() + 1);
+    check("no shift in the following decode", n_k_shifted == 0);
+    check("next decode matches the reference", logits_error(ref_again, again) < 1e-4f);
+
+    // hit: the same chunk in another sequence
+    check("append (hit)", llama_chunk_cache_append(ctx, cache, chunk_a, 1, pos, 0, cparams.n_batch));
+    const std::vector<float> hit = decode_next(ctx, next, 1, pos + chunk_a.size());
+    check("hit matches the first splice", logits_error(spliced, hit) < 1e-3f);
+
+    check("append (second chunk)", llama_chunk_cache_append(ctx, cache, chunk_b, 1, pos + chunk_a.size() + 1, 4, cparams.n_batch));
+    check("hit and miss counts", cache.n_hit == 1 && cache.n_miss == 2 && cache.entries.size() == 2);
+
+    llama_chunk_cache_clear(ctx, cache);
+    check("clear", cache.entries.empty());
+
+    llama_free(ctx);
+    return n_fail;
+}
+
+int main(int argc, char ** argv) {
+    char * model_path = get_model_or_exit(argc, argv);
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "failed to load %s\n", model_path);
+        return EXIT_FAILURE;
+    }
+
+    int n_fail = 0;
+    n_fail += run(model, false);
+    n_fail += run(model, true);
+
+    llama_free_model(model);
+    llama_backend_free();
+
+    return n_fail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,155 @@
+// Checks that the data repacked by iqk_repack_tensor (compiled for the baseline ISA) is read correctly
+// by the iqk kernels of the selected variant. Set GGML_IQK_VARIANT to test a specific variant.
+
+#include "ggml.h"
+#include "iqk/iqk_mul_mat.h"
+#include "iqk/iqk_quantize.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic ignored "-Wdouble-promotion"
+#endif
+
+// same checks as iqk_dispatch.cpp, the dispatcher aborts if the forced variant cannot run on this CPU
+static bool forced_variant_supported(const char * name) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    const bool avx2   = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool avx512 = avx2 &&
+        __builtin_cpu_supports("avx512f")  && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vnni");
+    const bool zen4   = avx512 &&
+        __builtin_cpu_supports("avx512bf16") && __builtin_cpu_supports("avx512vbmi") &&
+        __builtin_cpu_supports("avx512vpopcntdq") && __builtin_cpu_supports("avx512bitalg");
+    if (strcmp(name, "avx2")   == 0) return avx2;
+    if (strcmp(name, "avx512") == 0) return avx512;
+    if (strcmp(name, "zen4")   == 0) return zen4;
+#endif
+    GGML_UNUSED(name);
+    return true;
+}
+
+// C = A*B, computed with a single thread
+static std::vector<float> mul_mat(ggml_tensor * a, ggml_tensor * b) {
+    ggml_init_params params = {
+        /* .mem_size   = */ 4*ggml_nbytes(b) + 4*ggml_tensor_overhead() + ggml_graph_overhead() + (1 << 20),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * c = ggml_mul_mat(ctx, a, b);
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, c);
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    std::vector<float> res((const float *) c->data, (const float *) c->data + ggml_nelements(c));
+    ggml_free(ctx);
+    return res;
+}
+
+// max |x - y| relative to the rms of y
+static double rel_error(const std::vector<float> & x, const std::vector<float> & y) {
+    double max_diff = 0, sumy2 = 0;
+    for (size_t i = 0; i < y.size(); ++i) {
+        max_diff = std::max(max_diff, (double) std::fabs(x[i] - y[i]));
+        sumy2 += y[i]*y[i];
+    }
+    return max_diff / std::sqrt(sumy2/y.size() + 1e-20);
+}
+
+int main(void) {
+    const char * forced = getenv("GGML_IQK_VARIANT");
+    if (forced && !forced_variant_supported(forced)) {
+        printf("iqk variant %s is not supported by this CPU, skipping\n", forced);
+        return 0;
+    }
+
+    const int  features = iqk_kernel_features();
+    const bool fancy    = features & IQK_FEATURE_FANCY_SIMD;
+    const bool bf16_r16 = features & IQK_FEATURE_BF16_R16;
+    printf("iqk kernel features: %d\n", features);
+
+    const int64_t n_per_row = 512;
+    const int64_t n_rows    = 32;
+
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist;
+
+    std::vector<float> weights(n_per_row*n_rows);
+    for (auto & x : weights) x = dist(rng);
+
+    ggml_init_params params = {
+        /* .mem_size   = */ 64*1024*1024,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+    ggml_context * ctx = ggml_init(params);
+
+    ggml_tensor * a_f32 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, n_rows);
+    memcpy(a_f32->data, weights.data(), ggml_nbytes(a_f32));
+
+    int n_fail = 0;
+
+    for (int64_t n_cols : { 1, 2, 8, 33 }) {
+        ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, n_cols);
+        for (int64_t i = 0; i < ggml_nelements(b); ++i) {
+            ((float *) b->data)[i] = dist(rng);
+        }
+        const std::vector<float> c_f32 = mul_mat(a_f32, b);
+
+        // the repacked tensor must give the result of the dequantized weights
+        const ggml_type types[] = {
+            GGML_TYPE_Q4_0, GGML_TYPE_Q8_0, GGML_TYPE_Q8_KV, GGML_TYPE_Q4_K, GGML_TYPE_Q6_K,
+            GGML_TYPE_IQ4_XS, GGML_TYPE_IQ4_K, GGML_TYPE_BF16, GGML_TYPE_F16,
+        };
+        for (ggml_type type : types) {
+            ggml_tensor * a = ggml_new_tensor_2d(ctx, type, n_per_row, n_rows);
+            ggml_quantize_chunk(type, weights.data(), a->data, 0, n_rows, n_per_row, nullptr);
+
+            ggml_tensor * a_deq = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_per_row, n_rows);
+            for (int64_t row = 0; row < n_rows; ++row) {
+                ggml_internal_get_type_traits(type).to_float((const char *) a->data + row*a->nb[1], (float *) a_deq->data + row*n_per_row, n_per_row);
+            }
+            const std::vector<float> c_ref = mul_mat(a_deq, b);
+
+            ggml_tensor * a_rep = ggml_dup_tensor(ctx, a);
+            memcpy(a_rep->data, a->data, ggml_nbytes(a));
+            iqk_repack_tensor(a_rep);
+
+            // BF16_R16 is only used when the kernels can multiply it
+            const bool   repacked = a_rep->type != type;
+            const bool   expected = (type != GGML_TYPE_BF16 && type != GGML_TYPE_F16) || bf16_r16;
+            const double err      = rel_error(mul_mat(a_rep, b), c_ref);
+            const bool   ok       = repacked == expected && err < 5e-2;
+            printf("%-8s -> %-10s n_cols = %2d: error %.2e %s\n", ggml_type_name(type), ggml_type_name(a_rep->type),
+                    (int) n_cols, err, ok ? "OK" : "FAILED");
+            n_fail += !ok;
+        }
+
+        // Q8_K_R16 is quantized directly in the repacked layout and only has kernels with AVX512
+        if (fancy) {
+            ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_Q8_K_R16, n_per_row, n_rows);
+            ggml_quantize_chunk(GGML_TYPE_Q8_K_R16, weights.data(), a->data, 0, n_rows, n_per_row, nullptr);
+            const double err = rel_error(mul_mat(a, b), c_f32);
+            const bool   ok  = err < 5e-2;
+            printf("%-8s -> %-10s n_cols = %2d: error %.2e %s\n", "f32", ggml_type_name(GGML_TYPE_Q8_K_R16),
+                    (int) n_cols, err, ok ? "OK" : "FAILED");
+            n_fail += !ok;
+        }
+    }
+
+    ggml_free(ctx);
+
+    if (n_fail > 0) {
+        printf("%d checks failed\n", n_fail);
+        return 1;
+    }
+    return 0;
+}
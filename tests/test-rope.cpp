@@ -214,6 +214,47 @@ int main(int /*argc*/, const char ** /*argv*/) {
         }
     }
 
+    // rope with a precomputed table must match rope_ext
+    for (int m = 0; m < 2; ++m) {
+        const int ndims = 4;
+
+        const int64_t n_rot = 64;
+        const int64_t ne[4] = { 2*n_rot, 8, 37, 1 };
+
+        struct ggml_tensor * p = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, ne[2]);
+        struct ggml_tensor * f = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_rot/2);
+        for (int i = 0; i < ne[2]; ++i) {
+            ((int32_t *) p->data)[i] = 1000 + 7*i;
+        }
+        for (int i = 0; i < n_rot/2; ++i) {
+            ((float *) f->data)[i] = 1.0f + 0.1f*i;
+        }
+
+        // test mode 0, 2 (standard, GPT-NeoX)
+        const int mode = m == 0 ? 0 : 2;
+
+        x = get_random_tensor_f32(ctx0, ndims, ne, -1.0f, 1.0f);
+
+        struct ggml_tensor * r0 = ggml_rope_ext(ctx0, x, p, f, n_rot, mode, 4096, 10000.0f, 0.5f, 1.0f, 1.1f, 32.0f, 1.0f);
+        struct ggml_tensor * c  = ggml_rope_cache(ctx0, p, f, n_rot, mode, 4096, 10000.0f, 0.5f, 1.0f, 1.1f, 32.0f, 1.0f);
+        struct ggml_tensor * r1 = ggml_rope_fast(ctx0, x, c);
+
+        ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+        ggml_build_forward_expand(gf, r0);
+        ggml_build_forward_expand(gf, r1);
+
+        ggml_graph_compute_helper(work_buffer, gf, 4);
+
+        double diff = 0.0f;
+        for (int i = 0; i < ggml_nelements(r0); ++i) {
+            diff += fabs(((float *) r0->data)[i] - ((float *) r1->data)[i]);
+        }
+        printf("mode: %d, rope_fast diff: %f\n", mode, diff);
+
+        GGML_ASSERT(diff == 0.0);
+    }
+
     ggml_free(ctx0);
 
     return 0;
@@ -0,0 +1,186 @@
+// round trips of tensor data through an RPC server running in this process
+// with a model (argument or LLAMACPP_TEST_MODELFILE), also compares tensor parallel and CPU-only logits
+#include "ggml.h"
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml-rpc.h"
+#include "llama.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+static std::string start_server(int port) {
+    std::string endpoint = "127.0.0.1:" + std::to_string(port);
+    std::thread([endpoint] {
+        ggml_backend_t backend = ggml_backend_cpu_init();
+        ggml_backend_rpc_start_server(backend, endpoint.c_str(), nullptr, 1ull << 30, 1ull << 30);
+    }).detach();
+    return endpoint;
+}
+
+static ggml_backend_buffer_type_t connect(const std::string & endpoint) {
+    for (int i = 0; i < 100; ++i) {
+        ggml_backend_buffer_type_t buft = ggml_backend_rpc_buffer_type(endpoint.c_str());
+        if (buft) {
+            return buft;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return nullptr;
+}
+
+// sets and gets a [n_embd, n_rows] F32 tensor in a compute buffer, returns the max abs error
+static float round_trip(ggml_backend_buffer_type_t buft, const std::vector<float> & data, int64_t n_embd, bool input) {
+    const int64_t n_rows = data.size() / n_embd;
+    ggml_init_params params = { ggml_tensor_overhead(), nullptr, true };
+    ggml_context * ctx = ggml_init(params);
+    ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_rows);
+    if (input) {
+        ggml_set_input(t);
+    }
+    ggml_backend_buffer_t buf = ggml_backend_buft_alloc_buffer(buft, ggml_nbytes(t) + ggml_backend_buft_get_alignment(buft));
+    ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_COMPUTE);
+    ggml_backend_tensor_alloc(buf, t, ggml_backend_buffer_get_base(buf));
+
+    std::vector<float> result(data.size());
+    ggml_backend_tensor_set(t, data.data(), 0, ggml_nbytes(t));
+    ggml_backend_tensor_get(t, result.data(), 0, ggml_nbytes(t));
+
+    float max_err = 0.0f;
+    for (size_t i = 0; i < data.size(); ++i) {
+        // equal infinities are fine, NaN is not
+        float err = data[i] == result[i] ? 0.0f : std::fabs(data[i] - result[i]);
+        if (std::isnan(err)) {
+            err = INFINITY;
+        }
+        max_err = std::max(max_err, err);
+    }
+
+    ggml_backend_buffer_free(buf);
+    ggml_free(ctx);
+    return max_err;
+}
+
+static std::vector<float> last_logits(const char * model_path, const char * rpc_servers) {
+    llama_model_params mparams = llama_model_default_params();
+    std::vector<float> tensor_split(llama_max_devices(), 0.0f);
+    if (rpc_servers) {
+        // the repeating layers are split by rows over the server and the CPU, half each
+        tensor_split[0] = tensor_split[1] = 1.0f;
+        mparams.rpc_servers  = rpc_servers;
+        mparams.split_mode   = LLAMA_SPLIT_MODE_ROW;
+        mparams.n_gpu_layers = 999;
+        mparams.tensor_split = tensor_split.data();
+    }
+    std::vector<float> logits;
+    llama_model * model = llama_load_model_from_file(model_path, mparams);
+    if (model == nullptr) {
+        return logits;
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 128;
+    llama_context * ctx = llama_new_context_with_model(model, cparams);
+    if (ctx) {
+        std::vector<llama_token> tokens;
+        for (int i = 0; i < 64; ++i) {
+            tokens.push_back(1 + (i*97) % (llama_n_vocab(model) - 1));
+        }
+        // the batch is evaluated once, then one more token on top of the cache
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size() - 1, 0, 0)) == 0 &&
+            llama_decode(ctx, llama_batch_get_one(&tokens.back(), 1, tokens.size() - 1, 0)) == 0) {
+            const float * data = llama_get_logits_ith(ctx, -1);
+            logits.assign(data, data + llama_n_vocab(model));
+        }
+        llama_free(ctx);
+    }
+    llama_free_model(model);
+    return logits;
+}
+
+static int test_tensor_parallel(const char * model_path, const std::string & endpoint) {
+    const std::vector<float> ref = last_logits(model_path, nullptr);
+    const std::vector<float> tp  = last_logits(model_path, endpoint.c_str());
+    if (ref.empty() || tp.size() != ref.size()) {
+        printf("%-24s FAIL (could not evaluate the model)\n", "tensor parallel");
+        return 1;
+    }
+    // the partial sums are added in another order
+    float max_err = 0.0f, max_ref = 0.0f;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        max_err = std::max(max_err, std::fabs(ref[i] - tp[i]));
+        max_ref = std::max(max_ref, std::fabs(ref[i]));
+    }
+    const bool ok = max_err <= 1e-3f*max_ref;
+    printf("%-24s max error = %g (max logit %g) %s\n", "tensor parallel", max_err, max_ref, ok ? "OK" : "FAIL");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char ** argv) {
+    // the wire type is used only without shared memory
+    setenv("GGML_RPC_NO_SHM", "1", 1);
+    setenv("GGML_RPC_WIRE_TYPE", "q8_0", 1);
+
+    const std::string endpoint = start_server(20000 + getpid() % 20000);
+    ggml_backend_buffer_type_t buft = connect(endpoint);
+    if (!buft) {
+        fprintf(stderr, "failed to connect to %s\n", endpoint.c_str());
+        return EXIT_FAILURE;
+    }
+
+    const int64_t n_embd = 256;
+    const int64_t n_rows = 64;
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> activations(n_embd*n_rows);
+    for (auto & x : activations) {
+        x = dist(rng);
+    }
+
+    // causal mask
+    std::vector<float> mask(n_embd*n_rows);
+    for (int64_t i = 0; i < n_rows; ++i) {
+        for (int64_t j = 0; j < n_embd; ++j) {
+            mask[i*n_embd + j] = j <= i ? 0.0f : -INFINITY;
+        }
+    }
+
+    int n_fail = 0;
+    auto check = [&](const char * name, float err, float max_err) {
+        const bool ok = err <= max_err;
+        printf("%-24s max error = %g %s\n", name, err, ok ? "OK" : "FAIL");
+        n_fail += !ok;
+    };
+
+    // converted to q8_0 twice, each time within half a quantization step of the row maximum
+    check("activations (q8_0)",   round_trip(buft, activations, n_embd, false), 2.0f/127);
+    check("activations (input)",  round_trip(buft, activations, n_embd, true),  0.0f);
+    check("mask (-INF, input)",   round_trip(buft, mask,        n_embd, true),  0.0f);
+    // e.g. a copy of the mask made by the scheduler, without the input flag
+    check("mask (-INF, no flag)", round_trip(buft, mask,        n_embd, false), 0.0f);
+
+    const char * model_path = argc > 1 ? argv[1] : getenv("LLAMACPP_TEST_MODELFILE");
+    if (model_path && strlen(model_path) > 0) {
+        // the logits are compared with f32 activations
+        unsetenv("GGML_RPC_WIRE_TYPE");
+        const std::string endpoint_tp = start_server(20000 + (getpid() + 1) % 20000);
+        if (!connect(endpoint_tp)) {
+            fprintf(stderr, "failed to connect to %s\n", endpoint_tp.c_str());
+            return EXIT_FAILURE;
+        }
+        llama_backend_init();
+        n_fail += test_tensor_parallel(model_path, endpoint_tp);
+        llama_backend_free();
+    }
+
+    return n_fail == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}